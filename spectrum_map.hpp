@@ -16,14 +16,285 @@
 #include <cstdint>
 #include <vector>
 #include <string>
+#include <cstring>
+#include <charconv>
 #include <iterator>
 #include <algorithm>
 #include <cmath>
 #include <map>
 #include <set>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdio>
+#include <type_traits>
+#include <complex>
+#include <numbers>
+#include <random>
+#include <deque>
+#include <condition_variable>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <poll.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <linux/version.h>
+#include <sys/syscall.h>
+// The openat, statx, read and close requests arrived with the headers of Linux 5.6, older headers have io_uring without them. They are enumerators, not macros, so the
+// version of the headers is checked instead.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+#define SPECTRUM_MAP_IO_URING
+#endif
+#endif
+#endif
 
 namespace fs = std::filesystem;
 
+// ==================================================================================================== //
+//                                          PROFILING                                                   //
+
+/**
+ * @brief Class to record how long the stages of the program take. It is disabled by default, and while it is disabled the scopes do not read the clock or record anything.
+ * Every stage is recorded as an event with its start, duration, thread, bytes read and written, files and the peak memory of the process when it finished.
+ */
+class profiler
+{
+public:
+    /**
+     * @brief Stage recorded by a profile_scope.
+     */
+    struct event
+    {
+        std::string name;
+        int64_t start = 0;
+        int64_t duration = 0;
+        uint64_t thread = 0;
+        uint64_t bytes_read = 0;
+        uint64_t bytes_written = 0;
+        uint64_t files = 0;
+        uint64_t peak_rss = 0;
+    };
+
+    /**
+     * @brief Returns the profiler shared by the whole program.
+     */
+    static profiler &instance()
+    {
+        static profiler shared;
+        return shared;
+    }
+
+    /**
+     * @brief Starts recording. The times of the events are measured from this call.
+     */
+    void enable()
+    {
+        origin = std::chrono::steady_clock::now();
+        active.store(true, std::memory_order_relaxed);
+    }
+
+    bool enabled() const
+    {
+        return active.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Nanoseconds since the profiler was enabled.
+     */
+    int64_t now() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+    }
+
+    /**
+     * @brief Adds an event, called by profile_scope. Safe to call from several threads.
+     *
+     * @param recorded Event with the name, times and amounts of data. The thread and the peak memory are added here.
+     */
+    void record(event recorded)
+    {
+        recorded.peak_rss = peak_rss();
+        std::lock_guard<std::mutex> lock(events_mutex);
+        std::map<std::thread::id, uint64_t>::iterator thread = threads.try_emplace(std::this_thread::get_id(), threads.size()).first;
+        recorded.thread = thread->second;
+        events.push_back(recorded);
+    }
+
+    /**
+     * @brief Returns the peak resident memory of the process in kilobytes, 0 if the system does not provide it.
+     */
+    static uint64_t peak_rss()
+    {
+#if defined(__APPLE__)
+        rusage usage;
+        return getrusage(RUSAGE_SELF, &usage) == 0 ? static_cast<uint64_t>(usage.ru_maxrss) / 1024 : 0;
+#elif defined(__unix__)
+        rusage usage;
+        return getrusage(RUSAGE_SELF, &usage) == 0 ? static_cast<uint64_t>(usage.ru_maxrss) : 0;
+#else
+        return 0;
+#endif
+    }
+
+    /**
+     * @brief Prints one line per stage with the amount of calls, the time added over all the calls and threads, the data read and written, the files and the peak memory.
+     *
+     * @param output Stream where the table is printed.
+     */
+    void write_table(std::ostream &output)
+    {
+        struct summary
+        {
+            uint64_t calls = 0;
+            int64_t duration = 0;
+            uint64_t bytes_read = 0;
+            uint64_t bytes_written = 0;
+            uint64_t files = 0;
+            uint64_t peak_rss = 0;
+            int64_t first = 0;
+        };
+        std::lock_guard<std::mutex> lock(events_mutex);
+        std::map<std::string, summary> stages;
+        for (std::vector<event>::const_iterator e = events.begin(); e < events.end(); e++)
+        {
+            summary &stage = stages[e->name];
+            if (stage.calls == 0)
+                stage.first = e->start;
+            stage.calls++;
+            stage.duration += e->duration;
+            stage.bytes_read += e->bytes_read;
+            stage.bytes_written += e->bytes_written;
+            stage.files += e->files;
+            stage.peak_rss = std::max(stage.peak_rss, e->peak_rss);
+            stage.first = std::min(stage.first, e->start);
+        }
+        // The stages are listed in the order they started.
+        std::vector<std::pair<std::string, summary>> ordered(stages.begin(), stages.end());
+        std::sort(ordered.begin(), ordered.end(), [](const std::pair<std::string, summary> &a, const std::pair<std::string, summary> &b)
+                  { return a.second.first < b.second.first; });
+
+        char line[160];
+        std::snprintf(line, sizeof(line), "%-22s %10s %12s %12s %12s %10s %12s\n", "stage", "calls", "time (s)", "read (MB)", "written (MB)", "files", "peak RSS (MB)");
+        output << line;
+        for (std::vector<std::pair<std::string, summary>>::const_iterator s = ordered.begin(); s < ordered.end(); s++)
+        {
+            std::snprintf(line, sizeof(line), "%-22s %10llu %12.6f %12.3f %12.3f %10llu %12.1f\n", s->first.c_str(), static_cast<unsigned long long>(s->second.calls),
+                          static_cast<double>(s->second.duration) / 1e9, static_cast<double>(s->second.bytes_read) / 1e6, static_cast<double>(s->second.bytes_written) / 1e6,
+                          static_cast<unsigned long long>(s->second.files), static_cast<double>(s->second.peak_rss) / 1024);
+            output << line;
+        }
+        std::snprintf(line, sizeof(line), "%-22s %10s %12.6f %12s %12s %10s %12.1f\n", "total wall time", "", static_cast<double>(now()) / 1e9, "", "", "", static_cast<double>(peak_rss()) / 1024);
+        output << line;
+    }
+
+    /**
+     * @brief Writes the events in the Chrome trace event format, which can be opened with chrome://tracing or https://ui.perfetto.dev.
+     *
+     * @param filename Name of the JSON file.
+     */
+    void write_trace(const std::string &filename)
+    {
+        std::lock_guard<std::mutex> lock(events_mutex);
+        std::ofstream output(filename, std::ios::binary);
+        if (!output.is_open())
+            throw std::invalid_argument("Error creating the profile file " + filename);
+        std::string buffer = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        char line[512];
+        for (size_t i = 0; i < events.size(); i++)
+        {
+            const event &e = events[i];
+            std::snprintf(line, sizeof(line), "{\"name\": \"%s\", \"cat\": \"spectrumview\", \"ph\": \"X\", \"pid\": 1, \"tid\": %llu, \"ts\": %.3f, \"dur\": %.3f, "
+                                              "\"args\": {\"bytes_read\": %llu, \"bytes_written\": %llu, \"files\": %llu, \"peak_rss_kb\": %llu}}%s\n",
+                          e.name.c_str(), static_cast<unsigned long long>(e.thread), static_cast<double>(e.start) / 1e3, static_cast<double>(e.duration) / 1e3,
+                          static_cast<unsigned long long>(e.bytes_read), static_cast<unsigned long long>(e.bytes_written), static_cast<unsigned long long>(e.files),
+                          static_cast<unsigned long long>(e.peak_rss), i + 1 < events.size() ? "," : "");
+            buffer += line;
+        }
+        buffer += "]}\n";
+        output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        output.close();
+        if (!output)
+            throw std::invalid_argument("Error writing the profile file " + filename);
+    }
+
+private:
+    profiler() = default;
+
+    std::atomic<bool> active{false};
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    std::mutex events_mutex;
+    std::vector<event> events;
+    std::map<std::thread::id, uint64_t> threads;
+};
+
+/**
+ * @brief Records the time between its construction and its destruction as an event of the profiler, if the profiler is enabled. The amounts of data are added while the stage runs.
+ * Every event takes the lock of the profiler, so a scope should cover a whole stage and not the work of a single file.
+ */
+class profile_scope
+{
+public:
+    /**
+     * @brief Construct a new profile scope object and starts the clock.
+     *
+     * @param name Name of the stage, it must be a text that lives until the end of the program.
+     */
+    profile_scope(const char *name) : active(profiler::instance().enabled())
+    {
+        if (!active)
+            return;
+        recorded.name = name;
+        recorded.start = profiler::instance().now();
+    }
+
+    profile_scope(const profile_scope &) = delete;
+    profile_scope &operator=(const profile_scope &) = delete;
+
+    ~profile_scope()
+    {
+        if (!active)
+            return;
+        recorded.duration = profiler::instance().now() - recorded.start;
+        profiler::instance().record(std::move(recorded));
+    }
+
+    void add_read(const uint64_t &bytes)
+    {
+        recorded.bytes_read += bytes;
+    }
+
+    void add_written(const uint64_t &bytes)
+    {
+        recorded.bytes_written += bytes;
+    }
+
+    void add_files(const uint64_t &files)
+    {
+        recorded.files += files;
+    }
+
+private:
+    bool active = false;
+    profiler::event recorded;
+};
+
 // ==================================================================================================== //
 //                                        INPUT FUNCTIONS                                               //
 
@@ -36,94 +307,160 @@ namespace fs = std::filesystem;
  */
 std::vector<fs::path> opendirectory(const std::string &path)
 {
+    profile_scope scope("opendirectory");
     fs::path p = path;
     std::vector<fs::path> directory;
     try
     {
         for (fs::directory_entry const &dir_entry : fs::directory_iterator{p})
             directory.push_back(dir_entry.path());
+        scope.add_files(directory.size());
     }
     catch (fs::filesystem_error const &ex)
     {
-        std::cout << "Input path error: " << ex.code().message();
-        exit(0);
+        throw std::invalid_argument("Input path error: " + ex.code().message());
     }
     return directory;
 }
 
 /**
- * @brief Reads an individual data file to create the containers for the energy/frequency or intensity axis.
+ * @brief Checks that a value read from a data file only contains digits, a negation '-' at the beginning and at most a single point '.' for a float.
  *
- * @param path The path to the file where the information will be extracted. If you are using spectrumview, the program creates this path.
- * @param axis The axis to be returned. Can be either "energy" or "intensity".
- * @return Returns a vector containing the energy or intensity values. If an error occurs, terminates the program.
+ * @param first Pointer to the first character of the value.
+ * @param last Pointer past the last character of the value.
+ * @param path The path to the file being read, used for the error messages.
  */
-std::vector<double> readfile(const fs::path &path, const std::string &axis)
+void validate_value(const char *first, const char *last, const fs::path &path)
 {
-    std::ifstream path_input(path);
-    if (!path_input.is_open())
-    {
-        std::cout << "Can't open a file!:" << path.string();
-        exit(0);
-    }
-
-    std::string line;
-    std::vector<double> axis_container;
-    while (getline(path_input, line))
+    if (first == last)
+        throw std::invalid_argument("File " + path.string() + " is missing one or more values in a column or may be empty.");
+    if (*first == '-')
+        first++;
+    bool point = false;
+    for (const char *c = first; c < last; c++)
     {
-        for (const char &c : line)
-        {
-            if (isalpha(c))
-            {
-                throw std::invalid_argument("Error reading the file " + path.string() + ": Eliminate alphabetic characters from the energy values.");
-            }
-            else if (ispunct(c))
-            {
-                if (c == '-' or c == '.')
-                    continue;
-                else
-                    throw std::invalid_argument("Error reading the file " + path.string() + ": Eliminate punctuation characters. Only negation '-' at the beginning or a single point '.' for a float are allowed.");
-            }
-            else if (isspace(c) and std::count(line.begin(), line.end(), ' ') != 1)
-            {
-                throw std::invalid_argument("Error reading the file " + path.string() + ": Eliminate spaces within the values or eliminate additional values, each line should have only a pair of values separated by spaces.");
-            }
-        }
-        uint64_t tab = line.find(' ');
-        if (std::count(line.begin(), line.end(), ' ') > 1)
-        {
+        if (*c >= '0' and *c <= '9')
+            continue;
+        else if (*c == '.' and !point)
+            point = true;
+        else if (isalpha(static_cast<unsigned char>(*c)))
+            throw std::invalid_argument("Error reading the file " + path.string() + ": Eliminate alphabetic characters from the energy values.");
+        else if (*c == ' ' or *c == '\t')
             throw std::invalid_argument("Error reading the file " + path.string() + ". There might be more than two elements per line or spaces at the end of a line");
-            exit(0);
-        }
-        else if (tab == line.size() - 1 or tab == std::string::npos)
-        {
-            std::cout << "File " + path.string() + " is missing one or more values in a column or may be empty.";
-            exit(0);
-        }
-        if (!axis.find("energy"))
-        {
-            std::string energy = line.substr(0, tab);
-            if ((energy.find('-') != 0 and energy.find('-') != std::string::npos) or std::count(energy.begin(), energy.end(), '-') > 1 or std::count(energy.begin(), energy.end(), '.') > 1)
-                throw std::invalid_argument("Error reading the file " + path.string() + ": Eliminate punctuation characters. Only negation '-' at the beginning or a single point '.' for a float are allowed.");
-            else
-                axis_container.push_back(stod(energy));
-        }
-        else if (!axis.find("intensity"))
-        {
-            std::string intensity = line.substr(tab + 1, line.size());
-            if ((intensity.find('-') != 0 and intensity.find('-') != std::string::npos) or std::count(intensity.begin(), intensity.end(), '-') > 1 or std::count(intensity.begin(), intensity.end(), '.') > 1)
-                throw std::invalid_argument("Error reading the file " + path.string() + ": Eliminate punctuation characters. Only negation '-' at the beginning or a single point '.' for a float are allowed.");
-            else
-                axis_container.push_back(stod(intensity));
-        }
+        else
+            throw std::invalid_argument("Error reading the file " + path.string() + ": Eliminate punctuation characters. Only negation '-' at the beginning or a single point '.' for a float are allowed.");
     }
-    path_input.close();
-    if (axis_container.empty())
+}
+
+/**
+ * @brief Loads the whole content of a file with one block read.
+ *
+ * @param path The path to the file.
+ * @param buffer Container for the content, its previous content is replaced.
+ */
+void loadfile(const fs::path &path, std::string &buffer)
+{
+    std::ifstream path_input(path, std::ios::binary);
+    if (!path_input.is_open())
+        throw std::invalid_argument("Can't open a file!:" + path.string());
+    path_input.seekg(0, std::ios::end);
+    std::streamoff size = path_input.tellg();
+    path_input.seekg(0, std::ios::beg);
+    buffer.resize(size > 0 ? static_cast<size_t>(size) : 0);
+    if (size > 0 and !path_input.read(buffer.data(), size))
+        throw std::invalid_argument("Error reading the file " + path.string());
+}
+
+/**
+ * @brief Parses the content of a data file to fill both the energy/frequency and the intensity containers. Every line is validated while it is parsed and the values are converted
+ * with std::from_chars.
+ *
+ * @param content Content of the file, e.g. from loadfile or file_prefetcher.
+ * @param path The path to the file, used in the error messages.
+ * @param energy Container for the energy values, its previous content is replaced.
+ * @param intensity Container for the intensity values, its previous content is replaced. The values are parsed in double precision and stored with the type of the container, e.g. float to halve the memory of the spectra.
+ */
+template <typename Value>
+void parsespectrum(const std::string &content, const fs::path &path, std::vector<double> &energy, std::vector<Value> &intensity)
+{
+    static_assert(std::is_floating_point_v<Value>, "The intensities can only be stored as float, double or long double.");
+    const char *current = content.data();
+    const char *end = content.data() + content.size();
+    size_t lines = static_cast<size_t>(std::count(current, end, '\n')) + 1;
+    energy.clear();
+    intensity.clear();
+    energy.reserve(lines);
+    intensity.reserve(lines);
+
+    while (current < end)
     {
-        std::cout << "An error occurred while reading the file " + path.string() + ": File may be empty! ";
-        exit(0);
+        const char *line_end = static_cast<const char *>(std::memchr(current, '\n', static_cast<size_t>(end - current)));
+        if (line_end == nullptr)
+            line_end = end;
+        const char *next = line_end + (line_end < end ? 1 : 0);
+        if (line_end > current and *(line_end - 1) == '\r')
+            line_end--;
+
+        const char *separator = current;
+        while (separator < line_end and *separator != ' ' and *separator != '\t')
+            separator++;
+        if (separator == line_end or separator + 1 == line_end)
+            throw std::invalid_argument("File " + path.string() + " is missing one or more values in a column or may be empty.");
+
+        validate_value(current, separator, path);
+        validate_value(separator + 1, line_end, path);
+        double e = 0;
+        double i = 0;
+        auto [energy_end, energy_error] = std::from_chars(current, separator, e);
+        auto [intensity_end, intensity_error] = std::from_chars(separator + 1, line_end, i);
+        if (energy_error != std::errc() or energy_end != separator or intensity_error != std::errc() or intensity_end != line_end)
+            throw std::invalid_argument("Error reading the file " + path.string() + ": Eliminate punctuation characters. Only negation '-' at the beginning or a single point '.' for a float are allowed.");
+        energy.push_back(e);
+        intensity.push_back(static_cast<Value>(i));
+        current = next;
     }
-    return axis_container;
+
+    if (energy.empty())
+        throw std::invalid_argument("An error occurred while reading the file " + path.string() + ": File may be empty! ");
+}
+
+/**
+ * @brief Reads an individual data file in a single pass to fill both the energy/frequency and the intensity containers. The whole file is loaded with one block read
+ * and parsed with parsespectrum.
+ *
+ * @param path The path to the file where the information will be extracted. If you are using spectrumview, the program creates this path.
+ * @param energy Container for the energy values, its previous content is replaced.
+ * @param intensity Container for the intensity values, its previous content is replaced. The values are parsed in double precision and stored with the type of the container, e.g. float to halve the memory of the spectra.
+ * @return Returns the amount of bytes read from the file. If an error occurs, throws an invalid_argument exception.
+ */
+template <typename Value>
+uint64_t readspectrum(const fs::path &path, std::vector<double> &energy, std::vector<Value> &intensity)
+{
+    // The buffer is kept between calls so that reading a directory does not allocate once per file.
+    thread_local std::string buffer;
+    loadfile(path, buffer);
+    parsespectrum(buffer, path, energy, intensity);
+    return buffer.size();
+}
+
+/**
+ * @brief Reads an individual data file to create the containers for the energy/frequency or intensity axis. Kept for compatibility, readspectrum gets both axes in one pass.
+ *
+ * @param path The path to the file where the information will be extracted. If you are using spectrumview, the program creates this path.
+ * @param axis The axis to be returned. Can be either "energy" or "intensity".
+ * @return Returns a vector containing the energy or intensity values. If an error occurs, throws an invalid_argument exception.
+ */
+std::vector<double> readfile(const fs::path &path, const std::string &axis)
+{
+    std::vector<double> energy;
+    std::vector<double> intensity;
+    readspectrum(path, energy, intensity);
+    if (axis == "energy")
+        return energy;
+    else if (axis == "intensity")
+        return intensity;
+    else
+        throw std::invalid_argument("Specify axis of interest. Can only be 'energy' or 'intensity'");
 }
 
 /**
@@ -146,9 +483,9 @@ double findcoords(const fs::path &path, const std::string &coordinate)
     {
         for (std::string::iterator i = _x.begin(); i < _x.end(); i++)
         {
-            if (ispunct(*i))
+            if (ispunct(static_cast<unsigned char>(*i)))
                 throw std::invalid_argument("Unrecognized character for x position in file: " + path.string());
-            else if (isalpha(*i))
+            else if (isalpha(static_cast<unsigned char>(*i)))
             {
                 uint64_t start = _x.find(*i);
                 if (*i == 'p')
@@ -171,9 +508,9 @@ double findcoords(const fs::path &path, const std::string &coordinate)
     {
         for (std::string::iterator i = _y.begin(); i < _y.end(); i++)
         {
-            if (ispunct(*i))
+            if (ispunct(static_cast<unsigned char>(*i)))
                 throw std::invalid_argument("Unrecognized character for y position in file: " + path.string());
-            else if (isalpha(*i))
+            else if (isalpha(static_cast<unsigned char>(*i)))
             {
                 uint64_t start = _y.find(*i);
                 if (*i == 'p')
@@ -198,377 +535,3915 @@ double findcoords(const fs::path &path, const std::string &coordinate)
 
 //                                           End input functions
 // ====================================================================================================== //
-//                                           Begin class spectrum                                         //
+//                                        Begin extraction functions                                      //
+
 /**
- * @brief Class to store the information from the data files. Contains the energy, intensity and spatial location.
+ * @brief Limits of the integration window in an energy axis. Both limits are included in the sum. The rest of the members describe the axis where the window was found,
+ * so the same window can be reused for another spectrum with the same axis.
  */
-class spectrum
+struct integration_window
 {
+    size_t lower = 0;
+    size_t upper = 0;
+    size_t pos = 0;
+    size_t size = 0;
+    double energy = 0;
+    uint64_t channels = 0;
+    double pos_energy = 0;
+    double previous_energy = 0;
+};
 
-public:
-    /**
-     * @brief Construct a new spectrum object from a file
-     *
-     * @param path Takes the path to a file were the information will be extracted. If you are using spectrumview, the program creates this path.
-     */
-    spectrum(const fs::path &path)
+/**
+ * @brief Locates the nearest upper value of the requested energy in an energy axis and computes the limits of the integration window. If the window goes out of the axis only channels within the axis are considered.
+ * The energy axis must be sorted, the position is found with a binary search.
+ *
+ * @param energy_ax Energy axis of the spectra.
+ * @param energy Energy to be mapped.
+ * @param channels The amount of channels to integrate per side.
+ * @return Returns the limits of the window. If the energy is not in the axis, throws an invalid_argument exception.
+ */
+integration_window find_integration_window(const std::vector<double> &energy_ax, const double &energy, const uint64_t &channels)
+{
+    if (energy_ax.empty() or energy_ax[0] > energy or energy > energy_ax[energy_ax.size() - 1])
+        throw std::invalid_argument("Error: Requested energy value was not found. A file may not contain the energy value you requested.");
+    size_t pos = static_cast<size_t>(std::lower_bound(energy_ax.begin(), energy_ax.end(), energy) - energy_ax.begin());
+    integration_window window;
+    if (pos == 0 or channels > pos)
     {
-        energy_ax = readfile(path, "energy");
-        intensity = readfile(path, "intensity");
-        pos_x = findcoords(path, "x");
-        pos_y = findcoords(path, "y");
+        window.lower = 0;
+        window.upper = pos + channels + 1;
     }
-
-    /**
-     * @brief Extracts the intensity at a given energy by locating the nearest upper value and adding the intensities from contiguous specified amount of pixels. If energy is first or last value only channels within the axis are considered.
-     *
-     * @param energy Energy to be mapped.
-     * @param channels The amount of channels to integrate per side.
-     * @return Returns a long float with the result of the sum of the intensities for each channel that was considered.
-     */
-    double integrated_intensity(const double &energy, const uint64_t &channels)
+    else
     {
-        double integrated_intensity = 0;
-        size_t pos = 0;
-        size_t lower_limit;
-        size_t upper_limit;
-        if (energy_ax[0] > energy or energy > energy_ax[energy_ax.size() - 1])
-        {
-            std::cout << "Error: Requested energy value was not found. A file may not contain the energy value you requested.";
-            exit(0);
-        }
-        for (uint64_t i = 0; i < energy_ax.size(); i++)
-        {
-            if (energy_ax[i] >= energy)
-            {
-                pos = i;
-                break;
-            }
-        }
-        if (pos == 0 or channels > pos)
-        {
-            lower_limit = 0;
-            upper_limit = pos + channels + 1;
-        }
-        else if (pos == energy_ax.size() - 1 or ((pos + channels) >= energy_ax.size() - 1))
-        {
-            lower_limit = pos - channels;
-            upper_limit = energy_ax.size();
-        }
-        else
-        {
-            lower_limit = pos - channels;
-            upper_limit = pos + channels;
-        }
-        for (uint64_t i = lower_limit; i < upper_limit + 1; i++)
-        {
-            integrated_intensity += intensity.at(i);
-        }
-        return integrated_intensity;
+        window.lower = pos - channels;
+        window.upper = pos + channels;
     }
+    window.upper = std::min(window.upper, energy_ax.size() - 1);
+    window.pos = pos;
+    window.size = energy_ax.size();
+    window.energy = energy;
+    window.channels = channels;
+    window.pos_energy = energy_ax[pos];
+    window.previous_energy = pos > 0 ? energy_ax[pos - 1] : 0;
+    return window;
+}
 
-    /**
-     * @brief Extracts the intensity at a exact required energy by using linear interpolation to find the intensity from known values.
-     *
-     * @param energy Energy to be mapped.
-     * @return Returns a double with the intensity for the requested energy.
-     */
-    double interpolated_intensity(const double &energy)
-    {
-        double int_intensity = 0;
-        size_t pos = 0;
-        size_t lower_limit;
-        size_t upper_limit;
-        if (energy_ax[0] > energy or energy > energy_ax[energy_ax.size() - 1])
-        {
-            std::cout << "Error: Requested energy value was not found. A file may not contain the energy value you requested.";
-            exit(0);
-        }
-        for (uint64_t i = 0; i < energy_ax.size(); i++)
-        {
-            if (energy_ax[i] > energy)
-            {
-                pos = i;
-                break;
-            }
-        }
-        lower_limit = pos - 1;
-        upper_limit = pos + 1;
+/**
+ * @brief Reuses a previously found integration window if the energy axis has the same values around the requested energy, otherwise finds a new window. Since the axis is sorted, only
+ * the values next to the energy have to be compared, so the check does not depend on the length of the axis.
+ *
+ * @param energy_ax Energy axis of the spectrum.
+ * @param energy Energy to be mapped.
+ * @param channels The amount of channels to integrate per side.
+ * @param previous Window found for another spectrum. It is updated if a new window has to be found.
+ * @return Returns the limits of the window.
+ */
+integration_window find_integration_window(const std::vector<double> &energy_ax, const double &energy, const uint64_t &channels, integration_window &previous)
+{
+    if (previous.size == energy_ax.size() and previous.size > 0 and previous.energy == energy and previous.channels == channels and energy_ax[previous.pos] == previous.pos_energy and (previous.pos == 0 or energy_ax[previous.pos - 1] == previous.previous_energy))
+        return previous;
+    previous = find_integration_window(energy_ax, energy, channels);
+    return previous;
+}
 
-        int_intensity = intensity.at(lower_limit) + (((energy_ax.at(pos) - energy_ax.at(lower_limit)) * (intensity.at(upper_limit) - intensity.at(lower_limit))) / (energy_ax.at(upper_limit) - energy_ax.at(lower_limit)));
-        return int_intensity;
-    }
+/**
+ * @brief Adds the intensities inside an integration window. The sum is always kept in double precision, so a wide window of single precision intensities does not lose the small channels.
+ *
+ * @param intensity Pointer to the first intensity value of the spectrum, stored as float or double.
+ * @param window Limits of the window, comes from find_integration_window.
+ * @return Returns a long float with the result of the sum of the intensities within the window.
+ */
+template <typename Value>
+double window_sum(const Value *intensity, const integration_window &window)
+{
+    double integrated_intensity = 0;
+    for (size_t i = window.lower; i <= window.upper; i++)
+        integrated_intensity += intensity[i];
+    return integrated_intensity;
+}
 
-    /**
-     * @brief Prints either the x or the y coordinate as requested. This is handled by spectrumview.cpp.
-     *
-     * @param pos The coordinate of interest. Either "x" or "y".
-     * @return Returns a double with the ordinate or the abscissa.
-     */
-    double show_position(const std::string &pos)
-    {
-        double position;
-        if (pos == "x")
-        {
-            position = pos_x;
-            return position;
-        }
-        else if (pos == "y")
-        {
-            position = pos_y;
-            return position;
-        }
-        else
-            throw std::invalid_argument("Position can only be for x and y coordinates.");
-    }
+/**
+ * @brief Known values used to interpolate the intensity at a requested energy. The interpolated value is intensity[lower] + offset * (intensity[upper] - intensity[lower]) / span.
+ * The rest of the members describe the axis where the values were found, so they can be reused for another spectrum with the same axis.
+ */
+struct interpolation_point
+{
+    size_t lower = 0;
+    size_t upper = 0;
+    double offset = 0;
+    double span = 1;
+    size_t size = 0;
+    double energy = 0;
+    double lower_energy = 0;
+    double pos_energy = 0;
+    double upper_energy = 0;
+};
 
-private:
-    /**
-     * @brief Vector to store the energy/frequency values.
-     */
-    std::vector<double> energy_ax;
-    /**
-     * @brief Vector to store the intensity values.
-     */
-    std::vector<double> intensity;
-    /**
-     * @brief Variables to store the x-coordinate.
-     */
-    double pos_x = 0;
-    /**
-     * @brief Variables to store the y-coordinate.
-     */
-    double pos_y = 0;
+/**
+ * @brief Locates the known values around the requested energy in an energy axis to interpolate the intensity. The energy axis must be sorted, the position is found with a binary search.
+ *
+ * @param energy_ax Energy axis of the spectra.
+ * @param energy Energy to be mapped.
+ * @return Returns the indices and distances for the interpolation. If the energy can't be interpolated within the axis, throws an invalid_argument exception.
+ */
+interpolation_point find_interpolation_point(const std::vector<double> &energy_ax, const double &energy)
+{
+    if (energy_ax.empty() or energy_ax[0] > energy or energy > energy_ax[energy_ax.size() - 1])
+        throw std::invalid_argument("Error: Requested energy value was not found. A file may not contain the energy value you requested.");
+    size_t pos = static_cast<size_t>(std::upper_bound(energy_ax.begin(), energy_ax.end(), energy) - energy_ax.begin());
+    if (pos == 0 or pos + 1 >= energy_ax.size())
+        throw std::invalid_argument("Error: Requested energy value is too close to the limits of the energy axis to be interpolated.");
+    interpolation_point point;
+    point.lower = pos - 1;
+    point.upper = pos + 1;
+    point.offset = energy_ax[pos] - energy_ax[point.lower];
+    point.span = energy_ax[point.upper] - energy_ax[point.lower];
+    point.size = energy_ax.size();
+    point.energy = energy;
+    point.lower_energy = energy_ax[point.lower];
+    point.pos_energy = energy_ax[pos];
+    point.upper_energy = energy_ax[point.upper];
+    return point;
+}
+
+/**
+ * @brief Reuses previously found interpolation values if the energy axis has the same values around the requested energy, otherwise finds new ones. Since the axis is sorted, only
+ * the values next to the energy have to be compared, so the check does not depend on the length of the axis.
+ *
+ * @param energy_ax Energy axis of the spectrum.
+ * @param energy Energy to be mapped.
+ * @param previous Interpolation values found for another spectrum. They are updated if new values have to be found.
+ * @return Returns the indices and distances for the interpolation.
+ */
+interpolation_point find_interpolation_point(const std::vector<double> &energy_ax, const double &energy, interpolation_point &previous)
+{
+    if (previous.size == energy_ax.size() and previous.size > 0 and previous.energy == energy and energy_ax[previous.lower] == previous.lower_energy and energy_ax[previous.lower + 1] == previous.pos_energy and energy_ax[previous.upper] == previous.upper_energy)
+        return previous;
+    previous = find_interpolation_point(energy_ax, energy);
+    return previous;
+}
+
+/**
+ * @brief Computes the intensity from the known values of an interpolation point. The known values are converted to double before the difference is taken.
+ *
+ * @param intensity Pointer to the first intensity value of the spectrum, stored as float or double.
+ * @param point Indices and distances for the interpolation, comes from find_interpolation_point.
+ * @return Returns a double with the interpolated intensity.
+ */
+template <typename Value>
+double interpolate(const Value *intensity, const interpolation_point &point)
+{
+    double lower = intensity[point.lower];
+    double upper = intensity[point.upper];
+    return lower + ((point.offset * (upper - lower)) / point.span);
+}
+
+/**
+ * @brief Running values of a pass over an integration window, shared by the descriptors computed by describe_window.
+ */
+struct window_pass
+{
+    double sum = 0;
+    double weighted_energy = 0;
+    double maximum = 0;
+    size_t peak = 0;
 };
 
-//                                            End class spectrum                                          //
-//========================================================================================================//
-//                                            Begin class data_map                                        //
+/**
+ * @brief Descriptor with the sum of the intensities within the window, the same value as window_sum.
+ */
+struct integrated_descriptor
+{
+    static constexpr const char *name = "integrated";
+    static constexpr bool uses_sum = true;
+    static constexpr bool uses_peak = false;
+    static constexpr bool uses_centroid = false;
+
+    template <typename Value>
+    static double value(const window_pass &pass, const std::vector<double> &, const Value *, const integration_window &)
+    {
+        return pass.sum;
+    }
+};
 
 /**
- * @brief Class to create the energy map. Can provide a raw map with a "pixel" per point acquired, or a map with added pixels to improve aspect.
+ * @brief Descriptor with the highest intensity within the window.
  */
-class data_map
+struct peak_maximum_descriptor
 {
-public:
-    /**
-     * @brief Construct a new data map object. In spectrumview, a map with coordinates as keys is created to fill the raw map.
-     *
-     * @param keys The coordinates extracted from the file name for all the data files.
-     * @param intensity_fill The intensity values for a spectrum map associated with their respective coordinates.
-     */
-    data_map(const std::set<std::tuple<double, double>> &keys, const std::map<std::tuple<double, double>, double> &intensity_fill)
+    static constexpr const char *name = "peak-maximum";
+    static constexpr bool uses_sum = false;
+    static constexpr bool uses_peak = true;
+    static constexpr bool uses_centroid = false;
+
+    template <typename Value>
+    static double value(const window_pass &pass, const std::vector<double> &, const Value *, const integration_window &)
     {
-        if (keys.empty() or intensity_fill.empty())
+        return pass.maximum;
+    }
+};
+
+/**
+ * @brief Descriptor with the energy of the highest intensity within the window. If several channels have the highest intensity, the first one is used.
+ */
+struct peak_energy_descriptor
+{
+    static constexpr const char *name = "peak-energy";
+    static constexpr bool uses_sum = false;
+    static constexpr bool uses_peak = true;
+    static constexpr bool uses_centroid = false;
+
+    template <typename Value>
+    static double value(const window_pass &pass, const std::vector<double> &energy_ax, const Value *, const integration_window &)
+    {
+        return energy_ax[pass.peak];
+    }
+};
+
+/**
+ * @brief Descriptor with the centroid of the window: the energies weighted by their intensity. It is zero if the intensities of the window add to zero.
+ */
+struct centroid_descriptor
+{
+    static constexpr const char *name = "centroid";
+    static constexpr bool uses_sum = true;
+    static constexpr bool uses_peak = false;
+    static constexpr bool uses_centroid = true;
+
+    template <typename Value>
+    static double value(const window_pass &pass, const std::vector<double> &, const Value *, const integration_window &)
+    {
+        return pass.sum != 0 ? pass.weighted_energy / pass.sum : 0;
+    }
+};
+
+/**
+ * @brief Descriptor with the full width at half maximum of the highest peak of the window, measured from zero intensity. The channels are walked from the peak to both sides
+ * until the intensity drops to half the maximum, and the crossings are linearly interpolated. If a side does not drop within the window, the limit of the window is used.
+ * It is zero if the maximum is not positive.
+ */
+struct fwhm_descriptor
+{
+    static constexpr const char *name = "fwhm";
+    static constexpr bool uses_sum = false;
+    static constexpr bool uses_peak = true;
+    static constexpr bool uses_centroid = false;
+
+    template <typename Value>
+    static double value(const window_pass &pass, const std::vector<double> &energy_ax, const Value *intensity, const integration_window &window)
+    {
+        if (pass.maximum <= 0)
+            return 0;
+        double half = pass.maximum / 2;
+        size_t left = pass.peak;
+        while (left > window.lower and intensity[left - 1] > half)
+            left--;
+        size_t right = pass.peak;
+        while (right < window.upper and intensity[right + 1] > half)
+            right++;
+        // The channel outside the crossing is at or below half and the channel inside is above it, so the interpolation never divides by zero.
+        double left_energy = energy_ax[left];
+        if (left > window.lower)
         {
-            std::cout << "Error while processing the files";
-            exit(0);
+            double below = intensity[left - 1];
+            left_energy = energy_ax[left - 1] + (half - below) * (energy_ax[left] - energy_ax[left - 1]) / (intensity[left] - below);
         }
+        double right_energy = energy_ax[right];
+        if (right < window.upper)
+        {
+            double below = intensity[right + 1];
+            right_energy = energy_ax[right + 1] - (half - below) * (energy_ax[right + 1] - energy_ax[right]) / (intensity[right] - below);
+        }
+        return right_energy - left_energy;
+    }
+};
 
-        for (std::set<std::tuple<double, double>>::iterator i = keys.begin(); i != keys.end(); i++)
+/**
+ * @brief Computes several descriptors of a spectrum within an integration window with a single pass over the channels. The descriptors are given as template arguments, e.g.
+ * describe_window<peak_energy_descriptor, fwhm_descriptor>(energy_ax, intensity, window), and the pass only keeps the running values they use, so every combination is compiled
+ * into its own loop. New descriptors only need a struct with the same members as the ones above.
+ *
+ * @param energy_ax Energy axis of the spectrum.
+ * @param intensity Pointer to the first intensity value of the spectrum, stored as float or double.
+ * @param window Limits of the window, comes from find_integration_window.
+ * @return Returns an array with the value of every descriptor, in the order of the template arguments.
+ */
+template <typename... Descriptors, typename Value>
+std::array<double, sizeof...(Descriptors)> describe_window(const std::vector<double> &energy_ax, const Value *intensity, const integration_window &window)
+{
+    constexpr bool sum = (Descriptors::uses_sum or ...);
+    constexpr bool peak = (Descriptors::uses_peak or ...);
+    constexpr bool centroid = (Descriptors::uses_centroid or ...);
+    window_pass pass;
+    pass.peak = window.lower;
+    pass.maximum = intensity[window.lower];
+    for (size_t i = window.lower; i <= window.upper; i++)
+    {
+        double value = intensity[i];
+        if constexpr (sum)
+            pass.sum += value;
+        if constexpr (centroid)
+            pass.weighted_energy += value * energy_ax[i];
+        if constexpr (peak)
         {
-            x_handle.push_back(std::get<0>(*i));
-            y_handle.push_back(std::get<1>(*i));
+            if (value > pass.maximum)
+            {
+                pass.maximum = value;
+                pass.peak = i;
+            }
         }
+    }
+    return {Descriptors::value(pass, energy_ax, intensity, window)...};
+}
 
-        std::sort(x_handle.begin(), x_handle.end());
-        std::sort(y_handle.begin(), y_handle.end());
-        auto last_x = std::unique(x_handle.begin(), x_handle.end());
-        auto last_y = std::unique(y_handle.begin(), y_handle.end());
-        x_handle.erase(last_x, x_handle.end());
-        y_handle.erase(last_y, y_handle.end());
-        true_width = (uint32_t)x_handle.size();
-        true_length = (uint32_t)y_handle.size();
+/**
+ * @brief Pre-edge window where the power-law background A*E^-r is fitted, with the logarithm of the energy of every channel from the start of the window to the end of the axis.
+ * The sums of the logarithms within the window do not depend on the spectrum, so they are computed once and shared by the fits of all the spectra with the same axis. The rest of
+ * the members describe the axis where the window was found, so it can be reused for another spectrum with the same axis.
+ */
+struct background_window
+{
+    size_t lower = 0;
+    size_t upper = 0;
+    std::vector<double> log_energy;
+    double sum_x = 0;
+    double sum_xx = 0;
+    double first = 0;
+    double last = 0;
+    std::vector<double> energy;
+};
+
+/**
+ * @brief Locates the channels of a pre-edge window in an energy axis and computes the logarithms of the energies used by the fits and the subtraction.
+ *
+ * @param energy_ax Energy axis of the spectra, sorted in increasing order.
+ * @param first First energy of the pre-edge window, must be positive.
+ * @param last Last energy of the pre-edge window.
+ * @return Returns the window. If the window has less than two channels or a non positive energy, throws an invalid_argument exception.
+ */
+background_window find_background_window(const std::vector<double> &energy_ax, const double &first, const double &last)
+{
+    size_t lower = static_cast<size_t>(std::lower_bound(energy_ax.begin(), energy_ax.end(), first) - energy_ax.begin());
+    size_t end = static_cast<size_t>(std::upper_bound(energy_ax.begin(), energy_ax.end(), last) - energy_ax.begin());
+    if (end < lower + 2)
+        throw std::invalid_argument("Error: The background window needs at least two channels of the energy axis.");
+    if (energy_ax[lower] <= 0)
+        throw std::invalid_argument("Error: The background window can only have positive energies to fit a power law.");
+    background_window window;
+    window.lower = lower;
+    window.upper = end - 1;
+    window.first = first;
+    window.last = last;
+    window.energy.assign(energy_ax.begin() + static_cast<std::ptrdiff_t>(lower), energy_ax.end());
+    window.log_energy.resize(energy_ax.size() - lower);
+    for (size_t k = lower; k < energy_ax.size(); k++)
+        window.log_energy[k - lower] = std::log(energy_ax[k]);
+    for (size_t k = 0; k <= window.upper - lower; k++)
+    {
+        window.sum_x += window.log_energy[k];
+        window.sum_xx += window.log_energy[k] * window.log_energy[k];
+    }
+    return window;
+}
+
+/**
+ * @brief Reuses a previously found pre-edge window if the energy axis has the same values from the start of the window to the end, otherwise finds a new window. Comparing the
+ * energies is much cheaper than the logarithms of a new window.
+ *
+ * @param energy_ax Energy axis of the spectrum, sorted in increasing order.
+ * @param first First energy of the pre-edge window, must be positive.
+ * @param last Last energy of the pre-edge window.
+ * @param previous Window found for another spectrum. It is updated if a new window has to be found.
+ * @return Returns the window, previous itself.
+ */
+const background_window &find_background_window(const std::vector<double> &energy_ax, const double &first, const double &last, background_window &previous)
+{
+    bool reusable = !previous.energy.empty() and previous.first == first and previous.last == last and previous.lower + previous.energy.size() == energy_ax.size() and
+                    (previous.lower == 0 or energy_ax[previous.lower - 1] < first) and
+                    std::equal(previous.energy.begin(), previous.energy.end(), energy_ax.begin() + static_cast<std::ptrdiff_t>(previous.lower));
+    if (!reusable)
+        previous = find_background_window(energy_ax, first, last);
+    return previous;
+}
+
+/**
+ * @brief Parameters of a power-law background A*E^-r: the logarithm of A and the exponent r.
+ */
+struct power_law
+{
+    double log_amplitude = 0;
+    double exponent = 0;
+    bool fitted = false;
+};
 
-        for (uint64_t i = 1; i < x_handle.size(); i++)
+/**
+ * @brief Fits a power law to the pre-edge window of a spectrum with a linear least squares fit of log(I) against log(E). When all the intensities of the window are positive only
+ * the sums involving log(I) depend on the spectrum; otherwise the channels without a positive intensity are left out of the fit. The time is spent in std::log, which the compiler
+ * does not vectorize without -ffast-math, so the spectra are fitted one at a time: fitting blocks of spectra channel by channel, or in one pass with weights instead of the early
+ * exit, gave the same parameters but was slower.
+ *
+ * @param intensity Pointer to the first intensity value of the spectrum, stored as float or double.
+ * @param window Pre-edge window, comes from find_background_window.
+ * @return Returns the parameters of the power law. fitted is false if less than two channels have a positive intensity.
+ */
+template <typename Value>
+power_law fit_power_law(const Value *intensity, const background_window &window)
+{
+    double count = static_cast<double>(window.upper - window.lower + 1);
+    double sum_x = window.sum_x;
+    double sum_xx = window.sum_xx;
+    double sum_y = 0;
+    double sum_xy = 0;
+    bool positive = true;
+    for (size_t k = window.lower; k <= window.upper; k++)
+    {
+        if (!(intensity[k] > 0))
         {
-            uint32_t step_size = static_cast<uint32_t>(std::llround(x_handle.at(i) - x_handle.at(i - 1)));
-            x_step.push_back(step_size);
+            positive = false;
+            break;
         }
-
-        for (uint64_t i = 1; i < y_handle.size(); i++)
+        double y = std::log(static_cast<double>(intensity[k]));
+        sum_y += y;
+        sum_xy += window.log_energy[k - window.lower] * y;
+    }
+    if (!positive)
+    {
+        count = sum_x = sum_xx = sum_y = sum_xy = 0;
+        for (size_t k = window.lower; k <= window.upper; k++)
         {
-            uint32_t step_size = static_cast<uint32_t>(std::llround(y_handle.at(i) - y_handle.at(i - 1)));
-            y_step.push_back(step_size);
+            if (!(intensity[k] > 0))
+                continue;
+            double x = window.log_energy[k - window.lower];
+            double y = std::log(static_cast<double>(intensity[k]));
+            count++;
+            sum_x += x;
+            sum_xx += x * x;
+            sum_y += y;
+            sum_xy += x * y;
         }
+    }
+
+    power_law fit;
+    double determinant = count * sum_xx - sum_x * sum_x;
+    if (count < 2 or determinant <= 0)
+        return fit;
+    double slope = (count * sum_xy - sum_x * sum_y) / determinant;
+    fit.log_amplitude = (sum_y - slope * sum_x) / count;
+    fit.exponent = -slope;
+    fit.fitted = std::isfinite(fit.log_amplitude) and std::isfinite(fit.exponent);
+    return fit;
+}
+
+/**
+ * @brief Subtracts a power-law background from the channels of a spectrum, from the start of the pre-edge window to the end of the axis. The channels below the window are not changed.
+ *
+ * @param intensity Pointer to the first intensity value of the spectrum, stored as float or double.
+ * @param window Pre-edge window, comes from find_background_window.
+ * @param fit Parameters of the power law, comes from fit_power_law.
+ */
+template <typename Value>
+void subtract_power_law(Value *intensity, const background_window &window, const power_law &fit)
+{
+    for (size_t k = 0; k < window.log_energy.size(); k++)
+    {
+        double background = std::exp(fit.log_amplitude - fit.exponent * window.log_energy[k]);
+        intensity[window.lower + k] = static_cast<Value>(intensity[window.lower + k] - background);
+    }
+}
 
-        for (std::vector<double>::iterator i = y_handle.begin(); i < y_handle.end(); i++)
+//                                         End extraction functions
+// ====================================================================================================== //
+//                                         Begin alignment functions                                      //
+
+/**
+ * @brief Computes in place the discrete Fourier transform of a sequence with the iterative radix-2 Cooley-Tukey algorithm. The inverse transform is divided by the length,
+ * so a forward and an inverse transform give back the sequence.
+ *
+ * @param values Sequence to transform, its length must be a power of two.
+ * @param inverse True for the inverse transform.
+ */
+void fft(std::vector<std::complex<double>> &values, const bool &inverse)
+{
+    size_t n = values.size();
+    if (n == 0 or (n & (n - 1)) != 0)
+        throw std::invalid_argument("Error: The length of the Fourier transform must be a power of two.");
+    for (size_t i = 1, j = 0; i < n; i++)
+    {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+            std::swap(values[i], values[j]);
+    }
+    for (size_t length = 2; length <= n; length <<= 1)
+    {
+        double angle = (inverse ? 2 : -2) * std::numbers::pi / static_cast<double>(length);
+        for (size_t k = 0; k < length / 2; k++)
         {
-            for (std::vector<double>::iterator j = x_handle.begin(); j < x_handle.end(); j++)
+            std::complex<double> twiddle = std::polar(1.0, angle * static_cast<double>(k));
+            for (size_t i = k; i < n; i += length)
             {
-                std::tuple<double, double> coordinates = std::make_tuple(*j, *i);
-                if (intensity_fill.contains(coordinates))
-                    raw_map.push_back(intensity_fill.at(coordinates));
-                else
-                    raw_map.push_back(0);
+                std::complex<double> even = values[i];
+                std::complex<double> odd = values[i + length / 2] * twiddle;
+                values[i] = even + odd;
+                values[i + length / 2] = even - odd;
             }
         }
     }
+    if (inverse)
+    {
+        for (std::vector<std::complex<double>>::iterator v = values.begin(); v < values.end(); v++)
+            *v /= static_cast<double>(n);
+    }
+}
+
+/**
+ * @brief Channels of the zero-loss peak used to align the spectra, and the Fourier transform of the reference peak. The transforms have twice the length of the window rounded up
+ * to a power of two, so the circular correlation does not wrap the peak around.
+ */
+struct alignment_window
+{
+    size_t lower = 0;
+    size_t upper = 0;
+    double step = 0;
+    std::vector<std::complex<double>> reference;
+};
+
+/**
+ * @brief Locates the channels of the zero-loss peak in an energy axis and prepares the transforms for alignment_shift. The reference is set by the caller.
+ *
+ * @param energy_ax Energy axis of the spectra, sorted in increasing order with a constant step.
+ * @param first First energy of the window around the zero-loss peak.
+ * @param last Last energy of the window.
+ * @return Returns the window with an empty reference of the length of the transforms. If the window has less than three channels or the step of the axis is not constant (an energy
+ * more than a fifth of the step away from the uniform axis between the first and last energies), throws an invalid_argument exception.
+ */
+alignment_window find_alignment_window(const std::vector<double> &energy_ax, const double &first, const double &last)
+{
+    size_t lower = static_cast<size_t>(std::lower_bound(energy_ax.begin(), energy_ax.end(), first) - energy_ax.begin());
+    size_t end = static_cast<size_t>(std::upper_bound(energy_ax.begin(), energy_ax.end(), last) - energy_ax.begin());
+    if (end < lower + 3)
+        throw std::invalid_argument("Error: The alignment window needs at least three channels of the energy axis.");
+    // The shifts are measured and applied in channels, so they are only energies if every channel has the same width. The energies are compared with the uniform axis and not
+    // step by step, so the rounding of the energies written in the files is not taken as an irregular step.
+    double axis_step = (energy_ax.back() - energy_ax.front()) / static_cast<double>(energy_ax.size() - 1);
+    for (size_t k = 0; k < energy_ax.size(); k++)
+    {
+        if (std::abs(energy_ax[k] - (energy_ax.front() + static_cast<double>(k) * axis_step)) > 0.2 * axis_step)
+            throw std::invalid_argument("Error: The alignment needs an energy axis with a constant step, the shifts are measured in channels.");
+    }
+    alignment_window window;
+    window.lower = lower;
+    window.upper = end - 1;
+    window.step = (energy_ax[window.upper] - energy_ax[lower]) / static_cast<double>(window.upper - lower);
+    window.reference.assign(std::bit_ceil(2 * (end - lower)), 0);
+    return window;
+}
+
+/**
+ * @brief Estimates the shift of a spectrum against the reference of an alignment window from the maximum of their cross-correlation, computed with Fourier transforms.
+ * The position of the maximum is refined between channels with a parabola through the three highest values.
+ *
+ * @param intensity Pointer to the first intensity value of the spectrum, stored as float or double.
+ * @param window Alignment window with the transform of the reference.
+ * @param buffer Memory for the transform, resized to the length of the reference.
+ * @return Returns the shift in channels: positive if the peak of the spectrum is at higher energies than the peak of the reference.
+ */
+template <typename Value>
+double alignment_shift(const Value *intensity, const alignment_window &window, std::vector<std::complex<double>> &buffer)
+{
+    size_t n = window.reference.size();
+    buffer.assign(n, 0);
+    for (size_t k = window.lower; k <= window.upper; k++)
+        buffer[k - window.lower] = static_cast<double>(intensity[k]);
+    fft(buffer, false);
+    for (size_t k = 0; k < n; k++)
+        buffer[k] *= std::conj(window.reference[k]);
+    fft(buffer, true);
+
+    size_t peak = 0;
+    for (size_t k = 1; k < n; k++)
+    {
+        if (buffer[k].real() > buffer[peak].real())
+            peak = k;
+    }
+    double before = buffer[(peak + n - 1) % n].real();
+    double at = buffer[peak].real();
+    double after = buffer[(peak + 1) % n].real();
+    double curvature = before - 2 * at + after;
+    double refinement = curvature < 0 ? 0.5 * (before - after) / curvature : 0;
+    double lag = peak < n / 2 ? static_cast<double>(peak) : static_cast<double>(peak) - static_cast<double>(n);
+    return lag + refinement;
+}
+
+/**
+ * @brief Resamples a spectrum shifted by a number of channels onto the axis of the reference with linear interpolation: channel k takes the intensity at channel k + shift.
+ * Positions outside the spectrum take the intensity of the first or the last channel.
+ *
+ * @param intensity Pointer to the first intensity value of the spectrum, replaced by the resampled values.
+ * @param channels Amount of channels of the spectrum.
+ * @param shift Shift in channels, comes from alignment_shift.
+ * @param copy Memory for a copy of the spectrum.
+ */
+template <typename Value>
+void resample_shifted(Value *intensity, const size_t &channels, const double &shift, std::vector<double> &copy)
+{
+    copy.assign(intensity, intensity + channels);
+    double last = static_cast<double>(channels - 1);
+    for (size_t k = 0; k < channels; k++)
+    {
+        double position = std::clamp(static_cast<double>(k) + shift, 0.0, last);
+        size_t below = std::min(static_cast<size_t>(position), channels - 1);
+        size_t above = std::min(below + 1, channels - 1);
+        double fraction = position - static_cast<double>(below);
+        intensity[k] = static_cast<Value>(copy[below] + fraction * (copy[above] - copy[below]));
+    }
+}
+
+//                                          End alignment functions
+// ====================================================================================================== //
+//                                          Begin class mapped_file                                       //
 
+/**
+ * @brief Class to access the content of a binary file in memory. On Linux and macOS the file is memory-mapped, on other systems it is read with a single block read.
+ */
+class mapped_file
+{
+public:
     /**
-     * @brief Returns a vector with all the values for the abscissa and/or ordinate of the map.
+     * @brief Construct a new mapped file object.
      *
-     * @param axis Specify wether you want the file with the abscissa or the file of the ordinate.
-     * @return Returns a vector with all the values of the true coordinates in a specific direction.
+     * @param path Path to the file to be mapped.
      */
-    std::vector<double> show_axis(const std::string &axis)
+    mapped_file(const fs::path &path)
     {
-        if (axis == "x")
-            return x_handle;
-        else if (axis == "y")
-            return y_handle;
-        else
-            throw std::invalid_argument("Only axis 'x' or 'y' can be requested");
+#if defined(__unix__) || defined(__APPLE__)
+        int descriptor = ::open(path.c_str(), O_RDONLY);
+        if (descriptor < 0)
+            throw std::invalid_argument("Can't open a file!:" + path.string());
+        struct stat status;
+        if (::fstat(descriptor, &status) == 0 and status.st_size > 0)
+        {
+            void *address = ::mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, descriptor, 0);
+            if (address != MAP_FAILED)
+            {
+                mapped = static_cast<const char *>(address);
+                length = static_cast<size_t>(status.st_size);
+            }
+        }
+        ::close(descriptor);
+        if (mapped != nullptr)
+            return;
+#endif
+        std::ifstream input(path, std::ios::binary);
+        if (!input.is_open())
+            throw std::invalid_argument("Can't open a file!:" + path.string());
+        input.seekg(0, std::ios::end);
+        std::streamoff size = input.tellg();
+        input.seekg(0, std::ios::beg);
+        buffer.resize(size > 0 ? static_cast<size_t>(size) : 0);
+        if (size > 0 and !input.read(buffer.data(), size))
+            throw std::invalid_argument("Error reading the file " + path.string());
+        length = buffer.size();
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    ~mapped_file()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        if (mapped != nullptr)
+            ::munmap(const_cast<char *>(mapped), length);
+#endif
     }
 
     /**
-     * @brief Extracts the flattened matrix with the intensities extracted from the files respecting the dimensions of the experiment.
+     * @brief Provides access to the content of the file.
      *
-     * @return Returns a flattened matrix with the intensity values extracted from the map, doesn't consider if the step size varies.
+     * @return Returns a pointer to the first byte of the file.
      */
-    std::vector<double> show_raw()
+    const char *show_data() const
     {
-        std::vector<double> raw_image(raw_map.size());
-        for (uint64_t i = 0; i < raw_map.size(); i++)
-            raw_image[i] = raw_map[i];
-        return raw_image;
+        return mapped != nullptr ? mapped : buffer.data();
     }
 
     /**
-     * @brief Provides access to read the dimensions of raw image.
+     * @brief Provides the size of the file.
      *
-     * @param size_direction Specify wether the width or length is needed.
-     * @return Returns a 32-bit integer with the width or length measured in data points.
+     * @return Returns the amount of bytes in the file.
      */
-    std::uint32_t show_dimensions(const std::string &size_direction)
+    size_t show_size() const
     {
-        if (size_direction == "width")
-            return true_width;
-        else if (size_direction == "length")
-            return true_length;
-        else
-            throw std::invalid_argument("Can't access requested dimension.");
+        return length;
     }
 
+private:
+    const char *mapped = nullptr;
+    size_t length = 0;
+    std::vector<char> buffer;
+};
+
+//                                           End class mapped_file                                        //
+// ====================================================================================================== //
+//                                        Begin class directory_watcher                                   //
+
+/**
+ * @brief Class to follow the files that arrive to a directory during an acquisition. On Linux the directory is watched with inotify and a file is reported when it is closed after writing
+ * or moved into the directory. On other systems the directory is listed again after every wait and new or modified files are reported.
+ */
+class directory_watcher
+{
+public:
     /**
-     * @brief Creates a matrix with the intensities extracted from the files, and adds pixels to create a uniform pixel size and to allow the build of a BMP figure.
+     * @brief Construct a new directory watcher object. Files already in the directory are not reported, only the ones written after the construction.
      *
-     * @return Returns a vector with the flattened matrix with the intensity values extracted from the raw map. Creates a uniform spacing.
+     * @param path Path to the directory.
      */
-    std::vector<double> show_formatted_grid()
+    directory_watcher(const fs::path &path) : directory(path)
     {
-        if (x_handle.at(0) != 0 or y_handle.at(0) != 0)
-        {
-            std::cout << "Please note that if no point exists for coordinates (0,0), unusual behaviour may occur with the bitmap and formatted grid on this release." << '\n'
-                      << "Lost of information may occur!" << '\n'
-                      << "Future work will look for a way to fix such inconvenience." << '\n';
-        }
+#if defined(__linux__)
+        descriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (descriptor < 0 or inotify_add_watch(descriptor, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+            throw std::invalid_argument("Error watching the directory " + directory.string() + ": " + std::strerror(errno));
+#else
+        known = list_files();
+#endif
+    }
 
-        uint32_t width = (((uint32_t)x_handle.at((size_t)std::distance(x_handle.begin(), std::max_element(x_handle.begin(), x_handle.end()))) - (uint32_t)x_handle.at((size_t)std::distance(x_handle.begin(), std::min_element(x_handle.begin(), x_handle.end())))) / x_step.at((size_t)std::distance(x_step.begin(), std::min_element(x_step.begin(), x_step.end())))) + 1;
-        uint32_t length = (((uint32_t)y_handle.at((size_t)std::distance(y_handle.begin(), std::max_element(y_handle.begin(), y_handle.end()))) - (uint32_t)y_handle.at((size_t)std::distance(y_handle.begin(), std::min_element(y_handle.begin(), y_handle.end())))) / y_step.at((size_t)std::distance(y_step.begin(), std::min_element(y_step.begin(), y_step.end())))) + 1;
+    directory_watcher(const directory_watcher &) = delete;
+    directory_watcher &operator=(const directory_watcher &) = delete;
 
-        if (width % 4 != 0)
+    ~directory_watcher()
+    {
+#if defined(__linux__)
+        if (descriptor >= 0)
+            close(descriptor);
+#endif
+    }
+
+    /**
+     * @brief Waits until files arrive to the directory or the time runs out. Returns earlier, without files, if the process receives a signal.
+     *
+     * @param milliseconds Maximum time to wait.
+     * @return Returns the sorted paths of the new or modified files. If the system lost events, every file of the directory is returned.
+     */
+    std::vector<fs::path> wait(const int &milliseconds)
+    {
+        std::vector<fs::path> files;
+#if defined(__linux__)
+        pollfd request = {descriptor, POLLIN, 0};
+        if (poll(&request, 1, milliseconds) <= 0)
+            return files;
+        alignas(inotify_event) char events[1 << 16];
+        bool overflow = false;
+        for (ssize_t length = read(descriptor, events, sizeof(events)); length > 0; length = read(descriptor, events, sizeof(events)))
         {
-            width = (width + 4 - (width % 4));
+            for (char *position = events; position < events + length;)
+            {
+                const inotify_event *event = reinterpret_cast<const inotify_event *>(position);
+                if (event->mask & IN_Q_OVERFLOW)
+                    overflow = true;
+                else if (event->len > 0 and !(event->mask & IN_ISDIR))
+                    files.push_back(directory / event->name);
+                position += sizeof(inotify_event) + event->len;
+            }
         }
-        if (length % 4 != 0)
+        if (overflow)
         {
-            length = (length + 4 - (length % 4));
+            files.clear();
+            for (const fs::directory_entry &entry : fs::directory_iterator(directory))
+            {
+                if (entry.is_regular_file())
+                    files.push_back(entry.path());
+            }
         }
-
-        std::vector<uint32_t> x_pixel_step;
-        uint32_t accumulated = 0;
-        for (std::vector<uint32_t>::iterator i = x_step.begin(); i < x_step.end(); i++)
+#else
+        std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+        std::map<fs::path, fs::file_time_type> current = list_files();
+        for (std::map<fs::path, fs::file_time_type>::const_iterator f = current.begin(); f != current.end(); f++)
         {
-
-            uint32_t pixel_step = (*i * width) / ((uint32_t)x_handle.at((size_t)std::distance(x_handle.begin(), std::max_element(x_handle.begin(), x_handle.end()))) - (uint32_t)x_handle.at((size_t)std::distance(x_handle.begin(), std::min_element(x_handle.begin(), x_handle.end()))));
-            accumulated += pixel_step;
-            x_pixel_step.push_back(accumulated);
+            std::map<fs::path, fs::file_time_type>::const_iterator previous = known.find(f->first);
+            if (previous == known.end() or previous->second != f->second)
+                files.push_back(f->first);
         }
+        known.swap(current);
+#endif
+        std::sort(files.begin(), files.end());
+        files.erase(std::unique(files.begin(), files.end()), files.end());
+        return files;
+    }
 
-        std::vector<uint32_t> y_pixel_step;
-        accumulated = 0;
-        for (std::vector<uint32_t>::iterator i = y_step.begin(); i < y_step.end(); i++)
+private:
+#if defined(__linux__)
+    int descriptor = -1;
+#else
+    /**
+     * @brief Lists the regular files of the directory with their modification time.
+     */
+    std::map<fs::path, fs::file_time_type> list_files()
+    {
+        std::map<fs::path, fs::file_time_type> files;
+        for (const fs::directory_entry &entry : fs::directory_iterator(directory))
         {
-            uint32_t pixel_step = (*i * length) / ((uint32_t)y_handle.at((size_t)std::distance(y_handle.begin(), std::max_element(y_handle.begin(), y_handle.end()))) - (uint32_t)y_handle.at((size_t)std::distance(y_handle.begin(), std::min_element(y_handle.begin(), y_handle.end()))));
-            accumulated += pixel_step;
-            y_pixel_step.push_back(accumulated);
+            if (entry.is_regular_file())
+                files[entry.path()] = entry.last_write_time();
         }
+        return files;
+    }
 
-        std::vector<double> formatted_grid(width * length);
-        uint64_t m = 0;
-        uint64_t n = 0;
-        uint64_t raw_x = 0;
-        uint64_t raw_y = 0;
-        for (uint64_t i = 0; i < length; i++)
-        {
-            if (i == y_pixel_step[n])
-            {
-                raw_y++;
-                n++;
-            }
-            for (uint64_t j = 0; j < width; j++)
-            {
-                if (j == x_pixel_step[m])
+    std::map<fs::path, fs::file_time_type> known;
+#endif
+    fs::path directory;
+};
+
+//                                         End class directory_watcher                                    //
+// ====================================================================================================== //
+//                                         Begin class file_prefetcher                                    //
+
+#if defined(SPECTRUM_MAP_IO_URING)
+/**
+ * @brief Minimal io_uring instance made directly with the system calls, without liburing: the submission and completion rings are memory-mapped and the requests are written in them.
+ * A ring is only used by one thread.
+ */
+class io_ring
+{
+public:
+    /**
+     * @brief Construct a new io_ring object. If the kernel does not allow io_uring (too old, or disabled by a security policy) show_valid returns false.
+     *
+     * @param entries Amount of requests that can be submitted at once, a power of two.
+     */
+    io_ring(const unsigned &entries)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        descriptor = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (descriptor < 0)
+            return;
+        submission_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        completion_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_map)
+            submission_size = completion_size = std::max(submission_size, completion_size);
+        submission_ring = mmap(nullptr, submission_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, descriptor, IORING_OFF_SQ_RING);
+        completion_ring = single_map ? submission_ring : mmap(nullptr, completion_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, descriptor, IORING_OFF_CQ_RING);
+        requests_size = params.sq_entries * sizeof(io_uring_sqe);
+        void *requests_memory = mmap(nullptr, requests_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, descriptor, IORING_OFF_SQES);
+        if (submission_ring == MAP_FAILED or completion_ring == MAP_FAILED or requests_memory == MAP_FAILED)
+        {
+            if (requests_memory != MAP_FAILED)
+                munmap(requests_memory, requests_size);
+            if (!single_map and completion_ring != MAP_FAILED)
+                munmap(completion_ring, completion_size);
+            if (submission_ring != MAP_FAILED)
+                munmap(submission_ring, submission_size);
+            submission_ring = completion_ring = nullptr;
+            close(descriptor);
+            descriptor = -1;
+            return;
+        }
+        char *submission = static_cast<char *>(submission_ring);
+        submission_head = reinterpret_cast<unsigned *>(submission + params.sq_off.head);
+        submission_tail = reinterpret_cast<unsigned *>(submission + params.sq_off.tail);
+        submission_mask = *reinterpret_cast<unsigned *>(submission + params.sq_off.ring_mask);
+        submission_array = reinterpret_cast<unsigned *>(submission + params.sq_off.array);
+        char *completion = static_cast<char *>(completion_ring);
+        completion_head = reinterpret_cast<unsigned *>(completion + params.cq_off.head);
+        completion_tail = reinterpret_cast<unsigned *>(completion + params.cq_off.tail);
+        completion_mask = *reinterpret_cast<unsigned *>(completion + params.cq_off.ring_mask);
+        completions = reinterpret_cast<io_uring_cqe *>(completion + params.cq_off.cqes);
+        requests = static_cast<io_uring_sqe *>(requests_memory);
+        capacity = params.sq_entries;
+        tail = *submission_tail;
+    }
+
+    io_ring(const io_ring &) = delete;
+    io_ring &operator=(const io_ring &) = delete;
+
+    ~io_ring()
+    {
+        if (descriptor < 0)
+            return;
+        munmap(requests, requests_size);
+        if (completion_ring != submission_ring)
+            munmap(completion_ring, completion_size);
+        munmap(submission_ring, submission_size);
+        close(descriptor);
+    }
+
+    /**
+     * @brief Tells if the ring was created.
+     *
+     * @return Returns true if the ring can be used.
+     */
+    bool show_valid()
+    {
+        return descriptor >= 0;
+    }
+
+    /**
+     * @brief Reserves the next request of the submission ring, cleared, to be filled by the caller and sent with submit.
+     *
+     * @return Returns a pointer to the request. If the ring is full, throws an invalid_argument exception.
+     */
+    io_uring_sqe *request()
+    {
+        unsigned head = std::atomic_ref<unsigned>(*submission_head).load(std::memory_order_acquire);
+        if (tail - head >= capacity)
+            throw std::invalid_argument("Error: The submission ring of io_uring is full.");
+        unsigned slot = tail & submission_mask;
+        submission_array[slot] = slot;
+        io_uring_sqe *entry = requests + slot;
+        std::memset(entry, 0, sizeof(io_uring_sqe));
+        tail++;
+        prepared++;
+        return entry;
+    }
+
+    /**
+     * @brief Sends the prepared requests to the kernel.
+     */
+    void submit()
+    {
+        std::atomic_ref<unsigned>(*submission_tail).store(tail, std::memory_order_release);
+        while (prepared > 0)
+        {
+            long submitted = syscall(__NR_io_uring_enter, descriptor, prepared, 0, 0, nullptr, 0);
+            if (submitted < 0)
+            {
+                if (errno == EINTR or errno == EAGAIN)
+                    continue;
+                throw std::invalid_argument(std::string("Error submitting the reads to io_uring: ") + std::strerror(errno));
+            }
+            prepared -= static_cast<unsigned>(submitted);
+        }
+    }
+
+    /**
+     * @brief Waits for the next completed request.
+     *
+     * @return Returns the completion, with the user_data of the request and its result (negative errno if it failed).
+     */
+    io_uring_cqe complete()
+    {
+        io_uring_cqe entry;
+        while (true)
+        {
+            if (try_complete(entry))
+                return entry;
+            if (syscall(__NR_io_uring_enter, descriptor, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 and errno != EINTR)
+                throw std::invalid_argument(std::string("Error waiting for io_uring: ") + std::strerror(errno));
+        }
+    }
+
+    /**
+     * @brief Takes the next completed request without waiting.
+     *
+     * @param entry Filled with the completion, if there is one.
+     * @return Returns false if no request has completed yet.
+     */
+    bool try_complete(io_uring_cqe &entry)
+    {
+        unsigned head = std::atomic_ref<unsigned>(*completion_head).load(std::memory_order_relaxed);
+        if (head == std::atomic_ref<unsigned>(*completion_tail).load(std::memory_order_acquire))
+            return false;
+        entry = completions[head & completion_mask];
+        std::atomic_ref<unsigned>(*completion_head).store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    int descriptor = -1;
+    void *submission_ring = nullptr;
+    void *completion_ring = nullptr;
+    size_t submission_size = 0;
+    size_t completion_size = 0;
+    size_t requests_size = 0;
+    unsigned *submission_head = nullptr;
+    unsigned *submission_tail = nullptr;
+    unsigned *submission_array = nullptr;
+    unsigned submission_mask = 0;
+    unsigned *completion_head = nullptr;
+    unsigned *completion_tail = nullptr;
+    unsigned completion_mask = 0;
+    io_uring_cqe *completions = nullptr;
+    io_uring_sqe *requests = nullptr;
+    /**
+     * @brief Size of the submission ring, next free position and amount of requests prepared but not submitted.
+     */
+    unsigned capacity = 0;
+    unsigned tail = 0;
+    unsigned prepared = 0;
+};
+#endif
+
+/**
+ * @brief Content of a file read by file_prefetcher, with the position of the file in the list. If the file could not be read, error holds the exception of the failure.
+ */
+struct prefetched_file
+{
+    size_t index = 0;
+    std::string content;
+    std::exception_ptr error;
+};
+
+/**
+ * @brief Reads a list of files in the background, ahead of the threads that parse them. The files are handed out with next, in the order they finish, and at most depth files wait in
+ * memory, so reading and parsing overlap in a bounded pipeline. On Linux the files are opened, measured, read and closed with asynchronous io_uring requests from one thread, which
+ * keeps depth files in flight: as soon as a file is closed and handed out the next one is opened, so the kernel keeps reading while the files are delivered. If io_uring is not
+ * available, a few reader threads load the files with blocking reads.
+ */
+class file_prefetcher
+{
+public:
+    /**
+     * @brief Construct a new file prefetcher object and starts reading.
+     *
+     * @param paths Files to be read.
+     * @param depth Maximum amount of files read but not handed out yet, also the amount of files read at the same time with io_uring.
+     * @param use_io_uring False to use the reader threads even if io_uring is available.
+     */
+    file_prefetcher(const std::vector<fs::path> &paths, const size_t &depth = 64, const bool &use_io_uring = true) : files(paths), depth(std::max<size_t>(depth, 1))
+    {
+        producer = std::thread([this, use_io_uring]()
+                               {
+                                   profile_scope scope("prefetch");
+                                   try
+                                   {
+                                       size_t first = 0;
+#if defined(SPECTRUM_MAP_IO_URING)
+                                       if (use_io_uring)
+                                           first = read_with_io_uring();
+#endif
+                                       if (first < files.size())
+                                           read_with_threads(first);
+                                   }
+                                   catch (...)
+                                   {
+                                       std::lock_guard<std::mutex> lock(queue_mutex);
+                                       failure = std::current_exception();
+                                   }
+                                   std::lock_guard<std::mutex> lock(queue_mutex);
+                                   finished = true;
+                                   available.notify_all(); });
+    }
+
+    file_prefetcher(const file_prefetcher &) = delete;
+    file_prefetcher &operator=(const file_prefetcher &) = delete;
+
+    ~file_prefetcher()
+    {
+        cancel();
+        producer.join();
+    }
+
+    /**
+     * @brief Waits for the next file that was read. Several threads can call it at the same time.
+     *
+     * @param file Filled with the index and content of the file, or the error if it could not be read.
+     * @return Returns false when all the files were handed out or the reading was cancelled. If the reader failed, throws its exception once.
+     */
+    bool next(prefetched_file &file)
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        available.wait(lock, [&]()
+                       { return !ready.empty() or finished or cancelled; });
+        if (!ready.empty())
+        {
+            file = std::move(ready.front());
+            ready.pop_front();
+            space.notify_one();
+            return true;
+        }
+        if (failure and !cancelled)
+        {
+            std::exception_ptr error = failure;
+            failure = nullptr;
+            std::rethrow_exception(error);
+        }
+        return false;
+    }
+
+    /**
+     * @brief Stops reading. The files that were not handed out are dropped and next returns false.
+     */
+    void cancel()
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        cancelled = true;
+        ready.clear();
+        space.notify_all();
+        available.notify_all();
+    }
+
+    /**
+     * @brief Tells how the files are being read.
+     *
+     * @return Returns "io_uring" or "threads".
+     */
+    std::string show_backend()
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        return backend;
+    }
+
+private:
+    /**
+     * @brief Adds a file to the queue, waiting while depth files are already waiting.
+     *
+     * @return Returns false if the reading was cancelled.
+     */
+    bool deliver(prefetched_file &&file)
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        space.wait(lock, [&]()
+                   { return ready.size() < depth or cancelled; });
+        if (cancelled)
+            return false;
+        ready.push_back(std::move(file));
+        available.notify_one();
+        return true;
+    }
+
+    bool is_cancelled()
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        return cancelled;
+    }
+
+    /**
+     * @brief Reads the files from the first one with reader threads and blocking reads, each thread taking the next file of the list.
+     *
+     * @param first Index of the first file to be read.
+     */
+    void read_with_threads(const size_t &first)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            if (backend.empty())
+                backend = "threads";
+        }
+        std::atomic<size_t> next_file{first};
+        auto reader = [&]()
+        {
+            for (size_t i = next_file.fetch_add(1); i < files.size(); i = next_file.fetch_add(1))
+            {
+                prefetched_file file;
+                file.index = i;
+                try
+                {
+                    loadfile(files[i], file.content);
+                }
+                catch (...)
+                {
+                    file.error = std::current_exception();
+                }
+                if (!deliver(std::move(file)))
+                    return;
+            }
+        };
+        // A few threads are enough to keep several requests in flight, the parsing threads do the rest of the work.
+        size_t readers = std::clamp<size_t>(depth / 4, 1, 16);
+        std::vector<std::thread> pool;
+        for (size_t r = 1; r < readers; r++)
+            pool.emplace_back(reader);
+        reader();
+        for (std::thread &t : pool)
+            t.join();
+    }
+
+#if defined(SPECTRUM_MAP_IO_URING)
+    /**
+     * @brief State of a file read with io_uring: its descriptor, size, errors and the bytes read so far, with the amount of open and statx requests still in flight.
+     */
+    struct ring_file
+    {
+        int descriptor = -1;
+        struct statx size;
+        int open_error = 0;
+        int read_error = 0;
+        uint64_t done = 0;
+        unsigned waiting = 0;
+        prefetched_file file;
+    };
+
+    /**
+     * @brief Reads the files with io_uring, with up to depth files in flight. Every file goes through its own requests: open and statx at once, then the reads of the full file
+     * (requested again if the kernel returns less) and the close, and is handed out when its close completes. Its slot then opens the next file of the list, so the requests of
+     * the other files are in the kernel while a file waits for space in the queue.
+     *
+     * @return Returns the index of the first file that was not read, files.size() when all of them were read or the reading was cancelled. If io_uring can not be used, returns 0
+     * so all the files are read with threads.
+     */
+    size_t read_with_io_uring()
+    {
+        size_t slots = std::min<size_t>(std::min(depth, files.size()), 1024);
+        if (slots == 0)
+            return 0;
+        // A file has at most two requests in flight, its open and its statx.
+        io_ring ring(static_cast<unsigned>(std::bit_ceil(2 * slots)));
+        if (!ring.show_valid())
+            return 0;
+        // The user_data of a request is its slot times 4 plus the kind of request.
+        enum request_kind : uint64_t
+        {
+            open_kind,
+            size_kind,
+            read_kind,
+            close_kind
+        };
+        std::vector<ring_file> states(slots);
+        std::vector<size_t> free_slots;
+        for (size_t s = slots; s > 0; s--)
+            free_slots.push_back(s - 1);
+        size_t next_file = 0;
+        size_t in_flight = 0;
+        size_t delivered = 0;
+        bool stopping = false;
+        bool unsupported = false;
+
+        auto request_read = [&](const size_t &s)
+        {
+            ring_file &state = states[s];
+            io_uring_sqe *read_request = ring.request();
+            read_request->opcode = IORING_OP_READ;
+            read_request->fd = state.descriptor;
+            read_request->addr = reinterpret_cast<uint64_t>(state.file.content.data() + state.done);
+            read_request->len = static_cast<uint32_t>(std::min<uint64_t>(state.file.content.size() - state.done, std::numeric_limits<int32_t>::max()));
+            read_request->off = state.done;
+            read_request->user_data = 4 * s + read_kind;
+            in_flight++;
+        };
+        auto request_close = [&](const size_t &s)
+        {
+            io_uring_sqe *close_request = ring.request();
+            close_request->opcode = IORING_OP_CLOSE;
+            close_request->fd = states[s].descriptor;
+            close_request->user_data = 4 * s + close_kind;
+            in_flight++;
+        };
+        auto finish = [&](const size_t &s)
+        {
+            ring_file &state = states[s];
+            free_slots.push_back(s);
+            if (stopping)
+                return;
+            // The same messages as loadfile, so the errors do not depend on how the files were read.
+            if (state.open_error != 0 or state.descriptor < 0)
+                state.file.error = std::make_exception_ptr(std::invalid_argument("Can't open a file!:" + files[state.file.index].string()));
+            else if (state.read_error != 0)
+                state.file.error = std::make_exception_ptr(std::invalid_argument("Error reading the file " + files[state.file.index].string()));
+            if (state.file.error)
+                state.file.content.clear();
+            if (delivered == 0)
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                backend = "io_uring";
+            }
+            if (!deliver(std::move(state.file)))
+                stopping = true;
+            delivered++;
+        };
+
+        auto handle = [&](const io_uring_cqe &completion)
+        {
+            in_flight--;
+            size_t s = completion.user_data / 4;
+            ring_file &state = states[s];
+            switch (completion.user_data % 4)
+            {
+            case open_kind:
+            case size_kind:
+                if (completion.res < 0)
+                    state.open_error = state.open_error != 0 ? state.open_error : -completion.res;
+                else if (completion.user_data % 4 == open_kind)
+                    state.descriptor = completion.res;
+                if (--state.waiting > 0)
+                    break;
+                // Kernels older than 5.6 do not know these requests, so if the first file fails this way all the files are read with threads.
+                if (state.open_error == EINVAL and delivered == 0)
+                    unsupported = stopping = true;
+                if (state.descriptor < 0)
+                    finish(s);
+                else if (state.open_error != 0 or stopping or state.size.stx_size == 0)
+                    request_close(s);
+                else
+                {
+                    state.file.content.resize(state.size.stx_size);
+                    request_read(s);
+                }
+                break;
+            case read_kind:
+                if (completion.res == -EINTR or completion.res == -EAGAIN)
+                    request_read(s);
+                else if (completion.res < 0)
+                {
+                    state.read_error = -completion.res;
+                    request_close(s);
+                }
+                else if (completion.res == 0)
+                {
+                    state.file.content.resize(state.done);
+                    request_close(s);
+                }
+                else
                 {
-                    raw_x++;
-                    m++;
+                    state.done += static_cast<uint64_t>(completion.res);
+                    // A read can return less than requested, so the rest of the file is requested again until it is complete or the file ends.
+                    if (state.done < state.file.content.size() and !stopping)
+                        request_read(s);
+                    else
+                        request_close(s);
                 }
-                formatted_grid.at(i * width + j) = raw_map.at(raw_y * true_width + raw_x);
+                break;
+            case close_kind:
+                finish(s);
+                break;
+            }
+        };
+
+        while (true)
+        {
+            if (!stopping and is_cancelled())
+                stopping = true;
+            while (!stopping and next_file < files.size() and !free_slots.empty())
+            {
+                size_t s = free_slots.back();
+                free_slots.pop_back();
+                ring_file &state = states[s];
+                state = ring_file();
+                state.file.index = next_file;
+                state.waiting = 2;
+                io_uring_sqe *open_request = ring.request();
+                open_request->opcode = IORING_OP_OPENAT;
+                open_request->fd = AT_FDCWD;
+                open_request->addr = reinterpret_cast<uint64_t>(files[next_file].c_str());
+                open_request->open_flags = O_RDONLY | O_CLOEXEC;
+                open_request->user_data = 4 * s + open_kind;
+                io_uring_sqe *size_request = ring.request();
+                size_request->opcode = IORING_OP_STATX;
+                size_request->fd = AT_FDCWD;
+                size_request->addr = reinterpret_cast<uint64_t>(files[next_file].c_str());
+                size_request->len = STATX_SIZE;
+                size_request->off = reinterpret_cast<uint64_t>(&state.size);
+                size_request->user_data = 4 * s + size_kind;
+                in_flight += 2;
+                next_file++;
             }
-            raw_x = 0;
-            m = 0;
+            if (in_flight == 0)
+                break;
+            // The requests of the completions that are already there are sent together with the next submit.
+            ring.submit();
+            io_uring_cqe completion = ring.complete();
+            do
+                handle(completion);
+            while (ring.try_complete(completion));
+        }
+        return unsupported ? 0 : files.size();
+    }
+#endif
+
+    std::vector<fs::path> files;
+    size_t depth;
+    std::thread producer;
+    std::mutex queue_mutex;
+    std::condition_variable available;
+    std::condition_variable space;
+    std::deque<prefetched_file> ready;
+    bool finished = false;
+    bool cancelled = false;
+    std::exception_ptr failure;
+    std::string backend;
+};
+
+//                                         End class file_prefetcher                                      //
+// ====================================================================================================== //
+//                                           Begin class spectrum                                         //
+/**
+ * @brief Class to store the information from the data files. Contains the energy, intensity and spatial location. The intensities are stored with the type Value (float or double),
+ * the energy axis and the extracted intensities are always double; the name spectrum refers to the double precision class.
+ */
+template <typename Value>
+class basic_spectrum
+{
+
+public:
+    /**
+     * @brief Construct a new spectrum object from a file
+     *
+     * @param path Takes the path to a file were the information will be extracted. If you are using spectrumview, the program creates this path.
+     */
+    basic_spectrum(const fs::path &path)
+    {
+        file_size = readspectrum(path, energy_ax, intensity);
+        pos_x = findcoords(path, "x");
+        pos_y = findcoords(path, "y");
+    }
+
+    /**
+     * @brief Construct a new spectrum object from the content of a file that was already read, e.g. by file_prefetcher.
+     *
+     * @param path Path of the file, used for the coordinates and the error messages.
+     * @param content Text of the file.
+     */
+    basic_spectrum(const fs::path &path, const std::string &content)
+    {
+        parsespectrum(content, path, energy_ax, intensity);
+        file_size = content.size();
+        pos_x = findcoords(path, "x");
+        pos_y = findcoords(path, "y");
+    }
+
+    /**
+     * @brief Construct a new spectrum object from values in memory, e.g. a loading of a principal component analysis.
+     *
+     * @param energy Energy axis, sorted in increasing order.
+     * @param values Intensity of every energy.
+     * @param x The x-coordinate of the spectrum.
+     * @param y The y-coordinate of the spectrum.
+     */
+    basic_spectrum(const std::vector<double> &energy, const std::vector<Value> &values, const double &x = 0, const double &y = 0)
+        : energy_ax(energy), intensity(values), pos_x(x), pos_y(y)
+    {
+        if (energy_ax.size() != intensity.size() or energy_ax.size() < 2)
+            throw std::invalid_argument("A spectrum needs at least two energies and one intensity per energy.");
+    }
+
+    /**
+     * @brief Extracts the intensity at a given energy by locating the nearest upper value and adding the intensities from contiguous specified amount of pixels. If energy is first or last value only channels within the axis are considered.
+     *
+     * @param energy Energy to be mapped.
+     * @param channels The amount of channels to integrate per side.
+     * @return Returns a long float with the result of the sum of the intensities for each channel that was considered.
+     */
+    double integrated_intensity(const double &energy, const uint64_t &channels)
+    {
+        // Spectra of the same map usually share the axis, so the window found for the previous spectrum of this thread is checked first.
+        thread_local integration_window previous;
+        return window_sum(intensity.data(), find_integration_window(energy_ax, energy, channels, previous));
+    }
+
+    /**
+     * @brief Extracts the intensity at a exact required energy by using linear interpolation to find the intensity from known values.
+     *
+     * @param energy Energy to be mapped.
+     * @return Returns a double with the intensity for the requested energy.
+     */
+    double interpolated_intensity(const double &energy)
+    {
+        thread_local interpolation_point previous;
+        return interpolate(intensity.data(), find_interpolation_point(energy_ax, energy, previous));
+    }
+
+    /**
+     * @brief Computes several descriptors within the integration window of integrated_intensity in one pass, see describe_window, e.g. descriptors<peak_maximum_descriptor, centroid_descriptor>(energy, channels).
+     *
+     * @param energy Energy to be mapped.
+     * @param channels The amount of channels to integrate per side.
+     * @return Returns an array with the value of every descriptor, in the order of the template arguments.
+     */
+    template <typename... Descriptors>
+    std::array<double, sizeof...(Descriptors)> descriptors(const double &energy, const uint64_t &channels)
+    {
+        thread_local integration_window previous;
+        return describe_window<Descriptors...>(energy_ax, intensity.data(), find_integration_window(energy_ax, energy, channels, previous));
+    }
+
+    /**
+     * @brief Fits a power law A*E^-r to a pre-edge window and subtracts it from the intensities, from the start of the window to the end of the axis. The extraction functions called
+     * afterwards use the subtracted signal.
+     *
+     * @param first First energy of the pre-edge window, must be positive.
+     * @param last Last energy of the pre-edge window.
+     * @return Returns true if the background was subtracted, false if the window has less than two positive intensities and the spectrum was not changed.
+     */
+    bool subtract_background(const double &first, const double &last)
+    {
+        thread_local background_window previous;
+        const background_window &window = find_background_window(energy_ax, first, last, previous);
+        power_law fit = fit_power_law(intensity.data(), window);
+        if (fit.fitted)
+            subtract_power_law(intensity.data(), window, fit);
+        return fit.fitted;
+    }
+
+    /**
+     * @brief Prints either the x or the y coordinate as requested. This is handled by spectrumview.cpp.
+     *
+     * @param pos The coordinate of interest. Either "x" or "y".
+     * @return Returns a double with the ordinate or the abscissa.
+     */
+    double show_position(const std::string &pos)
+    {
+        double position;
+        if (pos == "x")
+        {
+            position = pos_x;
+            return position;
+        }
+        else if (pos == "y")
+        {
+            position = pos_y;
+            return position;
         }
+        else
+            throw std::invalid_argument("Position can only be for x and y coordinates.");
+    }
+
+    /**
+     * @brief Returns the energy/frequency values of the spectrum.
+     *
+     * @return Returns a vector with the energy axis.
+     */
+    std::vector<double> show_energy_axis()
+    {
+        return energy_ax;
+    }
+
+    /**
+     * @brief Returns the intensity values of the spectrum.
+     *
+     * @return Returns a vector with the intensities, with the storage type of the spectrum.
+     */
+    std::vector<Value> show_intensity()
+    {
+        return intensity;
+    }
+
+    /**
+     * @brief Provides the size of the data file the spectrum was read from.
+     *
+     * @return Returns the amount of bytes read from the file.
+     */
+    uint64_t show_size()
+    {
+        return file_size;
+    }
+
+private:
+    /**
+     * @brief Vector to store the energy/frequency values.
+     */
+    std::vector<double> energy_ax;
+    /**
+     * @brief Vector to store the intensity values.
+     */
+    std::vector<Value> intensity;
+    /**
+     * @brief Variables to store the x-coordinate.
+     */
+    double pos_x = 0;
+    /**
+     * @brief Variables to store the y-coordinate.
+     */
+    double pos_y = 0;
+    /**
+     * @brief Variable to store the size in bytes of the data file.
+     */
+    uint64_t file_size = 0;
+};
+
+typedef basic_spectrum<double> spectrum;
+
+//                                            End class spectrum                                          //
+//========================================================================================================//
+//                                            Begin parallel ingest                                       //
+
+/**
+ * @brief Runs a task for every index in [0, count) using a pool of worker threads with work stealing. Each worker starts on its own contiguous range of indices
+ * and, once it is exhausted, takes the remaining indices from the ranges of the other workers. If tasks throw, the exception of the lowest index is rethrown after
+ * all workers finish, and indices above it are skipped, so the reported error does not depend on the thread scheduling.
+ *
+ * @param count Amount of indices to process.
+ * @param threads Amount of worker threads. With one thread the tasks run in order in the calling thread.
+ * @param task Callable taking the index and the worker number (from 0 to threads - 1).
+ */
+template <typename Task>
+void parallel_for(const size_t &count, const unsigned &threads, Task task)
+{
+    size_t workers = std::min<size_t>(threads == 0 ? 1 : threads, count);
+    if (workers <= 1)
+    {
+        for (size_t i = 0; i < count; i++)
+            task(i, 0u);
+        return;
+    }
+
+    struct work_range
+    {
+        std::atomic<size_t> next{0};
+        size_t end = 0;
+    };
+    std::vector<work_range> ranges(workers);
+    for (size_t w = 0; w < workers; w++)
+    {
+        ranges[w].next = (count * w) / workers;
+        ranges[w].end = (count * (w + 1)) / workers;
+    }
+
+    std::atomic<size_t> failed_index{std::numeric_limits<size_t>::max()};
+    std::exception_ptr failure;
+    std::mutex failure_mutex;
+    auto run = [&](const size_t worker)
+    {
+        for (size_t k = 0; k < workers; k++)
+        {
+            work_range &range = ranges[(worker + k) % workers];
+            for (size_t i = range.next.fetch_add(1); i < range.end; i = range.next.fetch_add(1))
+            {
+                if (i > failed_index.load())
+                    break;
+                try
+                {
+                    task(i, static_cast<unsigned>(worker));
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(failure_mutex);
+                    if (i < failed_index.load())
+                    {
+                        failed_index = i;
+                        failure = std::current_exception();
+                    }
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t w = 1; w < workers; w++)
+        pool.emplace_back(run, w);
+    run(0);
+    for (std::thread &t : pool)
+        t.join();
+    if (failure)
+        std::rethrow_exception(failure);
+}
+
+/**
+ * @brief Reads a list of files with a file_prefetcher and parses them with a pool of worker threads while the next files are still being read. The files are parsed in the order they
+ * are read, not in the order of the list. If parsing or reading fails, every file is still handed out and the error of the first failing file in the list is thrown at the end, so
+ * the reported error does not depend on the thread scheduling.
+ *
+ * @param files Paths to the data files.
+ * @param threads Amount of worker threads parsing the files.
+ * @param parse Callable taking the index of the file in the list, its content and the worker number (from 0 to threads - 1).
+ * @param depth Maximum amount of files read ahead of the parsing.
+ */
+template <typename Parser>
+void read_directory(const std::vector<fs::path> &files, const unsigned &threads, Parser parse, const size_t &depth = 64)
+{
+    if (files.empty())
+        return;
+    file_prefetcher prefetcher(files, depth);
+    size_t workers = std::min<size_t>(threads == 0 ? 1 : threads, files.size());
+    size_t failed_index = std::numeric_limits<size_t>::max();
+    std::exception_ptr failure;
+    std::mutex failure_mutex;
+    auto fail = [&](const size_t i, std::exception_ptr error)
+    {
+        std::lock_guard<std::mutex> lock(failure_mutex);
+        if (i < failed_index)
+        {
+            failed_index = i;
+            failure = error;
+        }
+    };
+    parallel_for(workers, static_cast<unsigned>(workers), [&](const size_t, const unsigned worker)
+                 {
+                     prefetched_file file;
+                     while (prefetcher.next(file))
+                     {
+                         if (file.error)
+                         {
+                             fail(file.index, file.error);
+                             continue;
+                         }
+                         try
+                         {
+                             parse(file.index, file.content, worker);
+                         }
+                         catch (...)
+                         {
+                             fail(file.index, std::current_exception());
+                         }
+                     } });
+    if (failure)
+        std::rethrow_exception(failure);
+}
+
+/**
+ * @brief Information extracted from a single data file: its position in the directory listing, its coordinates, the extracted intensity and the bytes read. The intensity has the type
+ * returned by the extraction, e.g. an array of descriptors; extracted_point is the point with a single intensity.
+ */
+template <typename Result>
+struct basic_extracted_point
+{
+    size_t file_index = 0;
+    double x = 0;
+    double y = 0;
+    Result intensity = {};
+    uint64_t bytes = 0;
+};
+
+typedef basic_extracted_point<double> extracted_point;
+
+/**
+ * @brief Reads every file of a directory listing and extracts one intensity per spectrum using a pool of worker threads. Every worker keeps its own result buffer
+ * and the buffers are merged at the end in the order of the listing, so the result is the same as reading the files one by one.
+ *
+ * @param files Paths to the data files, comes from opendirectory.
+ * @param threads Amount of worker threads.
+ * @param extract Callable taking a basic_spectrum<Value> and returning the intensity for the map, e.g. a call to interpolated_intensity, integrated_intensity or descriptors.
+ * Value is the storage type of the intensities while the files are read, double unless it is given, e.g. extract_directory<float>(files, threads, extract).
+ * @return Returns a vector with one point per file in the same order as the listing, with the type returned by extract as intensity. If reading any file fails, the error of the first
+ * failing file in the listing is thrown.
+ */
+template <typename Value = double, typename Extractor>
+auto extract_directory(const std::vector<fs::path> &files, const unsigned &threads, Extractor extract)
+{
+    typedef basic_extracted_point<std::invoke_result_t<Extractor &, basic_spectrum<Value> &>> point_type;
+    profile_scope scope("extract_directory");
+    scope.add_files(files.size());
+    std::vector<std::vector<point_type>> buffers(std::max(threads, 1u));
+    read_directory(files, threads, [&](const size_t i, const std::string &content, const unsigned worker)
+                   {
+                     basic_spectrum<Value> current_spectrum(files[i], content);
+                     point_type point;
+                     point.file_index = i;
+                     point.x = current_spectrum.show_position("x");
+                     point.y = current_spectrum.show_position("y");
+                     point.intensity = extract(current_spectrum);
+                     point.bytes = current_spectrum.show_size();
+                     buffers[worker].push_back(point); });
+
+    // The scopes are kept at the level of the whole directory: a scope per file would take the lock of the profiler once per spectrum in every worker.
+    std::vector<point_type> points;
+    points.reserve(files.size());
+    for (std::vector<point_type> &buffer : buffers)
+    {
+        for (const point_type &point : buffer)
+            scope.add_read(point.bytes);
+        points.insert(points.end(), buffer.begin(), buffer.end());
+    }
+    std::sort(points.begin(), points.end(), [](const point_type &a, const point_type &b)
+              { return a.file_index < b.file_index; });
+    return points;
+}
+
+//                                            End parallel ingest                                         //
+//========================================================================================================//
+//                                            Begin decomposition functions                               //
+
+/**
+ * @brief Amount of spectra processed by a task of the decomposition functions, and amount of channels of the tiles of the matrix products. A tile of the basis with a few dozen
+ * columns stays in the cache while it is used with every spectrum of the block.
+ */
+constexpr size_t decomposition_block = 64;
+constexpr size_t decomposition_tile = 256;
+
+/**
+ * @brief Principal components of the spectra of a cube: the mean spectrum, the loadings of every component over the channels and the scores of every spectrum.
+ */
+struct principal_components
+{
+    /**
+     * @brief Amount of components, spectra and channels.
+     */
+    size_t components = 0;
+    size_t pixels = 0;
+    size_t channels = 0;
+    /**
+     * @brief Mean intensity of every channel, subtracted before the decomposition.
+     */
+    std::vector<double> mean;
+    /**
+     * @brief Singular values of the centred matrix, in decreasing order.
+     */
+    std::vector<double> singular_values;
+    /**
+     * @brief Sum of the squares of the centred matrix, so singular_values[c]^2 / total_variance is the fraction of the variance of component c.
+     */
+    double total_variance = 0;
+    /**
+     * @brief Loadings, components x channels. Every row has unit length and a positive sum.
+     */
+    std::vector<double> loadings;
+    /**
+     * @brief Scores, components x pixels, in the order of the spectra of the cube.
+     */
+    std::vector<double> scores;
+};
+
+/**
+ * @brief Computes the eigenvalues and eigenvectors of a small symmetric matrix with the cyclic Jacobi method.
+ *
+ * @param matrix Symmetric matrix in row-major order.
+ * @param size Amount of rows and columns.
+ * @param eigenvalues Eigenvalues in decreasing order.
+ * @param eigenvectors Matrix in row-major order with one eigenvector per column, in the order of the eigenvalues.
+ */
+void symmetric_eigen(std::vector<double> matrix, const size_t &size, std::vector<double> &eigenvalues, std::vector<double> &eigenvectors)
+{
+    std::vector<double> vectors(size * size, 0);
+    for (size_t i = 0; i < size; i++)
+        vectors[i * size + i] = 1;
+    double norm = 0;
+    for (std::vector<double>::const_iterator m = matrix.begin(); m < matrix.end(); m++)
+        norm += *m * *m;
+    for (size_t sweep = 0; sweep < 64; sweep++)
+    {
+        double off_diagonal = 0;
+        for (size_t p = 0; p < size; p++)
+            for (size_t q = p + 1; q < size; q++)
+                off_diagonal += matrix[p * size + q] * matrix[p * size + q];
+        if (off_diagonal <= 1e-30 * norm)
+            break;
+        for (size_t p = 0; p < size; p++)
+        {
+            for (size_t q = p + 1; q < size; q++)
+            {
+                double apq = matrix[p * size + q];
+                if (apq == 0)
+                    continue;
+                double theta = (matrix[q * size + q] - matrix[p * size + p]) / (2 * apq);
+                double t = (theta < 0 ? -1.0 : 1.0) / (std::abs(theta) + std::sqrt(theta * theta + 1));
+                double c = 1 / std::sqrt(t * t + 1);
+                double s = t * c;
+                for (size_t k = 0; k < size; k++)
+                {
+                    double akp = matrix[k * size + p];
+                    double akq = matrix[k * size + q];
+                    matrix[k * size + p] = c * akp - s * akq;
+                    matrix[k * size + q] = s * akp + c * akq;
+                }
+                for (size_t k = 0; k < size; k++)
+                {
+                    double apk = matrix[p * size + k];
+                    double aqk = matrix[q * size + k];
+                    matrix[p * size + k] = c * apk - s * aqk;
+                    matrix[q * size + k] = s * apk + c * aqk;
+                }
+                for (size_t k = 0; k < size; k++)
+                {
+                    double vkp = vectors[k * size + p];
+                    double vkq = vectors[k * size + q];
+                    vectors[k * size + p] = c * vkp - s * vkq;
+                    vectors[k * size + q] = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
+
+    std::vector<size_t> order(size);
+    for (size_t i = 0; i < size; i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&](const size_t a, const size_t b)
+              { return matrix[a * size + a] > matrix[b * size + b]; });
+    eigenvalues.resize(size);
+    eigenvectors.resize(size * size);
+    for (size_t c = 0; c < size; c++)
+    {
+        eigenvalues[c] = matrix[order[c] * size + order[c]];
+        for (size_t r = 0; r < size; r++)
+            eigenvectors[r * size + c] = vectors[r * size + order[c]];
+    }
+}
+
+/**
+ * @brief Makes the columns of a tall matrix orthonormal with the eigenvectors of its Gram matrix. The Gram matrix is added up by the worker threads in blocks of rows, and the
+ * orthogonalization is done twice so the result is orthonormal to the precision of the doubles. Columns without a significant contribution are set to zero.
+ *
+ * @param matrix Matrix in row-major order, replaced by the orthonormal basis of its columns.
+ * @param rows Amount of rows.
+ * @param columns Amount of columns.
+ * @param threads Amount of worker threads.
+ */
+void orthonormalize_columns(std::vector<double> &matrix, const size_t &rows, const size_t &columns, const unsigned &threads)
+{
+    size_t blocks = (rows + decomposition_block - 1) / decomposition_block;
+    for (size_t pass = 0; pass < 2; pass++)
+    {
+        std::vector<std::vector<double>> partial(std::max(threads, 1u), std::vector<double>(columns * columns, 0));
+        parallel_for(blocks, threads, [&](const size_t b, const unsigned worker)
+                     {
+                         std::vector<double> &gram = partial[worker];
+                         for (size_t i = b * decomposition_block; i < std::min(rows, (b + 1) * decomposition_block); i++)
+                         {
+                             const double *row = matrix.data() + i * columns;
+                             for (size_t p = 0; p < columns; p++)
+                                 for (size_t q = p; q < columns; q++)
+                                     gram[p * columns + q] += row[p] * row[q];
+                         } });
+        std::vector<double> gram(columns * columns, 0);
+        for (std::vector<std::vector<double>>::const_iterator w = partial.begin(); w < partial.end(); w++)
+            for (size_t p = 0; p < columns; p++)
+                for (size_t q = p; q < columns; q++)
+                    gram[p * columns + q] += (*w)[p * columns + q];
+        for (size_t p = 0; p < columns; p++)
+            for (size_t q = 0; q < p; q++)
+                gram[p * columns + q] = gram[q * columns + p];
+
+        std::vector<double> values;
+        std::vector<double> vectors;
+        symmetric_eigen(gram, columns, values, vectors);
+        std::vector<double> transform(columns * columns, 0);
+        for (size_t c = 0; c < columns; c++)
+        {
+            if (values[c] <= 1e-12 * values[0] or values[c] <= 0)
+                continue;
+            double scale = 1 / std::sqrt(values[c]);
+            for (size_t r = 0; r < columns; r++)
+                transform[r * columns + c] = vectors[r * columns + c] * scale;
+        }
+        parallel_for(blocks, threads, [&](const size_t b, const unsigned)
+                     {
+                         std::vector<double> product(columns);
+                         for (size_t i = b * decomposition_block; i < std::min(rows, (b + 1) * decomposition_block); i++)
+                         {
+                             double *row = matrix.data() + i * columns;
+                             std::fill(product.begin(), product.end(), 0.0);
+                             for (size_t r = 0; r < columns; r++)
+                                 for (size_t c = 0; c < columns; c++)
+                                     product[c] += row[r] * transform[r * columns + c];
+                             std::copy(product.begin(), product.end(), row);
+                         } });
+    }
+}
+
+/**
+ * @brief Multiplies the centred spectra by a basis over the channels: projection = (data - mean) * basis. The worker threads take blocks of spectra, and the channels are
+ * processed in tiles so every tile of the basis is read from the cache for all the spectra of the block.
+ *
+ * @param data Intensities of the spectra, pixels x channels.
+ * @param pixels Amount of spectra.
+ * @param channels Amount of channels per spectrum.
+ * @param mean Mean intensity of every channel.
+ * @param basis Matrix in row-major order, channels x rank.
+ * @param rank Amount of columns of the basis.
+ * @param projection Result, pixels x rank.
+ * @param threads Amount of worker threads.
+ */
+template <typename Value>
+void project_spectra(const Value *data, const size_t &pixels, const size_t &channels, const std::vector<double> &mean, const std::vector<double> &basis, const size_t &rank, std::vector<double> &projection, const unsigned &threads)
+{
+    // The mean is subtracted from the products instead of from every intensity.
+    std::vector<double> offset(rank, 0);
+    for (size_t j = 0; j < channels; j++)
+        for (size_t c = 0; c < rank; c++)
+            offset[c] += mean[j] * basis[j * rank + c];
+    projection.assign(pixels * rank, 0);
+    parallel_for((pixels + decomposition_block - 1) / decomposition_block, threads, [&](const size_t b, const unsigned)
+                 {
+                     size_t first = b * decomposition_block;
+                     size_t last = std::min(pixels, first + decomposition_block);
+                     for (size_t tile = 0; tile < channels; tile += decomposition_tile)
+                     {
+                         size_t end = std::min(channels, tile + decomposition_tile);
+                         for (size_t i = first; i < last; i++)
+                         {
+                             const Value *row = data + i * channels;
+                             double *result = projection.data() + i * rank;
+                             size_t j = tile;
+                             // Four channels per step, so the row of the result is loaded and stored once for four rows of the basis.
+                             for (; j + 4 <= end; j += 4)
+                             {
+                                 double v0 = static_cast<double>(row[j]);
+                                 double v1 = static_cast<double>(row[j + 1]);
+                                 double v2 = static_cast<double>(row[j + 2]);
+                                 double v3 = static_cast<double>(row[j + 3]);
+                                 const double *w0 = basis.data() + j * rank;
+                                 const double *w1 = w0 + rank;
+                                 const double *w2 = w1 + rank;
+                                 const double *w3 = w2 + rank;
+                                 for (size_t c = 0; c < rank; c++)
+                                     result[c] += v0 * w0[c] + v1 * w1[c] + v2 * w2[c] + v3 * w3[c];
+                             }
+                             for (; j < end; j++)
+                             {
+                                 double value = static_cast<double>(row[j]);
+                                 const double *weights = basis.data() + j * rank;
+                                 for (size_t c = 0; c < rank; c++)
+                                     result[c] += value * weights[c];
+                             }
+                         }
+                     }
+                     for (size_t i = first; i < last; i++)
+                         for (size_t c = 0; c < rank; c++)
+                             projection[i * rank + c] -= offset[c]; });
+}
+
+/**
+ * @brief Multiplies the transposed centred spectra by a basis over the spectra: product = (data - mean)^T * basis. Every worker thread adds its blocks of spectra to its own
+ * channels x rank matrix, in tiles of channels, and the matrices are added at the end.
+ *
+ * @param data Intensities of the spectra, pixels x channels.
+ * @param pixels Amount of spectra.
+ * @param channels Amount of channels per spectrum.
+ * @param mean Mean intensity of every channel.
+ * @param basis Matrix in row-major order, pixels x rank.
+ * @param rank Amount of columns of the basis.
+ * @param product Result, channels x rank.
+ * @param threads Amount of worker threads.
+ */
+template <typename Value>
+void project_channels(const Value *data, const size_t &pixels, const size_t &channels, const std::vector<double> &mean, const std::vector<double> &basis, const size_t &rank, std::vector<double> &product, const unsigned &threads)
+{
+    std::vector<std::vector<double>> partial(std::max(threads, 1u));
+    std::vector<std::vector<double>> basis_sums(std::max(threads, 1u), std::vector<double>(rank, 0));
+    parallel_for((pixels + decomposition_block - 1) / decomposition_block, threads, [&](const size_t b, const unsigned worker)
+                 {
+                     std::vector<double> &result = partial[worker];
+                     if (result.empty())
+                         result.assign(channels * rank, 0);
+                     size_t first = b * decomposition_block;
+                     size_t last = std::min(pixels, first + decomposition_block);
+                     for (size_t tile = 0; tile < channels; tile += decomposition_tile)
+                     {
+                         size_t end = std::min(channels, tile + decomposition_tile);
+                         size_t i = first;
+                         // Four spectra per step, so every row of the result is loaded and stored once for four spectra.
+                         for (; i + 4 <= last; i += 4)
+                         {
+                             const Value *r0 = data + i * channels;
+                             const Value *r1 = r0 + channels;
+                             const Value *r2 = r1 + channels;
+                             const Value *r3 = r2 + channels;
+                             const double *w0 = basis.data() + i * rank;
+                             const double *w1 = w0 + rank;
+                             const double *w2 = w1 + rank;
+                             const double *w3 = w2 + rank;
+                             for (size_t j = tile; j < end; j++)
+                             {
+                                 double v0 = static_cast<double>(r0[j]);
+                                 double v1 = static_cast<double>(r1[j]);
+                                 double v2 = static_cast<double>(r2[j]);
+                                 double v3 = static_cast<double>(r3[j]);
+                                 double *sums = result.data() + j * rank;
+                                 for (size_t c = 0; c < rank; c++)
+                                     sums[c] += v0 * w0[c] + v1 * w1[c] + v2 * w2[c] + v3 * w3[c];
+                             }
+                         }
+                         for (; i < last; i++)
+                         {
+                             const Value *row = data + i * channels;
+                             const double *weights = basis.data() + i * rank;
+                             for (size_t j = tile; j < end; j++)
+                             {
+                                 double value = static_cast<double>(row[j]);
+                                 double *sums = result.data() + j * rank;
+                                 for (size_t c = 0; c < rank; c++)
+                                     sums[c] += value * weights[c];
+                             }
+                         }
+                     }
+                     for (size_t i = first; i < last; i++)
+                         for (size_t c = 0; c < rank; c++)
+                             basis_sums[worker][c] += basis[i * rank + c]; });
+
+    product.assign(channels * rank, 0);
+    std::vector<double> basis_sum(rank, 0);
+    for (size_t w = 0; w < partial.size(); w++)
+    {
+        for (size_t c = 0; c < rank; c++)
+            basis_sum[c] += basis_sums[w][c];
+        if (partial[w].empty())
+            continue;
+        for (size_t k = 0; k < product.size(); k++)
+            product[k] += partial[w][k];
+    }
+    for (size_t j = 0; j < channels; j++)
+        for (size_t c = 0; c < rank; c++)
+            product[j * rank + c] -= mean[j] * basis_sum[c];
+}
+
+/**
+ * @brief Principal component analysis of a matrix of spectra with a randomized truncated singular value decomposition (Halko, Martinsson and Tropp). The centred matrix is
+ * multiplied by a random Gaussian basis with a few more columns than the requested components, refined with power iterations, and the small projected matrix is decomposed
+ * exactly. Every pass over the spectra is split between the worker threads, so the decomposition reads the matrix 2 * power_iterations + 3 times.
+ *
+ * @param data Intensities of the spectra, pixels x channels.
+ * @param pixels Amount of spectra.
+ * @param channels Amount of channels per spectrum.
+ * @param components Amount of principal components, between 1 and the smallest of pixels and channels.
+ * @param threads Amount of worker threads.
+ * @param oversampling Extra columns of the random basis.
+ * @param power_iterations Amount of power iterations, more iterations separate components with similar singular values.
+ * @param seed Seed of the random basis, the same seed gives the same components.
+ * @return Returns the mean spectrum, the singular values, the loadings and the scores.
+ */
+template <typename Value>
+principal_components randomized_pca(const Value *data, const size_t &pixels, const size_t &channels, const size_t &components, const unsigned &threads, const size_t &oversampling = 10, const size_t &power_iterations = 2, const uint64_t &seed = 1)
+{
+    if (components == 0 or components > std::min(pixels, channels))
+        throw std::invalid_argument("Error: The amount of principal components must be between 1 and the smallest of the amount of spectra and channels.");
+    principal_components result;
+    result.components = components;
+    result.pixels = pixels;
+    result.channels = channels;
+    size_t rank = std::min(components + oversampling, std::min(pixels, channels));
+    size_t blocks = (pixels + decomposition_block - 1) / decomposition_block;
+
+    std::vector<std::vector<double>> partial(std::max(threads, 1u), std::vector<double>(channels, 0));
+    parallel_for(blocks, threads, [&](const size_t b, const unsigned worker)
+                 {
+                     for (size_t i = b * decomposition_block; i < std::min(pixels, (b + 1) * decomposition_block); i++)
+                         for (size_t j = 0; j < channels; j++)
+                             partial[worker][j] += static_cast<double>(data[i * channels + j]); });
+    result.mean.assign(channels, 0);
+    for (std::vector<std::vector<double>>::const_iterator w = partial.begin(); w < partial.end(); w++)
+        for (size_t j = 0; j < channels; j++)
+            result.mean[j] += (*w)[j] / static_cast<double>(pixels);
+    std::vector<double> variance(std::max(threads, 1u), 0);
+    parallel_for(blocks, threads, [&](const size_t b, const unsigned worker)
+                 {
+                     for (size_t i = b * decomposition_block; i < std::min(pixels, (b + 1) * decomposition_block); i++)
+                         for (size_t j = 0; j < channels; j++)
+                         {
+                             double centred = static_cast<double>(data[i * channels + j]) - result.mean[j];
+                             variance[worker] += centred * centred;
+                         } });
+    for (std::vector<double>::const_iterator v = variance.begin(); v < variance.end(); v++)
+        result.total_variance += *v;
+
+    std::mt19937_64 generator(seed);
+    std::normal_distribution<double> normal(0.0, 1.0);
+    std::vector<double> channel_basis(channels * rank);
+    for (std::vector<double>::iterator g = channel_basis.begin(); g < channel_basis.end(); g++)
+        *g = normal(generator);
+    std::vector<double> pixel_basis;
+    project_spectra(data, pixels, channels, result.mean, channel_basis, rank, pixel_basis, threads);
+    orthonormalize_columns(pixel_basis, pixels, rank, threads);
+    for (size_t q = 0; q < power_iterations; q++)
+    {
+        project_channels(data, pixels, channels, result.mean, pixel_basis, rank, channel_basis, threads);
+        orthonormalize_columns(channel_basis, channels, rank, threads);
+        project_spectra(data, pixels, channels, result.mean, channel_basis, rank, pixel_basis, threads);
+        orthonormalize_columns(pixel_basis, pixels, rank, threads);
+    }
+    // The centred matrix projected on the basis of the spectra, transposed: channels x rank.
+    project_channels(data, pixels, channels, result.mean, pixel_basis, rank, channel_basis, threads);
+
+    // Its singular value decomposition comes from the eigenvectors of the rank x rank Gram matrix.
+    std::vector<double> gram(rank * rank, 0);
+    for (size_t j = 0; j < channels; j++)
+        for (size_t p = 0; p < rank; p++)
+            for (size_t q = 0; q < rank; q++)
+                gram[p * rank + q] += channel_basis[j * rank + p] * channel_basis[j * rank + q];
+    std::vector<double> values;
+    std::vector<double> vectors;
+    symmetric_eigen(gram, rank, values, vectors);
+
+    result.singular_values.assign(components, 0);
+    result.loadings.assign(components * channels, 0);
+    result.scores.assign(components * pixels, 0);
+    std::vector<double> signs(components, 1);
+    for (size_t c = 0; c < components; c++)
+    {
+        result.singular_values[c] = std::sqrt(std::max(values[c], 0.0));
+        if (result.singular_values[c] == 0)
+            continue;
+        double *loading = result.loadings.data() + c * channels;
+        double sum = 0;
+        for (size_t j = 0; j < channels; j++)
+        {
+            for (size_t r = 0; r < rank; r++)
+                loading[j] += channel_basis[j * rank + r] * vectors[r * rank + c];
+            loading[j] /= result.singular_values[c];
+            sum += loading[j];
+        }
+        // The sign of a component is arbitrary, so it is chosen to give loadings with a positive sum.
+        if (sum < 0)
+        {
+            signs[c] = -1;
+            for (size_t j = 0; j < channels; j++)
+                loading[j] = -loading[j];
+        }
+    }
+    parallel_for(blocks, threads, [&](const size_t b, const unsigned)
+                 {
+                     for (size_t i = b * decomposition_block; i < std::min(pixels, (b + 1) * decomposition_block); i++)
+                         for (size_t c = 0; c < components; c++)
+                         {
+                             double score = 0;
+                             for (size_t r = 0; r < rank; r++)
+                                 score += pixel_basis[i * rank + r] * vectors[r * rank + c];
+                             result.scores[c * pixels + i] = signs[c] * result.singular_values[c] * score;
+                         } });
+    return result;
+}
+
+/**
+ * @brief Replaces every spectrum with its reconstruction from the principal components: the mean spectrum plus the loadings weighted by the scores of the spectrum.
+ *
+ * @param data Intensities of the spectra, pixels x channels.
+ * @param pca Principal components of the same spectra, from randomized_pca.
+ * @param components Amount of components used, at most pca.components.
+ * @param threads Amount of worker threads.
+ */
+template <typename Value>
+void reconstruct_components(Value *data, const principal_components &pca, const size_t &components, const unsigned &threads)
+{
+    if (components > pca.components)
+        throw std::invalid_argument("Error: The reconstruction can not use more components than the decomposition.");
+    parallel_for((pca.pixels + decomposition_block - 1) / decomposition_block, threads, [&](const size_t b, const unsigned)
+                 {
+                     std::vector<double> spectrum_values(pca.channels);
+                     for (size_t i = b * decomposition_block; i < std::min(pca.pixels, (b + 1) * decomposition_block); i++)
+                     {
+                         std::copy(pca.mean.begin(), pca.mean.end(), spectrum_values.begin());
+                         for (size_t c = 0; c < components; c++)
+                         {
+                             double score = pca.scores[c * pca.pixels + i];
+                             const double *loading = pca.loadings.data() + c * pca.channels;
+                             for (size_t j = 0; j < pca.channels; j++)
+                                 spectrum_values[j] += score * loading[j];
+                         }
+                         Value *row = data + i * pca.channels;
+                         for (size_t j = 0; j < pca.channels; j++)
+                             row[j] = static_cast<Value>(spectrum_values[j]);
+                     } });
+}
+
+//                                            End decomposition functions                                 //
+//========================================================================================================//
+//                                            Begin clustering functions                                  //
+
+/**
+ * @brief Classes of the spectra of a cube found with k-means: the centroid spectrum and size of every class and the class of every spectrum. The classes are sorted by size, the
+ * largest first.
+ */
+struct spectral_classes
+{
+    /**
+     * @brief Amount of classes, spectra and channels.
+     */
+    size_t classes = 0;
+    size_t pixels = 0;
+    size_t channels = 0;
+    /**
+     * @brief Mean spectrum of every class, classes x channels.
+     */
+    std::vector<double> centroids;
+    /**
+     * @brief Class of every spectrum, from 0, in the order of the spectra of the cube.
+     */
+    std::vector<uint32_t> labels;
+    /**
+     * @brief Amount of spectra of every class.
+     */
+    std::vector<uint64_t> sizes;
+    /**
+     * @brief Sum of the squared distances of the spectra to the centroids of their classes.
+     */
+    double inertia = 0;
+    /**
+     * @brief Amount of assignment passes until no spectrum changed its class, or the maximum if it did not converge.
+     */
+    size_t iterations = 0;
+};
+
+/**
+ * @brief Squared Euclidean distance between a spectrum and a centroid. Four partial sums are kept so the additions do not wait for each other.
+ *
+ * @param intensity Pointer to the first intensity of the spectrum.
+ * @param centroid Pointer to the first value of the centroid.
+ * @param channels Amount of channels.
+ * @return Returns the sum of the squared differences.
+ */
+template <typename Value>
+double squared_distance(const Value *intensity, const double *centroid, const size_t &channels)
+{
+    double sums[4] = {0, 0, 0, 0};
+    size_t j = 0;
+    for (; j + 4 <= channels; j += 4)
+    {
+        for (size_t u = 0; u < 4; u++)
+        {
+            double difference = static_cast<double>(intensity[j + u]) - centroid[j + u];
+            sums[u] += difference * difference;
+        }
+    }
+    for (; j < channels; j++)
+    {
+        double difference = static_cast<double>(intensity[j]) - centroid[j];
+        sums[0] += difference * difference;
+    }
+    return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+}
+
+/**
+ * @brief Clusters a matrix of spectra with k-means, seeded with k-means++. Every pass assigns the spectra to the nearest centroid and adds them to the sums of the new centroids. The
+ * spectra are split in one contiguous range per thread, each with its own sums, and the sums are added in the order of the ranges, so the result only depends on the amount of threads
+ * and there are no locks in the passes. An empty class is seeded again with the spectrum farthest from its centroid.
+ *
+ * @param data Intensities of the spectra, pixels x channels.
+ * @param pixels Amount of spectra.
+ * @param channels Amount of channels per spectrum.
+ * @param classes Amount of classes, between 1 and the amount of spectra.
+ * @param threads Amount of worker threads.
+ * @param max_iterations Maximum amount of assignment passes.
+ * @param seed Seed of the k-means++ choices, the same seed gives the same classes.
+ * @return Returns the centroids, sizes and labels, with the classes sorted by size.
+ */
+template <typename Value>
+spectral_classes kmeans_spectra(const Value *data, const size_t &pixels, const size_t &channels, const size_t &classes, const unsigned &threads, const size_t &max_iterations = 100, const uint64_t &seed = 1)
+{
+    if (classes == 0 or classes > pixels)
+        throw std::invalid_argument("Error: The amount of classes must be between 1 and the amount of spectra.");
+    spectral_classes result;
+    result.classes = classes;
+    result.pixels = pixels;
+    result.channels = channels;
+    size_t ranges = std::max(threads, 1u);
+    auto range_begin = [&](const size_t r)
+    {
+        return (pixels * r) / ranges;
+    };
+
+    // k-means++: every new centroid is a spectrum chosen with a probability proportional to its squared distance to the nearest centroid.
+    std::mt19937_64 generator(seed);
+    std::vector<double> centroids(classes * channels);
+    std::vector<double> distances(pixels, std::numeric_limits<double>::infinity());
+    size_t chosen = std::uniform_int_distribution<size_t>(0, pixels - 1)(generator);
+    for (size_t c = 0; c < classes; c++)
+    {
+        for (size_t j = 0; j < channels; j++)
+            centroids[c * channels + j] = static_cast<double>(data[chosen * channels + j]);
+        const double *centroid = centroids.data() + c * channels;
+        parallel_for(ranges, threads, [&](const size_t r, const unsigned)
+                     {
+                         for (size_t i = range_begin(r); i < range_begin(r + 1); i++)
+                             distances[i] = std::min(distances[i], squared_distance(data + i * channels, centroid, channels)); });
+        if (c + 1 == classes)
+            break;
+        double total = 0;
+        for (std::vector<double>::const_iterator d = distances.begin(); d < distances.end(); d++)
+            total += *d;
+        if (total <= 0)
+        {
+            // All the spectra are equal to a centroid, any spectrum is as good as another.
+            chosen = std::uniform_int_distribution<size_t>(0, pixels - 1)(generator);
+            continue;
+        }
+        double target = std::uniform_real_distribution<double>(0, total)(generator);
+        chosen = pixels - 1;
+        for (size_t i = 0; i < pixels; i++)
+        {
+            target -= distances[i];
+            if (target < 0 and distances[i] > 0)
+            {
+                chosen = i;
+                break;
+            }
+        }
+    }
+
+    std::vector<uint32_t> labels(pixels, 0);
+    std::vector<std::vector<double>> sums(ranges);
+    std::vector<std::vector<uint64_t>> counts(ranges);
+    std::vector<double> inertia(ranges);
+    std::vector<uint64_t> changed(ranges);
+    for (size_t iteration = 0; iteration < max_iterations; iteration++)
+    {
+        parallel_for(ranges, threads, [&](const size_t r, const unsigned)
+                     {
+                         sums[r].assign(classes * channels, 0);
+                         counts[r].assign(classes, 0);
+                         inertia[r] = 0;
+                         changed[r] = 0;
+                         for (size_t i = range_begin(r); i < range_begin(r + 1); i++)
+                         {
+                             const Value *spectrum_values = data + i * channels;
+                             uint32_t nearest = 0;
+                             double nearest_distance = std::numeric_limits<double>::infinity();
+                             for (size_t c = 0; c < classes; c++)
+                             {
+                                 double distance = squared_distance(spectrum_values, centroids.data() + c * channels, channels);
+                                 if (distance < nearest_distance)
+                                 {
+                                     nearest_distance = distance;
+                                     nearest = static_cast<uint32_t>(c);
+                                 }
+                             }
+                             if (iteration == 0 or labels[i] != nearest)
+                                 changed[r]++;
+                             labels[i] = nearest;
+                             distances[i] = nearest_distance;
+                             inertia[r] += nearest_distance;
+                             counts[r][nearest]++;
+                             double *class_sums = sums[r].data() + nearest * channels;
+                             for (size_t j = 0; j < channels; j++)
+                                 class_sums[j] += static_cast<double>(spectrum_values[j]);
+                         } });
+        result.iterations = iteration + 1;
+        result.inertia = 0;
+        uint64_t total_changed = 0;
+        result.sizes.assign(classes, 0);
+        std::fill(centroids.begin(), centroids.end(), 0.0);
+        for (size_t r = 0; r < ranges; r++)
+        {
+            result.inertia += inertia[r];
+            total_changed += changed[r];
+            for (size_t c = 0; c < classes; c++)
+                result.sizes[c] += counts[r][c];
+            for (size_t k = 0; k < centroids.size(); k++)
+                centroids[k] += sums[r][k];
+        }
+        for (size_t c = 0; c < classes; c++)
+        {
+            if (result.sizes[c] > 0)
+            {
+                for (size_t j = 0; j < channels; j++)
+                    centroids[c * channels + j] /= static_cast<double>(result.sizes[c]);
+                continue;
+            }
+            size_t farthest = static_cast<size_t>(std::max_element(distances.begin(), distances.end()) - distances.begin());
+            for (size_t j = 0; j < channels; j++)
+                centroids[c * channels + j] = static_cast<double>(data[farthest * channels + j]);
+            distances[farthest] = 0;
+            // A new centroid needs another pass even if no spectrum changed its class.
+            total_changed++;
+        }
+        if (total_changed == 0)
+            break;
+    }
+
+    std::vector<size_t> order(classes);
+    for (size_t c = 0; c < classes; c++)
+        order[c] = c;
+    std::stable_sort(order.begin(), order.end(), [&](const size_t a, const size_t b)
+                     { return result.sizes[a] > result.sizes[b]; });
+    std::vector<uint32_t> rank(classes);
+    result.centroids.resize(classes * channels);
+    std::vector<uint64_t> sizes(classes);
+    for (size_t c = 0; c < classes; c++)
+    {
+        rank[order[c]] = static_cast<uint32_t>(c);
+        sizes[c] = result.sizes[order[c]];
+        std::copy(centroids.begin() + static_cast<std::ptrdiff_t>(order[c] * channels), centroids.begin() + static_cast<std::ptrdiff_t>((order[c] + 1) * channels), result.centroids.begin() + static_cast<std::ptrdiff_t>(c * channels));
+    }
+    result.sizes = sizes;
+    result.labels.resize(pixels);
+    for (size_t i = 0; i < pixels; i++)
+        result.labels[i] = rank[labels[i]];
+    return result;
+}
+
+//                                            End clustering functions                                    //
+//========================================================================================================//
+//                                            Begin class data_map                                        //
+
+/**
+ * @brief Class to create the energy map. Can provide a raw map with a "pixel" per point acquired, or a map with added pixels to improve aspect. The raw map is stored with the type Value
+ * (float or double) and the formatted grid is always computed in double precision; the name data_map refers to the double precision class.
+ */
+template <typename Value>
+class basic_data_map
+{
+public:
+    /**
+     * @brief Construct a new data map object from a set of coordinates and a map with the intensity of each coordinate. Coordinates without intensity are filled with zero.
+     *
+     * @param keys The coordinates extracted from the file name for all the data files.
+     * @param intensity_fill The intensity values for a spectrum map associated with their respective coordinates.
+     */
+    basic_data_map(const std::set<std::tuple<double, double>> &keys, const std::map<std::tuple<double, double>, double> &intensity_fill)
+    {
+        if (keys.empty() or intensity_fill.empty())
+            throw std::invalid_argument("Error while processing the files");
+
+        std::vector<double> x;
+        std::vector<double> y;
+        std::vector<double> intensity;
+        x.reserve(keys.size());
+        y.reserve(keys.size());
+        intensity.reserve(keys.size());
+        for (std::set<std::tuple<double, double>>::iterator i = keys.begin(); i != keys.end(); i++)
+        {
+            x.push_back(std::get<0>(*i));
+            y.push_back(std::get<1>(*i));
+            std::map<std::tuple<double, double>, double>::const_iterator value = intensity_fill.find(*i);
+            intensity.push_back(value != intensity_fill.end() ? value->second : 0);
+        }
+        assemble(x, y, intensity);
+    }
+
+    /**
+     * @brief Construct a new data map object from the coordinates and intensity of every spectrum. In spectrumview, this is the constructor used to fill the raw map: the unique x and y values are sorted once
+     * and every intensity is written straight into its position of the flattened matrix, so no tree of coordinates is needed.
+     *
+     * @param x The x coordinate of every spectrum.
+     * @param y The y coordinate of every spectrum.
+     * @param intensity_fill The intensity of every spectrum, in the same order as the coordinates.
+     */
+    basic_data_map(const std::vector<double> &x, const std::vector<double> &y, const std::vector<double> &intensity_fill)
+    {
+        if (x.empty() or x.size() != y.size() or x.size() != intensity_fill.size())
+            throw std::invalid_argument("Error while processing the files: The amount of coordinates and intensities do not coincide.");
+        assemble(x, y, intensity_fill);
+    }
+
+    /**
+     * @brief Returns a vector with all the values for the abscissa and/or ordinate of the map.
+     *
+     * @param axis Specify wether you want the file with the abscissa or the file of the ordinate.
+     * @return Returns a vector with all the values of the true coordinates in a specific direction.
+     */
+    std::vector<double> show_axis(const std::string &axis)
+    {
+        if (axis == "x")
+            return x_handle;
+        else if (axis == "y")
+            return y_handle;
+        else
+            throw std::invalid_argument("Only axis 'x' or 'y' can be requested");
+    }
+
+    /**
+     * @brief Extracts the flattened matrix with the intensities extracted from the files respecting the dimensions of the experiment.
+     *
+     * @return Returns a flattened matrix with the intensity values extracted from the map, doesn't consider if the step size varies.
+     */
+    std::vector<double> show_raw()
+    {
+        std::vector<double> raw_image(raw_map.size());
+        for (uint64_t i = 0; i < raw_map.size(); i++)
+            raw_image[i] = raw_map[i];
+        return raw_image;
+    }
+
+    /**
+     * @brief Provides access to read the dimensions of raw image.
+     *
+     * @param size_direction Specify wether the width or length is needed.
+     * @return Returns a 32-bit integer with the width or length measured in data points.
+     */
+    std::uint32_t show_dimensions(const std::string &size_direction)
+    {
+        if (size_direction == "width")
+            return true_width;
+        else if (size_direction == "length")
+            return true_length;
+        else
+            throw std::invalid_argument("Can't access requested dimension.");
+    }
+
+    /**
+     * @brief Replaces the intensities of the raw map keeping the same positions, e.g. to get the map of another energy from the same spectra. The position of every spectrum in the matrix
+     * was found when the map was constructed, so no search is needed and the resampling plan of the formatted grid is kept.
+     *
+     * @param intensity_fill The intensity of every spectrum, in the same order as the coordinates used to construct the map.
+     */
+    void refill(const std::vector<double> &intensity_fill)
+    {
+        if (intensity_fill.size() != cell_index.size())
+            throw std::invalid_argument("The amount of intensities does not coincide with the amount of positions in the map.");
+        std::fill(raw_map.begin(), raw_map.end(), 0);
+        for (size_t i = 0; i < intensity_fill.size(); i++)
+            raw_map[cell_index[i]] = static_cast<Value>(intensity_fill[i]);
+    }
+
+    /**
+     * @brief Places the intensities of the spectra in a raw map with the positions of this map, without changing the map. The intensities are in the same order as in the constructor,
+     * as in refill.
+     *
+     * @param intensity_fill The intensity of every spectrum.
+     * @return Returns the flattened raw map, with the storage type of the map.
+     */
+    std::vector<Value> show_placed(const std::vector<double> &intensity_fill) const
+    {
+        if (intensity_fill.size() != cell_index.size())
+            throw std::invalid_argument("The amount of intensities does not coincide with the amount of positions in the map.");
+        std::vector<Value> raw(raw_map.size(), 0);
+        for (size_t i = 0; i < intensity_fill.size(); i++)
+            raw[cell_index[i]] = static_cast<Value>(intensity_fill[i]);
+        return raw;
+    }
+
+    /**
+     * @brief Adds the intensity of one position to the map, or replaces it if the position already has a value, e.g. when a spectrum arrives during an acquisition.
+     * If the x or y value is new, it is inserted in its axis and the raw map gets a new column or row filled with zero; the resampling plan is then computed again when it is requested.
+     *
+     * @param x The x coordinate of the spectrum.
+     * @param y The y coordinate of the spectrum.
+     * @param value The intensity of the spectrum.
+     * @param raw_row Returns the row of the raw map where the value was written.
+     * @return Returns true if the axes of the map changed.
+     */
+    bool update(const double &x, const double &y, const double &value, uint64_t &raw_row)
+    {
+        size_t column = static_cast<size_t>(std::lower_bound(x_handle.begin(), x_handle.end(), x) - x_handle.begin());
+        size_t row = static_cast<size_t>(std::lower_bound(y_handle.begin(), y_handle.end(), y) - y_handle.begin());
+        bool new_column = column == x_handle.size() or x_handle[column] != x;
+        bool new_row = row == y_handle.size() or y_handle[row] != y;
+        if (new_column or new_row)
+            extend(column, new_column, x, row, new_row, y);
+
+        size_t index = row * true_width + column;
+        if (!occupied[index])
+        {
+            occupied[index] = true;
+            cell_index.push_back(index);
+        }
+        raw_map[index] = static_cast<Value>(value);
+        raw_row = row;
+        return new_column or new_row;
+    }
+
+    /**
+     * @brief Creates a matrix with the intensities extracted from the files, and adds pixels to create a uniform pixel size and to allow the build of a BMP figure. The matrix is filled with the
+     * resampling plan, which is computed once per map, and every row is a gather of raw values.
+     *
+     * @param threads Amount of worker threads to fill and normalize the matrix.
+     * @return Returns a vector with the flattened matrix with the intensity values extracted from the raw map. Creates a uniform spacing.
+     */
+    std::vector<double> show_formatted_grid(const unsigned &threads = 1)
+    {
+        profile_scope scope("show_formatted_grid");
+        warn_origin();
+        const resampling_plan &plan = show_resampling_plan();
+        std::vector<double> formatted_grid(static_cast<size_t>(plan.width) * plan.length);
+        std::vector<double> maxima(std::max(threads, 1u), -std::numeric_limits<double>::infinity());
+        parallel_for(plan.length, threads, [&](const size_t i, const unsigned worker)
+                     {
+                         const Value *raw_row = raw_map.data() + plan.rows[i];
+                         double *row = formatted_grid.data() + i * plan.width;
+                         double maximum = maxima[worker];
+                         for (size_t j = 0; j < plan.width; j++)
+                         {
+                             row[j] = raw_row[plan.columns[j]];
+                             maximum = std::max(maximum, row[j]);
+                         }
+                         maxima[worker] = maximum; });
+
+        double maximum = *std::max_element(maxima.begin(), maxima.end());
+        parallel_for(plan.length, threads, [&](const size_t i, const unsigned)
+                     {
+                         double *row = formatted_grid.data() + i * plan.width;
+                         for (size_t j = 0; j < plan.width; j++)
+                             row[j] = row[j] / maximum; });
+        return formatted_grid;
+    }
+
+    /**
+     * @brief Finds the maximum of the formatted grid without building it: the maximum of the raw values at the raw rows and columns used by the resampling plan.
+     *
+     * @return Returns the value used to normalize the formatted grid.
+     */
+    double show_formatted_maximum()
+    {
+        warn_origin();
+        return show_formatted_maximum(raw_map);
+    }
+
+    /**
+     * @brief Finds the maximum of the formatted grid of another raw map with the same positions, e.g. from show_placed. Once the resampling plan was computed it does not change the map,
+     * so several threads can use it at the same time.
+     *
+     * @param raw Raw map with the dimensions of this map.
+     * @return Returns the value used to normalize the formatted grid of that raw map.
+     */
+    double show_formatted_maximum(const std::vector<Value> &raw)
+    {
+        if (raw.size() != raw_map.size())
+            throw std::invalid_argument("The raw map does not have the dimensions of the map.");
+        const resampling_plan &plan = show_resampling_plan();
+        // The plan only moves forward through the raw map, so every raw row and column used appears as a run of equal values.
+        std::vector<uint32_t> columns;
+        for (size_t j = 0; j < plan.width; j++)
+        {
+            if (columns.empty() or columns.back() != plan.columns[j])
+                columns.push_back(plan.columns[j]);
+        }
+        double maximum = -std::numeric_limits<double>::infinity();
+        for (size_t i = 0; i < plan.length; i++)
+        {
+            if (i > 0 and plan.rows[i] == plan.rows[i - 1])
+                continue;
+            const Value *raw_row = raw.data() + plan.rows[i];
+            for (std::vector<uint32_t>::const_iterator c = columns.begin(); c < columns.end(); c++)
+                maximum = std::max(maximum, static_cast<double>(raw_row[*c]));
+        }
+        return maximum;
+    }
+
+    /**
+     * @brief Fills a band of rows of the formatted grid, normalized with the maximum from show_formatted_maximum. The values are the same as the rows of show_formatted_grid,
+     * so a map can be written band by band without keeping the whole grid in memory.
+     *
+     * @param first First row of the band.
+     * @param count Amount of rows in the band.
+     * @param maximum Maximum of the formatted grid.
+     * @param band Pointer to the memory of the band, with space for count times the formatted width values.
+     * @param threads Amount of worker threads to fill the rows.
+     */
+    void show_formatted_rows(const uint64_t &first, const uint64_t &count, const double &maximum, double *band, const unsigned &threads = 1)
+    {
+        show_formatted_rows(raw_map, first, count, maximum, band, threads);
+    }
+
+    /**
+     * @brief Fills a band of rows of the formatted grid of another raw map with the same positions, e.g. from show_placed. Like show_formatted_maximum(raw), it can be used by several
+     * threads at the same time once the resampling plan was computed.
+     *
+     * @param raw Raw map with the dimensions of this map.
+     * @param first First row of the band.
+     * @param count Amount of rows in the band.
+     * @param maximum Value used to normalize the rows.
+     * @param band Pointer to the memory of the band, with space for count times the formatted width values.
+     * @param threads Amount of worker threads to fill the rows.
+     */
+    void show_formatted_rows(const std::vector<Value> &raw, const uint64_t &first, const uint64_t &count, const double &maximum, double *band, const unsigned &threads = 1)
+    {
+        if (raw.size() != raw_map.size())
+            throw std::invalid_argument("The raw map does not have the dimensions of the map.");
+        const resampling_plan &plan = show_resampling_plan();
+        if (first + count > plan.length)
+            throw std::invalid_argument("Error: The requested rows go out of the formatted grid.");
+        parallel_for(count, threads, [&](const size_t i, const unsigned)
+                     {
+                         const Value *raw_row = raw.data() + plan.rows[first + i];
+                         double *row = band + i * plan.width;
+                         for (size_t j = 0; j < plan.width; j++)
+                             row[j] = static_cast<double>(raw_row[plan.columns[j]]) / maximum; });
+    }
+
+    /**
+     * @brief Calculates the width and length for the formatted grid.
+     *
+     * @param size_direction Specify wether the width or the length is needed.
+     * @return Returns a 32-bit integer with the width or length measured in pixels.
+     */
+    uint32_t show_formatted_dimensions(const std::string &size_direction)
+    {
+        if (size_direction == "width")
+            return formatted_size(x_handle, x_step);
+        else if (size_direction == "length")
+            return formatted_size(y_handle, y_step);
+        else
+            throw std::invalid_argument("Can't access requested dimension");
+    }
+
+    /**
+     * @brief Tables to build the formatted grid from the raw map: the raw column of every pixel column and the position in the raw map of the raw row of every pixel row.
+     * They only depend on the positions, so every map with the same positions uses the same plan.
+     */
+    struct resampling_plan
+    {
+        uint32_t width = 0;
+        uint32_t length = 0;
+        std::vector<uint32_t> columns;
+        std::vector<uint64_t> rows;
+    };
+
+    /**
+     * @brief Returns the resampling plan of the formatted grid, computing it the first time it is requested. The pixel steps are accumulated in the same way as in the previous releases,
+     * so the formatted grid does not change.
+     *
+     * @return Returns a reference to the plan kept by the map.
+     */
+    const resampling_plan &show_resampling_plan()
+    {
+        if (plan_ready)
+            return plan;
+        plan.width = formatted_size(x_handle, x_step);
+        plan.length = formatted_size(y_handle, y_step);
+        std::vector<uint32_t> x_raw = raw_positions(x_handle, x_step, plan.width);
+        std::vector<uint32_t> y_raw = raw_positions(y_handle, y_step, plan.length);
+        plan.columns = x_raw;
+        plan.rows.resize(plan.length);
+        for (size_t i = 0; i < plan.length; i++)
+        {
+            if (y_raw[i] >= true_length)
+                throw std::invalid_argument("Error: The formatted grid goes out of the raw map.");
+            plan.rows[i] = static_cast<uint64_t>(y_raw[i]) * true_width;
+        }
+        for (size_t j = 0; j < plan.width; j++)
+        {
+            if (x_raw[j] >= true_width)
+                throw std::invalid_argument("Error: The formatted grid goes out of the raw map.");
+        }
+        plan_ready = true;
+        return plan;
+    }
+
+private:
+    /**
+     * @brief Prints a warning when the map has no point at the coordinate (0,0). The warning is printed once per map.
+     */
+    void warn_origin()
+    {
+        if (!origin_warned and (x_handle.at(0) != 0 or y_handle.at(0) != 0))
+        {
+            origin_warned = true;
+            std::cout << "Please note that if no point exists for coordinates (0,0), unusual behaviour may occur with the bitmap and formatted grid on this release." << '\n'
+                      << "Lost of information may occur!" << '\n'
+                      << "Future work will look for a way to fix such inconvenience." << '\n';
+        }
+    }
+
+    /**
+     * @brief Builds the axes, the step sizes and the raw map. Each intensity is placed with a binary search of its coordinates in the sorted axes. Positions without data are filled with zero.
+     *
+     * @param x The x coordinate of every spectrum.
+     * @param y The y coordinate of every spectrum.
+     * @param intensity_fill The intensity of every spectrum.
+     */
+    void assemble(const std::vector<double> &x, const std::vector<double> &y, const std::vector<double> &intensity_fill)
+    {
+        profile_scope scope("data_map");
+        x_handle = x;
+        y_handle = y;
+        std::sort(x_handle.begin(), x_handle.end());
+        std::sort(y_handle.begin(), y_handle.end());
+        auto last_x = std::unique(x_handle.begin(), x_handle.end());
+        auto last_y = std::unique(y_handle.begin(), y_handle.end());
+        x_handle.erase(last_x, x_handle.end());
+        y_handle.erase(last_y, y_handle.end());
+        true_width = (uint32_t)x_handle.size();
+        true_length = (uint32_t)y_handle.size();
+        x_step = axis_steps(x_handle);
+        y_step = axis_steps(y_handle);
+
+        raw_map.assign(static_cast<size_t>(true_width) * true_length, 0);
+        cell_index.resize(intensity_fill.size());
+        occupied.assign(raw_map.size(), false);
+        for (size_t i = 0; i < intensity_fill.size(); i++)
+        {
+            size_t column = static_cast<size_t>(std::lower_bound(x_handle.begin(), x_handle.end(), x[i]) - x_handle.begin());
+            size_t row = static_cast<size_t>(std::lower_bound(y_handle.begin(), y_handle.end(), y[i]) - y_handle.begin());
+            size_t index = row * true_width + column;
+            if (occupied[index])
+                throw std::invalid_argument("Two files found for the same position. Make sure directory only has one file per position.");
+            occupied[index] = true;
+            raw_map[index] = static_cast<Value>(intensity_fill[i]);
+            cell_index[i] = index;
+        }
+    }
+
+    /**
+     * @brief Computes the step sizes between contiguous values of a sorted axis, rounded to integers.
+     *
+     * @param handle Unique values of the axis.
+     * @return Returns a vector with one step less than the values of the axis.
+     */
+    static std::vector<uint32_t> axis_steps(const std::vector<double> &handle)
+    {
+        std::vector<uint32_t> step;
+        for (uint64_t i = 1; i < handle.size(); i++)
+        {
+            uint32_t step_size = static_cast<uint32_t>(std::llround(handle.at(i) - handle.at(i - 1)));
+            step.push_back(step_size);
+        }
+        return step;
+    }
+
+    /**
+     * @brief Inserts a new column and/or row in the raw map, moving the values and the positions of the spectra. Called by update.
+     *
+     * @param column Position of the new x value in the axis.
+     * @param new_column True if a column is inserted.
+     * @param x The new x value.
+     * @param row Position of the new y value in the axis.
+     * @param new_row True if a row is inserted.
+     * @param y The new y value.
+     */
+    void extend(const size_t &column, const bool &new_column, const double &x, const size_t &row, const bool &new_row, const double &y)
+    {
+        uint32_t width = true_width + (new_column ? 1 : 0);
+        uint32_t length = true_length + (new_row ? 1 : 0);
+        auto moved = [&](const size_t &index)
+        {
+            size_t r = index / true_width;
+            size_t c = index % true_width;
+            if (new_row and r >= row)
+                r++;
+            if (new_column and c >= column)
+                c++;
+            return r * width + c;
+        };
+
+        std::vector<Value> map(static_cast<size_t>(width) * length, 0);
+        std::vector<bool> filled(map.size(), false);
+        for (size_t i = 0; i < raw_map.size(); i++)
+        {
+            map[moved(i)] = raw_map[i];
+            filled[moved(i)] = occupied[i];
+        }
+        for (std::vector<size_t>::iterator c = cell_index.begin(); c < cell_index.end(); c++)
+            *c = moved(*c);
+        raw_map.swap(map);
+        occupied.swap(filled);
+        if (new_column)
+            x_handle.insert(x_handle.begin() + static_cast<std::ptrdiff_t>(column), x);
+        if (new_row)
+            y_handle.insert(y_handle.begin() + static_cast<std::ptrdiff_t>(row), y);
+        true_width = width;
+        true_length = length;
+        x_step = axis_steps(x_handle);
+        y_step = axis_steps(y_handle);
+        plan_ready = false;
+    }
+
+    /**
+     * @brief Computes the width or length of the formatted grid from the sorted axis and its steps: the range divided by the smallest step, rounded up to a multiple of 4.
+     *
+     * @param handle Unique values of the axis.
+     * @param step Step size between contiguous values.
+     * @return Returns the size in pixels.
+     */
+    static uint32_t formatted_size(const std::vector<double> &handle, const std::vector<uint32_t> &step)
+    {
+        if (step.empty())
+            throw std::invalid_argument("Error: At least two positions per direction are needed to build the formatted grid.");
+        std::pair<std::vector<double>::const_iterator, std::vector<double>::const_iterator> limits = std::minmax_element(handle.begin(), handle.end());
+        uint32_t size = (((uint32_t)*limits.second - (uint32_t)*limits.first) / *std::min_element(step.begin(), step.end())) + 1;
+        if (size % 4 != 0)
+            size = size + 4 - (size % 4);
+        return size;
+    }
+
+    /**
+     * @brief Computes the raw index of every pixel along one direction. The pixel where each raw step starts is accumulated from the step sizes, and the raw index moves to the next value when a pixel reaches it.
+     *
+     * @param handle Unique values of the axis.
+     * @param step Step size between contiguous values.
+     * @param size Size in pixels of the formatted grid in this direction.
+     * @return Returns a vector with the raw index of every pixel.
+     */
+    static std::vector<uint32_t> raw_positions(const std::vector<double> &handle, const std::vector<uint32_t> &step, const uint32_t &size)
+    {
+        std::pair<std::vector<double>::const_iterator, std::vector<double>::const_iterator> limits = std::minmax_element(handle.begin(), handle.end());
+        uint32_t range = (uint32_t)*limits.second - (uint32_t)*limits.first;
+        std::vector<uint32_t> pixel_step;
+        uint32_t accumulated = 0;
+        for (std::vector<uint32_t>::const_iterator i = step.begin(); i < step.end(); i++)
+        {
+            accumulated += (*i * size) / range;
+            pixel_step.push_back(accumulated);
+        }
+
+        std::vector<uint32_t> raw(size);
+        size_t m = 0;
+        uint32_t raw_index = 0;
+        for (uint32_t j = 0; j < size; j++)
+        {
+            if (m < pixel_step.size() and j == pixel_step[m])
+            {
+                raw_index++;
+                m++;
+            }
+            raw[j] = raw_index;
+        }
+        return raw;
+    }
+
+    uint32_t true_width = 0;
+    uint32_t true_length = 0;
+    std::vector<double> x_handle;
+    std::vector<double> y_handle;
+    std::vector<uint32_t> x_step;
+    std::vector<uint32_t> y_step;
+    std::vector<Value> raw_map;
+    /**
+     * @brief Position in the raw map of every spectrum used to construct the map, used by refill.
+     */
+    std::vector<size_t> cell_index;
+    /**
+     * @brief True for the positions of the raw map that have a spectrum.
+     */
+    std::vector<bool> occupied;
+    resampling_plan plan;
+    bool plan_ready = false;
+    bool origin_warned = false;
+};
+
+typedef basic_data_map<double> data_map;
+
+//                                            End class data_map                                            //
+//==========================================================================================================//
+//                                          Begin class spectrum_cube                                       //
+
+/**
+ * @brief Class to keep all the spectra of a map in memory as a cube (x, y, energy). The files are read once and any amount of maps at different energies can be extracted afterwards.
+ * All the spectra must share the same energy axis. The intensities are stored with the type Value: float halves the memory of the cube, while the sums and the interpolations of the
+ * extraction are still done in double precision. The name spectrum_cube refers to the double precision class.
+ */
+template <typename Value>
+class basic_spectrum_cube
+{
+public:
+    /**
+     * @brief Construct a new spectrum cube object by reading every file of a directory listing.
+     *
+     * @param files Paths to the data files, comes from opendirectory.
+     * @param threads Amount of worker threads to read the files.
+     */
+    basic_spectrum_cube(const std::vector<fs::path> &files, const unsigned &threads)
+        : basic_spectrum_cube(files, threads, fs::path())
+    {
+    }
+
+    /**
+     * @brief Construct a new spectrum cube object using a binary cache of the directory. Spectra whose file has the same size and modification time as in the cache are copied from it,
+     * new or modified files are read and the cache is written again if anything changed. If the cache does not exist or belongs to another directory, all the files are read and the cache is created.
+     *
+     * @param files Paths to the data files, comes from opendirectory.
+     * @param threads Amount of worker threads to read the files.
+     * @param cache Path to the binary cache file. If it is empty no cache is used. The cache keeps the intensities in double precision, so it can be shared by cubes of any storage type.
+     */
+    basic_spectrum_cube(const std::vector<fs::path> &files, const unsigned &threads, const fs::path &cache)
+    {
+        profile_scope scope("spectrum_cube");
+        if (files.empty())
+            throw std::invalid_argument("Error while processing the files: The directory is empty.");
+
+        directory = fs::absolute(files[0].parent_path()).lexically_normal().string();
+        file_names.resize(files.size());
+        file_sizes.resize(files.size());
+        file_times.resize(files.size());
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            file_names[i] = files[i].filename().string();
+            file_sizes[i] = fs::file_size(files[i]);
+            file_times[i] = static_cast<int64_t>(fs::last_write_time(files[i]).time_since_epoch().count());
+        }
+        pos_x.resize(files.size());
+        pos_y.resize(files.size());
+
+        // Rows that can be copied from the cache, the rest of the files are read.
+        std::vector<const cube_cache_record *> cached_rows(files.size(), nullptr);
+        std::unique_ptr<mapped_file> mapped;
+        const double *cached_intensity = nullptr;
+        uint64_t cached_files = 0;
+        if (!cache.empty() and fs::exists(cache))
+        {
+            mapped = std::make_unique<mapped_file>(cache);
+            cached_intensity = open_cache(*mapped, cached_rows, cached_files);
+        }
+
+        std::vector<size_t> pending;
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            if (cached_rows[i] == nullptr)
+                pending.push_back(i);
+        }
+        if (pending.size() == files.size())
+        {
+            std::vector<double> first_intensity;
+            readspectrum(files[0], energy_ax, first_intensity);
+        }
+        channels = energy_ax.size();
+        intensity.resize(files.size() * channels);
+
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            if (cached_rows[i] == nullptr)
+                continue;
+            const cube_cache_record &record = *cached_rows[i];
+            std::copy(cached_intensity + record.row * channels, cached_intensity + (record.row + 1) * channels, intensity.begin() + i * channels);
+            pos_x[i] = record.x;
+            pos_y[i] = record.y;
+        }
+        cached_spectra = files.size() - pending.size();
+        mapped.reset();
+
+        std::vector<uint64_t> file_bytes(files.size());
+        std::vector<fs::path> pending_files(pending.size());
+        for (size_t k = 0; k < pending.size(); k++)
+            pending_files[k] = files[pending[k]];
+        read_directory(pending_files, threads, [&](const size_t k, const std::string &content, const unsigned)
+                       {
+                         size_t i = pending[k];
+                         thread_local std::vector<double> current_energy;
+                         thread_local std::vector<Value> current_intensity;
+                         parsespectrum(content, files[i], current_energy, current_intensity);
+                         file_bytes[i] = content.size();
+                         if (current_energy != energy_ax)
+                             throw std::invalid_argument("Error reading the file " + files[i].string() + ": All the spectra must share the same energy axis to build a cube.");
+                         std::copy(current_intensity.begin(), current_intensity.end(), intensity.begin() + i * channels);
+                         pos_x[i] = findcoords(files[i], "x");
+                         pos_y[i] = findcoords(files[i], "y"); });
+
+        std::vector<size_t> order(files.size());
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            order[i] = i;
+            bytes_read += file_bytes[i];
+        }
+        scope.add_read(bytes_read);
+        scope.add_files(pending.size());
+        std::sort(order.begin(), order.end(), [&](const size_t a, const size_t b)
+                  { return std::make_tuple(pos_x[a], pos_y[a]) < std::make_tuple(pos_x[b], pos_y[b]); });
+        for (size_t i = 1; i < order.size(); i++)
+        {
+            if (pos_x[order[i]] == pos_x[order[i - 1]] and pos_y[order[i]] == pos_y[order[i - 1]])
+                throw std::invalid_argument("Two files found for the same position. Make sure directory only has one file per position.");
+        }
+
+        if (!cache.empty() and (!pending.empty() or cached_files != files.size()))
+            write_cache(cache);
+    }
+
+    /**
+     * @brief Extracts the integrated intensity of every spectrum in the cube. The integration window is located once for the whole map.
+     *
+     * @param energy Energy to be mapped.
+     * @param channels_per_side The amount of channels to integrate per side.
+     * @return Returns a vector with the integrated intensity for every spectrum, in the same order as the files.
+     */
+    std::vector<double> integrated_intensity(const double &energy, const uint64_t &channels_per_side)
+    {
+        profile_scope scope("extraction");
+        integration_window window = find_integration_window(energy_ax, energy, channels_per_side);
+        std::vector<double> values(pos_x.size());
+        if (!prefix_sums.empty())
+        {
+            for (size_t i = 0; i < values.size(); i++)
+            {
+                const long double *cumulative = prefix_sums.data() + i * (channels + 1);
+                values[i] = static_cast<double>(cumulative[window.upper + 1] - cumulative[window.lower]);
+            }
+            return values;
+        }
+        for (size_t i = 0; i < values.size(); i++)
+            values[i] = window_sum(intensity.data() + i * channels, window);
+        return values;
+    }
+
+    /**
+     * @brief Computes the cumulative sum of every spectrum so that integrated_intensity gets any window with two values per spectrum, whatever the amount of channels.
+     * The sums are stored as long double to keep the precision of small windows far from the start of the axis.
+     *
+     * @param threads Amount of worker threads.
+     */
+    void build_prefix_sums(const unsigned &threads)
+    {
+        profile_scope scope("prefix_sums");
+        prefix_sums.assign(pos_x.size() * (channels + 1), 0);
+        parallel_for(pos_x.size(), threads, [&](const size_t i, const unsigned)
+                     {
+                         const Value *spectrum_intensity = intensity.data() + i * channels;
+                         long double *cumulative = prefix_sums.data() + i * (channels + 1);
+                         for (size_t k = 0; k < channels; k++)
+                             cumulative[k + 1] = cumulative[k] + spectrum_intensity[k]; });
+    }
+
+    /**
+     * @brief Aligns the zero-loss peak of every spectrum to the average zero-loss peak of the cube. The shift of every spectrum is estimated from the cross-correlation of its
+     * zero-loss peak with the average, computed with Fourier transforms, and the spectrum is resampled onto the shared energy axis. The transform of the average is computed once
+     * and the spectra are processed by the worker threads. The cumulative sums are removed so they have to be built again.
+     *
+     * @param first First energy of the window around the zero-loss peak.
+     * @param last Last energy of the window.
+     * @param threads Amount of worker threads.
+     * @return Returns the shift of every spectrum in energy units, in the same order as the files: positive if its peak was at a higher energy than the average.
+     */
+    std::vector<double> align_zero_loss(const double &first, const double &last, const unsigned &threads)
+    {
+        profile_scope scope("alignment");
+        alignment_window window = find_alignment_window(energy_ax, first, last);
+        for (size_t i = 0; i < pos_x.size(); i++)
+        {
+            const Value *spectrum_intensity = intensity.data() + i * channels;
+            for (size_t k = window.lower; k <= window.upper; k++)
+                window.reference[k - window.lower] += static_cast<double>(spectrum_intensity[k]) / static_cast<double>(pos_x.size());
+        }
+        fft(window.reference, false);
+
+        std::vector<double> shifts(pos_x.size());
+        parallel_for(pos_x.size(), threads, [&](const size_t i, const unsigned)
+                     {
+                         thread_local std::vector<std::complex<double>> buffer;
+                         thread_local std::vector<double> copy;
+                         Value *spectrum_intensity = intensity.data() + i * channels;
+                         double shift = alignment_shift(spectrum_intensity, window, buffer);
+                         resample_shifted(spectrum_intensity, channels, shift, copy);
+                         shifts[i] = shift * window.step; });
+        prefix_sums.clear();
+        return shifts;
+    }
+
+    /**
+     * @brief Fits a power law A*E^-r to a pre-edge window of every spectrum and subtracts it, from the start of the window to the end of the axis. The window and the sums of the
+     * logarithms of its energies are computed once for the whole cube, and every spectrum is fitted with fit_power_law and subtracted right away by the worker threads, while it is
+     * still in cache. The maps extracted afterwards use the subtracted
+     * signal, and the cumulative sums are removed so they have to be built again.
+     *
+     * @param first First energy of the pre-edge window, must be positive.
+     * @param last Last energy of the pre-edge window.
+     * @param threads Amount of worker threads.
+     * @return Returns the amount of spectra that could not be fitted (less than two positive intensities in the window); they are not changed.
+     */
+    uint64_t subtract_background(const double &first, const double &last, const unsigned &threads)
+    {
+        profile_scope scope("background");
+        background_window window = find_background_window(energy_ax, first, last);
+        std::vector<uint64_t> unfitted(std::max(threads, 1u), 0);
+        parallel_for(pos_x.size(), threads, [&](const size_t i, const unsigned worker)
+                     {
+                         Value *spectrum_intensity = intensity.data() + i * channels;
+                         power_law fit = fit_power_law(spectrum_intensity, window);
+                         if (fit.fitted)
+                             subtract_power_law(spectrum_intensity, window, fit);
+                         else
+                             unfitted[worker]++; });
+        prefix_sums.clear();
+        uint64_t total = 0;
+        for (std::vector<uint64_t>::const_iterator u = unfitted.begin(); u < unfitted.end(); u++)
+            total += *u;
+        return total;
+    }
+
+    /**
+     * @brief Principal component analysis of the spectra of the cube, as a pixels x channels matrix, with a randomized truncated singular value decomposition (see randomized_pca).
+     * The passes over the spectra are split between the worker threads.
+     *
+     * @param components Amount of principal components.
+     * @param threads Amount of worker threads.
+     * @return Returns the mean spectrum, the singular values, the loadings and the scores of every spectrum.
+     */
+    principal_components decompose(const uint64_t &components, const unsigned &threads)
+    {
+        profile_scope scope("pca");
+        return randomized_pca(intensity.data(), pos_x.size(), channels, components, threads);
+    }
+
+    /**
+     * @brief Replaces every spectrum with its reconstruction from the principal components, which keeps the signal of the components and removes the rest, mostly noise. The maps
+     * extracted afterwards use the reconstructed spectra, and the cumulative sums are removed so they have to be built again.
+     *
+     * @param pca Principal components of this cube, from decompose.
+     * @param threads Amount of worker threads.
+     */
+    void reconstruct(const principal_components &pca, const unsigned &threads)
+    {
+        if (pca.pixels != pos_x.size() or pca.channels != channels)
+            throw std::invalid_argument("The principal components do not have the dimensions of the cube.");
+        profile_scope scope("pca_reconstruction");
+        reconstruct_components(intensity.data(), pca, pca.components, threads);
+        prefix_sums.clear();
+    }
+
+    /**
+     * @brief Returns the loading of a principal component as a spectrum with the energy axis of the cube.
+     *
+     * @param pca Principal components of this cube, from decompose.
+     * @param component Index of the component, from 0.
+     * @return Returns a spectrum with the loading as intensity.
+     */
+    spectrum show_loading(const principal_components &pca, const uint64_t &component)
+    {
+        if (component >= pca.components or pca.channels != channels)
+            throw std::invalid_argument("The component is not part of the principal components of the cube.");
+        std::vector<double>::const_iterator first = pca.loadings.begin() + static_cast<std::ptrdiff_t>(component * channels);
+        return spectrum(energy_ax, std::vector<double>(first, first + static_cast<std::ptrdiff_t>(channels)));
+    }
+
+    /**
+     * @brief Returns the scores of a principal component as a map with the positions of the spectra.
+     *
+     * @param pca Principal components of this cube, from decompose.
+     * @param component Index of the component, from 0.
+     * @return Returns a data_map with the score of every spectrum.
+     */
+    data_map show_scores(const principal_components &pca, const uint64_t &component)
+    {
+        if (component >= pca.components or pca.pixels != pos_x.size())
+            throw std::invalid_argument("The component is not part of the principal components of the cube.");
+        std::vector<double>::const_iterator first = pca.scores.begin() + static_cast<std::ptrdiff_t>(component * pca.pixels);
+        return show_map(std::vector<double>(first, first + static_cast<std::ptrdiff_t>(pca.pixels)));
+    }
+
+    /**
+     * @brief Clusters the spectra of the cube in classes with k-means (see kmeans_spectra). The passes over the spectra are split between the worker threads.
+     *
+     * @param classes Amount of classes.
+     * @param threads Amount of worker threads.
+     * @return Returns the centroid, size and spectra of every class, the largest class first.
+     */
+    spectral_classes classify(const uint64_t &classes, const unsigned &threads)
+    {
+        profile_scope scope("kmeans");
+        return kmeans_spectra(intensity.data(), pos_x.size(), channels, classes, threads);
+    }
+
+    /**
+     * @brief Returns the centroid of a class as a spectrum with the energy axis of the cube.
+     *
+     * @param result Classes of this cube, from classify.
+     * @param index Index of the class, from 0.
+     * @return Returns a spectrum with the mean intensities of the spectra of the class.
+     */
+    spectrum show_centroid(const spectral_classes &result, const uint64_t &index)
+    {
+        if (index >= result.classes or result.channels != channels)
+            throw std::invalid_argument("The class is not part of the classes of the cube.");
+        std::vector<double>::const_iterator first = result.centroids.begin() + static_cast<std::ptrdiff_t>(index * channels);
+        return spectrum(energy_ax, std::vector<double>(first, first + static_cast<std::ptrdiff_t>(channels)));
+    }
+
+    /**
+     * @brief Returns the class of every spectrum as a map, numbered from 1 so the class map can be drawn with build_class_bitmap.
+     *
+     * @param result Classes of this cube, from classify.
+     * @return Returns a data_map with the class number of every spectrum.
+     */
+    data_map show_classes(const spectral_classes &result)
+    {
+        if (result.pixels != pos_x.size())
+            throw std::invalid_argument("The classes do not have the dimensions of the cube.");
+        std::vector<double> numbers(result.labels.size());
+        for (size_t i = 0; i < numbers.size(); i++)
+            numbers[i] = static_cast<double>(result.labels[i]) + 1;
+        return show_map(numbers);
+    }
+
+    /**
+     * @brief Returns the energies of the axis between two limits, e.g. to move an integration window one channel at a time through an energy range.
+     *
+     * @param first Lower limit of the range.
+     * @param last Upper limit of the range.
+     * @return Returns a vector with the energies of the axis within the limits, both included.
+     */
+    std::vector<double> show_energies_between(const double &first, const double &last)
+    {
+        std::vector<double>::iterator begin = std::lower_bound(energy_ax.begin(), energy_ax.end(), first);
+        std::vector<double>::iterator end = std::upper_bound(energy_ax.begin(), energy_ax.end(), last);
+        if (begin >= end)
+            throw std::invalid_argument("Error: The energy axis has no values within the requested range.");
+        return std::vector<double>(begin, end);
+    }
+
+    /**
+     * @brief Extracts the interpolated intensity of every spectrum in the cube. The known values for the interpolation are located once for the whole map.
+     *
+     * @param energy Energy to be mapped.
+     * @return Returns a vector with the interpolated intensity for every spectrum, in the same order as the files.
+     */
+    std::vector<double> interpolated_intensity(const double &energy)
+    {
+        profile_scope scope("extraction");
+        interpolation_point point = find_interpolation_point(energy_ax, energy);
+        std::vector<double> values(pos_x.size());
+        for (size_t i = 0; i < values.size(); i++)
+            values[i] = interpolate(intensity.data() + i * channels, point);
+        return values;
+    }
+
+    /**
+     * @brief Computes several descriptors of every spectrum within the integration window in one pass over each spectrum, see describe_window. The window is located once for the whole map.
+     *
+     * @param energy Energy to be mapped.
+     * @param channels_per_side The amount of channels to integrate per side.
+     * @return Returns one vector per descriptor, in the order of the template arguments, with the value of every spectrum in the same order as the files.
+     */
+    template <typename... Descriptors>
+    std::array<std::vector<double>, sizeof...(Descriptors)> descriptors(const double &energy, const uint64_t &channels_per_side)
+    {
+        profile_scope scope("extraction");
+        integration_window window = find_integration_window(energy_ax, energy, channels_per_side);
+        std::array<std::vector<double>, sizeof...(Descriptors)> maps;
+        for (std::vector<double> &map : maps)
+            map.resize(pos_x.size());
+        for (size_t i = 0; i < pos_x.size(); i++)
+        {
+            std::array<double, sizeof...(Descriptors)> values = describe_window<Descriptors...>(energy_ax, intensity.data() + i * channels, window);
+            for (size_t d = 0; d < values.size(); d++)
+                maps[d][i] = values[d];
+        }
+        return maps;
+    }
+
+    /**
+     * @brief Creates a data_map from one value per spectrum, e.g. the result of integrated_intensity or interpolated_intensity.
+     *
+     * @param values One value for every spectrum in the cube.
+     * @return Returns the data_map object with the values placed at the coordinates of each spectrum.
+     */
+    data_map show_map(const std::vector<double> &values)
+    {
+        if (values.size() != pos_x.size())
+            throw std::invalid_argument("The amount of values does not coincide with the amount of spectra in the cube.");
+        return data_map(pos_x, pos_y, values);
+    }
+
+    /**
+     * @brief Returns the energy axis shared by all the spectra.
+     *
+     * @return Returns a vector with the energy values.
+     */
+    std::vector<double> show_energy_axis()
+    {
+        return energy_ax;
+    }
+
+    /**
+     * @brief Returns the x or the y coordinate of every spectrum, in the same order as the files.
+     *
+     * @param pos The coordinate of interest. Either "x" or "y".
+     * @return Returns a vector with the coordinates.
+     */
+    std::vector<double> show_positions(const std::string &pos)
+    {
+        if (pos == "x")
+            return pos_x;
+        else if (pos == "y")
+            return pos_y;
+        else
+            throw std::invalid_argument("Position can only be for x and y coordinates.");
+    }
+
+    /**
+     * @brief Provides direct access to the intensities of one spectrum, used by other containers built from the cube.
+     *
+     * @param pixel Index of the spectrum, in the same order as the files.
+     * @return Returns a pointer to the first intensity value of the spectrum, with the storage type of the cube.
+     */
+    const Value *show_spectrum(const size_t &pixel) const
+    {
+        return intensity.data() + pixel * channels;
+    }
+
+    /**
+     * @brief Provides the amount of spectra in the cube.
+     *
+     * @return Returns the amount of spectra.
+     */
+    uint64_t show_pixels()
+    {
+        return pos_x.size();
+    }
+
+    /**
+     * @brief Provides the total size of the data files read to build the cube. Spectra copied from the cache are not included.
+     *
+     * @return Returns the amount of bytes read from the files.
+     */
+    uint64_t show_size()
+    {
+        return bytes_read;
+    }
+
+    /**
+     * @brief Provides the amount of spectra that were copied from the binary cache instead of being read from their file.
+     *
+     * @return Returns the amount of spectra taken from the cache.
+     */
+    uint64_t show_cached()
+    {
+        return cached_spectra;
+    }
+
+    /**
+     * @brief Writes the cube into a binary cache file: a header, the directory, the size, modification time and coordinates of every file, the file names,
+     * the energy axis and the intensities. Every section is aligned to 8 bytes so the file can be memory-mapped. The file is written next to the cache and renamed at the end.
+     *
+     * @param cache Path to the binary cache file.
+     */
+    void write_cache(const fs::path &cache)
+    {
+        std::string names;
+        std::vector<cube_cache_record> records(file_names.size());
+        for (size_t i = 0; i < file_names.size(); i++)
+        {
+            records[i].size = file_sizes[i];
+            records[i].time = file_times[i];
+            records[i].x = pos_x[i];
+            records[i].y = pos_y[i];
+            records[i].row = i;
+            records[i].name_offset = names.size();
+            records[i].name_length = file_names[i].size();
+            names += file_names[i];
+        }
+        std::string padded_directory = directory;
+        padded_directory.resize(cache_padding(directory.size()), '\0');
+        names.resize(cache_padding(names.size()), '\0');
+
+        cube_cache_header header;
+        std::copy(cube_cache_signature, cube_cache_signature + 8, header.signature);
+        header.files = file_names.size();
+        header.channels = channels;
+        header.directory_length = directory.size();
+        header.names_length = names.size();
+
+        fs::path temporary = cache;
+        temporary += ".tmp";
+        std::ofstream output(temporary, std::ios::binary);
+        if (!output.is_open())
+            throw std::invalid_argument("Error creating the cache file " + cache.string());
+        output.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        output.write(padded_directory.data(), static_cast<std::streamsize>(padded_directory.size()));
+        output.write(reinterpret_cast<const char *>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(cube_cache_record)));
+        output.write(names.data(), static_cast<std::streamsize>(names.size()));
+        output.write(reinterpret_cast<const char *>(energy_ax.data()), static_cast<std::streamsize>(energy_ax.size() * sizeof(double)));
+        if constexpr (std::is_same_v<Value, double>)
+            output.write(reinterpret_cast<const char *>(intensity.data()), static_cast<std::streamsize>(intensity.size() * sizeof(double)));
+        else
+        {
+            // Other storage types are widened in blocks, so the cache does not depend on the precision of the cube.
+            std::vector<double> block(std::min<size_t>(intensity.size(), 1 << 16));
+            for (size_t first = 0; first < intensity.size(); first += block.size())
+            {
+                size_t count = std::min(block.size(), intensity.size() - first);
+                std::copy(intensity.begin() + first, intensity.begin() + first + count, block.begin());
+                output.write(reinterpret_cast<const char *>(block.data()), static_cast<std::streamsize>(count * sizeof(double)));
+            }
+        }
+        output.close();
+        if (!output)
+            throw std::invalid_argument("Error writing the cache file " + cache.string());
+        fs::rename(temporary, cache);
+    }
+
+private:
+    /**
+     * @brief Header at the beginning of the binary cache file.
+     */
+    struct cube_cache_header
+    {
+        char signature[8] = {};
+        uint64_t files = 0;
+        uint64_t channels = 0;
+        uint64_t directory_length = 0;
+        uint64_t names_length = 0;
+    };
+
+    /**
+     * @brief Information stored in the binary cache for every file.
+     */
+    struct cube_cache_record
+    {
+        uint64_t size = 0;
+        int64_t time = 0;
+        double x = 0;
+        double y = 0;
+        uint64_t row = 0;
+        uint64_t name_offset = 0;
+        uint64_t name_length = 0;
+    };
+
+    static constexpr char cube_cache_signature[8] = {'S', 'V', 'C', 'U', 'B', 'E', '0', '1'};
+
+    /**
+     * @brief Rounds a size up to a multiple of 8 bytes.
+     */
+    static size_t cache_padding(const size_t &size)
+    {
+        return (size + 7) / 8 * 8;
+    }
+
+    /**
+     * @brief Checks a mapped cache file and finds the files of the directory that did not change since the cache was written. The energy axis is taken from the cache if any file can be reused.
+     *
+     * @param mapped The mapped cache file.
+     * @param cached_rows Filled with a pointer to the record of every file that can be copied from the cache, or nullptr if the file has to be read.
+     * @param cached_files Filled with the amount of files stored in the cache.
+     * @return Returns a pointer to the intensities stored in the cache, or nullptr if the cache can't be used.
+     */
+    const double *open_cache(const mapped_file &mapped, std::vector<const cube_cache_record *> &cached_rows, uint64_t &cached_files)
+    {
+        const char *data = mapped.show_data();
+        size_t size = mapped.show_size();
+        if (size < sizeof(cube_cache_header))
+            return nullptr;
+        cube_cache_header header;
+        std::memcpy(&header, data, sizeof(header));
+        if (!std::equal(cube_cache_signature, cube_cache_signature + 8, header.signature) or header.directory_length > size or header.names_length > size or header.files > size or header.channels > size)
+            return nullptr;
+        size_t records_offset = sizeof(header) + cache_padding(header.directory_length);
+        size_t names_offset = records_offset + header.files * sizeof(cube_cache_record);
+        size_t energy_offset = names_offset + header.names_length;
+        size_t intensity_offset = energy_offset + header.channels * sizeof(double);
+        if (intensity_offset + header.files * header.channels * sizeof(double) != size or header.channels == 0)
+            return nullptr;
+        if (std::string(data + sizeof(header), header.directory_length) != directory)
+            return nullptr;
+
+        const cube_cache_record *records = reinterpret_cast<const cube_cache_record *>(data + records_offset);
+        std::unordered_map<std::string, const cube_cache_record *> by_name;
+        for (size_t r = 0; r < header.files; r++)
+        {
+            if (records[r].name_offset + records[r].name_length > header.names_length or records[r].row >= header.files)
+                return nullptr;
+            by_name[std::string(data + names_offset + records[r].name_offset, records[r].name_length)] = &records[r];
+        }
+
+        bool reused = false;
+        for (size_t i = 0; i < file_names.size(); i++)
+        {
+            auto found = by_name.find(file_names[i]);
+            if (found != by_name.end() and found->second->size == file_sizes[i] and found->second->time == file_times[i])
+            {
+                cached_rows[i] = found->second;
+                reused = true;
+            }
+        }
+        cached_files = header.files;
+        if (!reused)
+            return nullptr;
+        const double *cached_energy = reinterpret_cast<const double *>(data + energy_offset);
+        energy_ax.assign(cached_energy, cached_energy + header.channels);
+        return reinterpret_cast<const double *>(data + intensity_offset);
+    }
+
+    /**
+     * @brief Vector to store the energy/frequency values shared by all the spectra.
+     */
+    std::vector<double> energy_ax;
+    /**
+     * @brief Vectors to store the coordinates of every spectrum.
+     */
+    std::vector<double> pos_x;
+    std::vector<double> pos_y;
+    /**
+     * @brief Vector to store the intensities, one spectrum after the other.
+     */
+    std::vector<Value> intensity;
+    /**
+     * @brief Vector to store the cumulative sum of every spectrum, channels + 1 values per spectrum starting with zero. Empty until build_prefix_sums is called.
+     */
+    std::vector<long double> prefix_sums;
+    /**
+     * @brief Amount of energy channels in every spectrum.
+     */
+    size_t channels = 0;
+    /**
+     * @brief Total size in bytes of the data files.
+     */
+    uint64_t bytes_read = 0;
+    /**
+     * @brief Amount of spectra copied from the binary cache.
+     */
+    uint64_t cached_spectra = 0;
+    /**
+     * @brief Directory of the data files and the name, size and modification time of every file, stored in the binary cache.
+     */
+    std::string directory;
+    std::vector<std::string> file_names;
+    std::vector<uint64_t> file_sizes;
+    std::vector<int64_t> file_times;
+};
+
+typedef basic_spectrum_cube<double> spectrum_cube;
+
+//                                           End class spectrum_cube                                        //
+//==========================================================================================================//
+//                                             Begin SIMD kernels                                           //
+
+/**
+ * @brief Adds a plane of intensities to an accumulator, element by element. Uses AVX-512 or AVX2 when the program is compiled for them (e.g. with -march=native), otherwise a scalar loop.
+ *
+ * @param plane Intensities of one energy channel for a group of pixels.
+ * @param sum Accumulator with one value per pixel.
+ * @param count Amount of pixels.
+ */
+void add_plane(const double *plane, double *sum, const size_t &count)
+{
+    size_t i = 0;
+#if defined(__AVX512F__)
+    for (; i + 8 <= count; i += 8)
+        _mm512_storeu_pd(sum + i, _mm512_add_pd(_mm512_loadu_pd(sum + i), _mm512_loadu_pd(plane + i)));
+#elif defined(__AVX2__)
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(sum + i, _mm256_add_pd(_mm256_loadu_pd(sum + i), _mm256_loadu_pd(plane + i)));
+#endif
+    for (; i < count; i++)
+        sum[i] += plane[i];
+}
+
+/**
+ * @brief Interpolates the intensity of a group of pixels between two planes of intensities, with the same formula as interpolate. Uses AVX-512 or AVX2 when the program is compiled for them, otherwise a scalar loop.
+ *
+ * @param lower Intensities of the lower energy channel.
+ * @param upper Intensities of the upper energy channel.
+ * @param point Indices and distances for the interpolation, comes from find_interpolation_point.
+ * @param values Output with one value per pixel.
+ * @param count Amount of pixels.
+ */
+void interpolate_planes(const double *lower, const double *upper, const interpolation_point &point, double *values, const size_t &count)
+{
+    size_t i = 0;
+#if defined(__AVX512F__)
+    __m512d offset = _mm512_set1_pd(point.offset);
+    __m512d span = _mm512_set1_pd(point.span);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m512d low = _mm512_loadu_pd(lower + i);
+        __m512d difference = _mm512_sub_pd(_mm512_loadu_pd(upper + i), low);
+        _mm512_storeu_pd(values + i, _mm512_add_pd(low, _mm512_div_pd(_mm512_mul_pd(offset, difference), span)));
+    }
+#elif defined(__AVX2__)
+    __m256d offset = _mm256_set1_pd(point.offset);
+    __m256d span = _mm256_set1_pd(point.span);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256d low = _mm256_loadu_pd(lower + i);
+        __m256d difference = _mm256_sub_pd(_mm256_loadu_pd(upper + i), low);
+        _mm256_storeu_pd(values + i, _mm256_add_pd(low, _mm256_div_pd(_mm256_mul_pd(offset, difference), span)));
+    }
+#endif
+    for (; i < count; i++)
+        values[i] = lower[i] + ((point.offset * (upper[i] - lower[i])) / point.span);
+}
+
+/**
+ * @brief Adds a plane of single precision intensities to a double precision accumulator, so the sum of many channels keeps the precision of add_plane. Every group of floats is
+ * widened to doubles in registers, which halves the memory read per pixel.
+ *
+ * @param plane Intensities of one energy channel for a group of pixels.
+ * @param sum Accumulator with one value per pixel.
+ * @param count Amount of pixels.
+ */
+void add_plane(const float *plane, double *sum, const size_t &count)
+{
+    size_t i = 0;
+#if defined(__AVX512F__)
+    // The masked conversion with every lane selected is the plain conversion, it avoids a false uninitialized warning of some GCC releases.
+    for (; i + 8 <= count; i += 8)
+        _mm512_storeu_pd(sum + i, _mm512_add_pd(_mm512_loadu_pd(sum + i), _mm512_maskz_cvtps_pd(0xFF, _mm256_loadu_ps(plane + i))));
+#elif defined(__AVX2__)
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(sum + i, _mm256_add_pd(_mm256_loadu_pd(sum + i), _mm256_cvtps_pd(_mm_loadu_ps(plane + i))));
+#endif
+    for (; i < count; i++)
+        sum[i] += plane[i];
+}
+
+/**
+ * @brief Interpolates the intensity of a group of pixels between two planes of single precision intensities. The values are widened to double before the difference is taken,
+ * so the result is the same as interpolate on the same float values.
+ *
+ * @param lower Intensities of the lower energy channel.
+ * @param upper Intensities of the upper energy channel.
+ * @param point Indices and distances for the interpolation, comes from find_interpolation_point.
+ * @param values Output with one value per pixel.
+ * @param count Amount of pixels.
+ */
+void interpolate_planes(const float *lower, const float *upper, const interpolation_point &point, double *values, const size_t &count)
+{
+    size_t i = 0;
+#if defined(__AVX512F__)
+    __m512d offset = _mm512_set1_pd(point.offset);
+    __m512d span = _mm512_set1_pd(point.span);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m512d low = _mm512_maskz_cvtps_pd(0xFF, _mm256_loadu_ps(lower + i));
+        __m512d difference = _mm512_sub_pd(_mm512_maskz_cvtps_pd(0xFF, _mm256_loadu_ps(upper + i)), low);
+        _mm512_storeu_pd(values + i, _mm512_add_pd(low, _mm512_div_pd(_mm512_mul_pd(offset, difference), span)));
+    }
+#elif defined(__AVX2__)
+    __m256d offset = _mm256_set1_pd(point.offset);
+    __m256d span = _mm256_set1_pd(point.span);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256d low = _mm256_cvtps_pd(_mm_loadu_ps(lower + i));
+        __m256d difference = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(upper + i)), low);
+        _mm256_storeu_pd(values + i, _mm256_add_pd(low, _mm256_div_pd(_mm256_mul_pd(offset, difference), span)));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        double low = lower[i];
+        values[i] = low + ((point.offset * (static_cast<double>(upper[i]) - low)) / point.span);
+    }
+}
+
+/**
+ * @brief Returns the instruction set used by the SIMD kernels in this build.
+ *
+ * @return Returns "AVX-512", "AVX2" or "scalar".
+ */
+std::string simd_kernels()
+{
+#if defined(__AVX512F__)
+    return "AVX-512";
+#elif defined(__AVX2__)
+    return "AVX2";
+#else
+    return "scalar";
+#endif
+}
+
+//                                              End SIMD kernels                                            //
+//==========================================================================================================//
+//                                        Begin class energy_major_cube                                     //
 
-        double maximum = formatted_grid.at((size_t)std::distance(formatted_grid.begin(), std::max_element(formatted_grid.begin(), formatted_grid.end())));
-        for (std::vector<double>::iterator i = formatted_grid.begin(); i < formatted_grid.end(); i++)
-            *i = *i / maximum;
-        return formatted_grid;
+/**
+ * @brief Class to keep the intensities of a spectrum_cube ordered by energy: all the pixels of an energy channel are contiguous in memory. Extracting a map only reads the planes
+ * of the channels involved, and the kernels process many pixels per instruction. The planes keep the storage type of the cube (float or double) and the maps are always accumulated
+ * in double precision; the name energy_major_cube refers to the double precision class.
+ */
+template <typename Value>
+class basic_energy_major_cube
+{
+public:
+    /**
+     * @brief Construct a new energy major cube object by transposing the intensities of a spectrum_cube.
+     *
+     * @param cube The spectrum_cube with the spectra of the map.
+     * @param threads Amount of worker threads.
+     */
+    basic_energy_major_cube(basic_spectrum_cube<Value> &cube, const unsigned &threads)
+    {
+        profile_scope scope("energy_major_cube");
+        energy_ax = cube.show_energy_axis();
+        pixels = cube.show_pixels();
+        planes.resize(energy_ax.size() * pixels);
+        // The transposition goes through blocks of pixels so that every spectrum read stays in cache while the planes are written.
+        const size_t block = 64;
+        size_t blocks = (pixels + block - 1) / block;
+        parallel_for(blocks, threads, [&](const size_t b, const unsigned)
+                     {
+                         size_t first = b * block;
+                         size_t last = std::min(first + block, pixels);
+                         for (size_t k = 0; k < energy_ax.size(); k++)
+                         {
+                             Value *plane = planes.data() + k * pixels;
+                             for (size_t p = first; p < last; p++)
+                                 plane[p] = cube.show_spectrum(p)[k];
+                         } });
+        worker_threads = threads;
     }
 
     /**
-     * @brief Calculates the width and length for the formatted grid.
+     * @brief Extracts the integrated intensity of every pixel by adding the planes of the channels within the window.
      *
-     * @param size_direction Specify wether the width or the length is needed.
-     * @return Returns a 32-bit integer with the width or length measured in pixels.
+     * @param energy Energy to be mapped.
+     * @param channels_per_side The amount of channels to integrate per side.
+     * @return Returns a vector with the integrated intensity for every spectrum, in the same order as the files.
      */
-    uint32_t show_formatted_dimensions(const std::string &size_direction)
+    std::vector<double> integrated_intensity(const double &energy, const uint64_t &channels_per_side)
     {
-        if (size_direction == "width")
-        {
-            uint32_t width = (((uint32_t)x_handle.at((size_t)std::distance(x_handle.begin(), std::max_element(x_handle.begin(), x_handle.end()))) - (uint32_t)x_handle.at((size_t)std::distance(x_handle.begin(), std::min_element(x_handle.begin(), x_handle.end())))) / x_step.at((size_t)std::distance(x_step.begin(), std::min_element(x_step.begin(), x_step.end())))) + 1;
+        profile_scope scope("extraction");
+        integration_window window = find_integration_window(energy_ax, energy, channels_per_side);
+        std::vector<double> values(pixels, 0);
+        for_each_block([&](const size_t first, const size_t count)
+                       {
+                           for (size_t k = window.lower; k <= window.upper; k++)
+                               add_plane(planes.data() + k * pixels + first, values.data() + first, count); });
+        return values;
+    }
 
-            if (width % 4 != 0)
-            {
-                width = width + 4 - (width % 4);
-            }
-            return width;
-        }
-        else if (size_direction == "length")
-        {
-            uint32_t length = (((uint32_t)y_handle.at((size_t)std::distance(y_handle.begin(), std::max_element(y_handle.begin(), y_handle.end()))) - (uint32_t)y_handle.at((size_t)std::distance(y_handle.begin(), std::min_element(y_handle.begin(), y_handle.end())))) / y_step.at((size_t)std::distance(y_step.begin(), std::min_element(y_step.begin(), y_step.end())))) + 1;
+    /**
+     * @brief Extracts the interpolated intensity of every pixel from the planes around the requested energy.
+     *
+     * @param energy Energy to be mapped.
+     * @return Returns a vector with the interpolated intensity for every spectrum, in the same order as the files.
+     */
+    std::vector<double> interpolated_intensity(const double &energy)
+    {
+        profile_scope scope("extraction");
+        interpolation_point point = find_interpolation_point(energy_ax, energy);
+        std::vector<double> values(pixels);
+        for_each_block([&](const size_t first, const size_t count)
+                       { interpolate_planes(planes.data() + point.lower * pixels + first, planes.data() + point.upper * pixels + first, point, values.data() + first, count); });
+        return values;
+    }
 
-            if (length % 4 != 0)
-            {
-                length = length + 4 - (length % 4);
-            }
-            return length;
-        }
-        else
-            throw std::invalid_argument("Can't access requested dimension");
+    /**
+     * @brief Provides the amount of pixels in the cube.
+     *
+     * @return Returns the amount of spectra.
+     */
+    uint64_t show_pixels()
+    {
+        return pixels;
     }
 
 private:
-    uint32_t true_width = 0;
-    uint32_t true_length = 0;
-    std::vector<double> x_handle;
-    std::vector<double> y_handle;
-    std::vector<uint32_t> x_step;
-    std::vector<uint32_t> y_step;
-    std::vector<double> raw_map;
+    /**
+     * @brief Runs a kernel over blocks of pixels with the worker threads. The blocks are small enough to keep the accumulators in cache while the planes are added.
+     *
+     * @param kernel Callable taking the first pixel and the amount of pixels of the block.
+     */
+    template <typename Kernel>
+    void for_each_block(Kernel kernel)
+    {
+        const size_t block = 4096;
+        size_t blocks = (pixels + block - 1) / block;
+        parallel_for(blocks, worker_threads, [&](const size_t b, const unsigned)
+                     { kernel(b * block, std::min(block, pixels - b * block)); });
+    }
+
+    /**
+     * @brief Vector to store the energy/frequency values shared by all the spectra.
+     */
+    std::vector<double> energy_ax;
+    /**
+     * @brief Vector to store the intensities, one plane of pixels per energy channel.
+     */
+    std::vector<Value> planes;
+    size_t pixels = 0;
+    unsigned worker_threads = 1;
 };
 
-//                                            End class data_map                                            //
+typedef basic_energy_major_cube<double> energy_major_cube;
+
+//                                         End class energy_major_cube                                      //
 //==========================================================================================================//
 //                                           Begin class BmpHeader                                          //
 
@@ -587,17 +4462,22 @@ public:
     BmpHeader(const uint64_t &width, const uint64_t &length)
     {
         if (width > INT32_MAX or length > INT32_MAX)
-        {
-            std::cout << "Map dimensions might result in unexpected behavior. Get formatted map with external argument";
-            exit(0);
-        }
-        else if (width % 4 != 0 or length % 4 != 0)
-        {
-            std::cout << "Dimensions are not allowed for BMP";
-            exit(0);
-        }
-        uint32_t size_of_map = static_cast<uint32_t>(width * length);
-        sizeOfBitmapFile += (size_of_map * 4);
+            throw std::invalid_argument("Map dimensions might result in unexpected behavior. Get formatted map with external argument");
+        uint64_t size_of_map = bitmap_row_size(width) * length;
+        if (size_of_map > UINT32_MAX - sizeOfBitmapFile)
+            throw std::invalid_argument("Map dimensions are too large for a BMP file. Get formatted map with external argument");
+        sizeOfBitmapFile += static_cast<uint32_t>(size_of_map);
+    }
+
+    /**
+     * @brief Computes the size of a row of pixels in the BMP file. Every pixel takes 3 bytes and rows are padded to a multiple of 4 bytes.
+     *
+     * @param width Width of the image in pixels.
+     * @return Returns the amount of bytes per row.
+     */
+    static uint64_t bitmap_row_size(const uint64_t &width)
+    {
+        return (3 * width + 3) / 4 * 4;
     }
 
     /**
@@ -640,10 +4520,7 @@ public:
     BmpInfoHeader(const uint64_t &formatted_width, const uint64_t &formatted_length)
     {
         if (formatted_width > INT32_MAX or formatted_length > INT32_MAX)
-        {
-            std::cout << "Map dimensions might result in unexpected behavior. Get formatted map with external argument";
-            exit(0);
-        }
+            throw std::invalid_argument("Map dimensions might result in unexpected behavior. Get formatted map with external argument");
         width = static_cast<int32_t>(formatted_width);
         height = static_cast<int32_t>(formatted_length);
         int32_t a = width;
@@ -696,47 +4573,311 @@ private:
 
 //                                          End class BmpInfoHeader                                           //
 //============================================================================================================//
+//                                          Begin class bitmap_writer                                         //
+
+/**
+ * @brief Colour table with 256 entries to turn a normalized intensity into the blue, green and red bytes of a BMP pixel.
+ */
+typedef std::array<std::array<uint8_t, 3>, 256> colormap_table;
+
+/**
+ * @brief Creates the colour table of one of the built-in colormaps. The colours of "viridis" and "inferno" are interpolated from a few reference colours of the matplotlib colormaps.
+ *
+ * @param name Name of the colormap: "orange" (the colours of the previous releases), "gray", "viridis" or "inferno".
+ * @return Returns the table with the blue, green and red bytes of each level.
+ */
+colormap_table make_colormap(const std::string &name)
+{
+    std::vector<std::array<double, 3>> anchors;
+    if (name == "orange")
+        anchors = {{0, 0, 0}, {255, 140, 0}};
+    else if (name == "gray")
+        anchors = {{0, 0, 0}, {255, 255, 255}};
+    else if (name == "viridis")
+        anchors = {{68, 1, 84}, {72, 40, 120}, {62, 74, 137}, {49, 104, 142}, {38, 130, 142}, {31, 158, 137}, {53, 183, 121}, {109, 205, 89}, {180, 222, 44}, {253, 231, 37}};
+    else if (name == "inferno")
+        anchors = {{0, 0, 4}, {31, 12, 72}, {85, 15, 109}, {136, 34, 106}, {186, 54, 85}, {227, 89, 51}, {249, 140, 10}, {249, 201, 50}, {252, 255, 164}};
+    else
+        throw std::invalid_argument("Colormap not identified. Allowed colormaps are: orange, gray, viridis, inferno");
+
+    colormap_table table;
+    for (size_t level = 0; level < 256; level++)
+    {
+        double position = static_cast<double>(level) * static_cast<double>(anchors.size() - 1) / 255.0;
+        size_t lower = std::min(static_cast<size_t>(position), anchors.size() - 2);
+        double fraction = position - static_cast<double>(lower);
+        for (size_t channel = 0; channel < 3; channel++)
+        {
+            double value = anchors[lower][channel] + fraction * (anchors[lower + 1][channel] - anchors[lower][channel]);
+            // The table stores blue, green and red, the order of the bytes in the BMP file.
+            table[level][2 - channel] = static_cast<uint8_t>(value);
+        }
+    }
+    return table;
+}
+
+/**
+ * @brief Amount of classes that a class bitmap can show, each one with its own colour.
+ */
+constexpr size_t class_colours = 20;
+
+/**
+ * @brief Creates the colour table of the class bitmaps: level 0 is black, for the positions of the grid without spectra, and level n is the colour of class n. The first 10 classes take
+ * the colours of the Tableau palette and the next 10 their lighter versions. The levels above class_colours are not used.
+ *
+ * @return Returns the table with the blue, green and red bytes of each level.
+ */
+colormap_table make_class_colormap()
+{
+    const std::array<std::array<uint8_t, 3>, class_colours> palette = {{{31, 119, 180}, {255, 127, 14}, {44, 160, 44}, {214, 39, 40}, {148, 103, 189}, {140, 86, 75}, {227, 119, 194}, {127, 127, 127}, {188, 189, 34}, {23, 190, 207},
+                                                                         {174, 199, 232}, {255, 187, 120}, {152, 223, 138}, {255, 152, 150}, {197, 176, 213}, {196, 156, 148}, {247, 182, 210}, {199, 199, 199}, {219, 219, 141}, {158, 218, 229}}};
+    colormap_table table = {};
+    for (size_t c = 0; c < palette.size(); c++)
+        table[c + 1] = {palette[c][2], palette[c][1], palette[c][0]};
+    return table;
+}
+
+/**
+ * @brief Converts a row of normalized intensities into the pixels of a BMP row. Values are clamped to the range [0, 1], NaN and negative values go to the first level of the colormap.
+ *
+ * @param row Pointer to the first value of the row.
+ * @param width Amount of values in the row.
+ * @param table Colour table of the colormap.
+ * @param pixel Pointer to the first byte of the row in the BMP data, with space for 3 bytes per value.
+ */
+void encode_bitmap_row(const double *row, const uint64_t &width, const colormap_table &table, uint8_t *pixel)
+{
+    for (uint64_t j = 0; j < width; j++)
+    {
+        double value = std::min(std::max(row[j] * 255.0, 0.0), 255.0);
+        const std::array<uint8_t, 3> &colour = table[static_cast<size_t>(value)];
+        pixel[0] = colour[0];
+        pixel[1] = colour[1];
+        pixel[2] = colour[2];
+        pixel += 3;
+    }
+}
+
+/**
+ * @brief Class to write a 24-bit BMP file row by row. The intensities are quantized to 256 levels and coloured through a colormap table, the rows are padded to a multiple of 4 bytes
+ * and collected in a buffer that is written to the file in large blocks.
+ */
+class bitmap_writer
+{
+public:
+    /**
+     * @brief Construct a new bitmap writer object: creates the BMP file and writes the headers.
+     *
+     * @param filename Name of the BMP file, including the extension.
+     * @param width Width of the image in pixels.
+     * @param length Height of the image in pixels.
+     * @param colormap Name of the colormap, see make_colormap.
+     */
+    bitmap_writer(const std::string &filename, const uint64_t &width, const uint64_t &length, const std::string &colormap) : bitmap_writer(filename, width, length, make_colormap(colormap))
+    {
+    }
+
+    /**
+     * @brief Construct a new bitmap writer object with a colour table that is not one of the named colormaps, e.g. the one of make_class_colormap.
+     *
+     * @param filename Name of the BMP file, including the extension.
+     * @param width Width of the image in pixels.
+     * @param length Height of the image in pixels.
+     * @param colours Colour table of the 256 levels.
+     */
+    bitmap_writer(const std::string &filename, const uint64_t &width, const uint64_t &length, const colormap_table &colours)
+        : table(colours), width(width), length(length), row_size(BmpHeader::bitmap_row_size(width))
+    {
+        BmpHeader header(width, length);
+        BmpInfoHeader info_header(width, length);
+        outputbm.open(filename, std::ios::binary);
+        if (!outputbm.is_open())
+            throw std::invalid_argument("Error creating BMP File " + filename);
+        header.write_header(outputbm);
+        info_header.write_infoheader(outputbm);
+        rows_per_block = std::max<uint64_t>(1, (1 << 20) / row_size);
+        buffer.reserve(rows_per_block * row_size);
+    }
+
+    /**
+     * @brief Adds rows of normalized intensities to the image, starting from the bottom row. Values are clamped to the range [0, 1].
+     *
+     * @param intensity Pointer to the first value of the rows, width values per row.
+     * @param rows Amount of rows.
+     */
+    void write_rows(const double *intensity, const uint64_t &rows)
+    {
+        if (rows_written + rows > length)
+            throw std::invalid_argument("Error: More rows than the height of the BMP file were written.");
+        for (uint64_t r = 0; r < rows; r++)
+        {
+            size_t start = buffer.size();
+            buffer.resize(start + row_size, 0);
+            encode_bitmap_row(intensity + r * width, width, table, buffer.data() + start);
+            if (buffer.size() >= rows_per_block * row_size)
+                flush();
+        }
+        rows_written += rows;
+    }
+
+    /**
+     * @brief Writes the remaining rows and closes the file. Throws an exception if the amount of rows is not the height of the image.
+     */
+    void close()
+    {
+        flush();
+        outputbm.close();
+        if (rows_written != length)
+            throw std::invalid_argument("Error: The BMP file was closed before all the rows were written.");
+        if (!outputbm)
+            throw std::invalid_argument("Error writing the BMP file.");
+    }
+
+private:
+    /**
+     * @brief Writes the buffered rows to the file.
+     */
+    void flush()
+    {
+        outputbm.write(reinterpret_cast<const char *>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+        buffer.clear();
+    }
+
+    colormap_table table;
+    uint64_t width = 0;
+    uint64_t length = 0;
+    uint64_t row_size = 0;
+    uint64_t rows_per_block = 1;
+    uint64_t rows_written = 0;
+    std::vector<uint8_t> buffer;
+    std::ofstream outputbm;
+};
+
+//                                           End class bitmap_writer                                          //
+//============================================================================================================//
 //                                          Begin output functions                                            //
 
 /**
- * @brief Creates a file and writes the matrix with format. Applies for both the raw and the bitmap matrix.
+ * @brief Appends a value to a text buffer with the same characters as an output stream with std::setprecision(6), right aligned in a field of the requested width.
+ *
+ * @param buffer Text where the value is appended.
+ * @param value Value to be written.
+ * @param field_width Minimum amount of characters, 0 for no alignment.
+ */
+void append_value(std::string &buffer, const double &value, const size_t &field_width)
+{
+    char digits[32];
+    std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value, std::chars_format::general, 6);
+    size_t size = static_cast<size_t>(result.ptr - digits);
+    if (size < field_width)
+        buffer.append(field_width - size, ' ');
+    buffer.append(digits, size);
+}
+
+/**
+ * @brief Appends rows of a matrix to a text buffer with the layout of external_plot: every value in a column of 10 characters followed by a space, one row per line.
+ *
+ * @param buffer Text where the rows are appended.
+ * @param map Pointer to the first value of the matrix.
+ * @param width Amount of values per row.
+ * @param first First row to be written.
+ * @param rows Amount of rows to be written.
+ */
+void append_rows(std::string &buffer, const double *map, const uint64_t &width, const uint64_t &first, const uint64_t &rows)
+{
+    buffer.reserve(buffer.size() + rows * (width * 11 + 1));
+    for (uint64_t i = first; i < first + rows; i++)
+    {
+        const double *row = map + i * width;
+        for (uint64_t j = 0; j < width; j++)
+        {
+            append_value(buffer, row[j], 10);
+            buffer.push_back(' ');
+        }
+        buffer.push_back('\n');
+    }
+}
+
+/**
+ * @brief Creates a file and writes the matrix with format. Applies for both the raw and the bitmap matrix. The rows are formatted in blocks of about 64 thousand values,
+ * several blocks at a time with the worker threads, and every block is written with a single call.
  *
  * @param map Matrix with the intensity values to be in the output.
  * @param width Width of the figure, comes from the class data_map functions.
  * @param length Height of the figure, comes from the class data_map functions.
  * @param output_filename Title of the output file.
+ * @param threads Amount of worker threads to format the values.
  */
-void external_plot(const std::vector<double> &map, const uint64_t &width, const uint64_t &length, std::string &output_filename)
+void external_plot(const std::vector<double> &map, const uint64_t &width, const uint64_t &length, std::string &output_filename, const unsigned &threads = 1)
 {
     if ((length * width) != map.size())
-    {
-        std::cout << "Dimensions and map do not coincide";
-        exit(0);
-    }
+        throw std::invalid_argument("Dimensions and map do not coincide");
     std::string filename = output_filename + ".txt";
     std::ofstream output(filename);
     if (!output.is_open())
-    {
-        std::cout << "Error opening the file " << filename << "!";
-        exit(0);
-    }
+        throw std::invalid_argument("Error opening the file " + filename + "!");
 
-    for (uint64_t i = 0; i < length; i++)
+    profile_scope scope("external_plot");
+    uint64_t block_rows = std::max<uint64_t>(1, (1 << 16) / std::max<uint64_t>(width, 1));
+    uint64_t blocks = (length + block_rows - 1) / block_rows;
+    std::vector<std::string> buffers(std::max(threads, 1u));
+    for (uint64_t start = 0; start < blocks; start += buffers.size())
     {
-        for (uint64_t j = 0; j < width; j++)
+        size_t count = static_cast<size_t>(std::min<uint64_t>(buffers.size(), blocks - start));
+        parallel_for(count, threads, [&](const size_t b, const unsigned)
+                     {
+                         uint64_t first = (start + b) * block_rows;
+                         buffers[b].clear();
+                         append_rows(buffers[b], map.data(), width, first, std::min(block_rows, length - first)); });
+        for (size_t b = 0; b < count; b++)
         {
-
-            output << std::setw(10) << std::setprecision(6);
-            output << map.at(i * width + j);
-            if (j != width)
-                output << ' ';
+            output.write(buffers[b].data(), static_cast<std::streamsize>(buffers[b].size()));
+            scope.add_written(buffers[b].size());
         }
-        output << '\n';
     }
     output.close();
     std::cout << "Created file: " << filename << " with matrix to plot image externally." << '\n';
 }
 
+/**
+ * @brief Writes several matrices with the same dimensions, e.g. the maps of a series of energies, each one in its own file with the layout of external_plot. The files are written in parallel,
+ * one per worker thread.
+ *
+ * @param maps Matrices with the intensity values.
+ * @param width Width of the matrices.
+ * @param length Height of the matrices.
+ * @param output_filenames Title of the output file of every matrix.
+ * @param threads Amount of worker threads.
+ */
+void external_plot_slices(const std::vector<std::vector<double>> &maps, const uint64_t &width, const uint64_t &length, const std::vector<std::string> &output_filenames, const unsigned &threads = 1)
+{
+    if (maps.size() != output_filenames.size())
+        throw std::invalid_argument("Every matrix needs its own output file.");
+    for (std::vector<std::vector<double>>::const_iterator m = maps.begin(); m < maps.end(); m++)
+    {
+        if (m->size() != width * length)
+            throw std::invalid_argument("Dimensions and map do not coincide");
+    }
+    profile_scope scope("external_plot_slices");
+    parallel_for(maps.size(), threads, [&](const size_t m, const unsigned)
+                 {
+                     std::string filename = output_filenames[m] + ".txt";
+                     std::ofstream output(filename);
+                     if (!output.is_open())
+                         throw std::invalid_argument("Error opening the file " + filename + "!");
+                     std::string buffer;
+                     uint64_t block_rows = std::max<uint64_t>(1, (1 << 16) / std::max<uint64_t>(width, 1));
+                     for (uint64_t first = 0; first < length; first += block_rows)
+                     {
+                         buffer.clear();
+                         append_rows(buffer, maps[m].data(), width, first, std::min(block_rows, length - first));
+                         output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+                     }
+                     output.close();
+                     if (!output)
+                         throw std::invalid_argument("Error writing the file " + filename + "!"); });
+}
+
 /**
  * @brief Creates two files one for the x axis and one for the y axis values for the raw map.
  * Used to plot in other programming languages or software.
@@ -747,78 +4888,346 @@ void external_plot(const std::vector<double> &map, const uint64_t &width, const
  */
 void external_plot_axis(std::vector<double> &x, std::vector<double> &y, std::string &output_filename)
 {
+    profile_scope scope("external_plot_axis");
     std::string filename1 = output_filename + "-x-axis-handles.txt";
     std::string filename2 = output_filename + "-y-axis-handles.txt";
     std::ofstream output1(filename1);
     if (!output1.is_open())
-    {
-        std::cout << "Error opening the file: " << filename1 << "!";
-    }
+        throw std::invalid_argument("Error opening the file: " + filename1 + "!");
 
+    std::string buffer;
     for (uint64_t i = 0; i < x.size(); i++)
     {
-        output1 << x.at(i) << '\n';
+        append_value(buffer, x[i], 0);
+        buffer.push_back('\n');
     }
-
+    output1.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    scope.add_written(buffer.size());
     output1.close();
     std::cout << "Created file:" << filename1 << " with x-axis handles to plot image externally." << '\n';
 
     std::ofstream output2(filename2);
     if (!output2.is_open())
-    {
-        std::cout << "Error opening the file: " << filename1 << "!";
-    }
+        throw std::invalid_argument("Error opening the file: " + filename2 + "!");
+    buffer.clear();
     for (uint64_t i = 0; i < y.size(); i++)
     {
-        output2 << y.at(i) << '\n';
+        append_value(buffer, y[i], 0);
+        buffer.push_back('\n');
     }
+    output2.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    scope.add_written(buffer.size());
     output2.close();
 
-    std::cout << "Created file:" << filename1 << " with y-axis handles to plot image externally." << '\n';
+    std::cout << "Created file:" << filename2 << " with y-axis handles to plot image externally." << '\n';
+}
+
+/**
+ * @brief Writes a spectrum as a text file with one energy and its intensity per line, separated by a tab, the format read by readspectrum. The values are written in fixed notation,
+ * since readspectrum does not accept exponents, with the shortest representation that reads back to the same value.
+ *
+ * @param input_spectrum Spectrum to be written, e.g. a loading from show_loading.
+ * @param output_filename Name of the file, including the extension.
+ */
+template <typename Value>
+void write_spectrum(basic_spectrum<Value> &input_spectrum, const std::string &output_filename)
+{
+    profile_scope scope("write_spectrum");
+    std::vector<double> energy = input_spectrum.show_energy_axis();
+    std::vector<Value> intensity = input_spectrum.show_intensity();
+    std::string buffer;
+    // Enough characters for any double in fixed notation.
+    char digits[800];
+    for (size_t k = 0; k < energy.size(); k++)
+    {
+        std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), energy[k], std::chars_format::fixed);
+        buffer.append(digits, static_cast<size_t>(result.ptr - digits));
+        buffer.push_back('\t');
+        result = std::to_chars(digits, digits + sizeof(digits), intensity[k], std::chars_format::fixed);
+        buffer.append(digits, static_cast<size_t>(result.ptr - digits));
+        buffer.push_back('\n');
+    }
+    std::ofstream output(output_filename);
+    if (!output.is_open())
+        throw std::invalid_argument("Error opening the file: " + output_filename + "!");
+    output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    output.close();
+    if (!output)
+        throw std::invalid_argument("Error writing the file: " + output_filename + "!");
+    scope.add_written(buffer.size());
+    std::cout << "Created file: " << output_filename << " with the spectrum." << '\n';
+}
+
+/**
+ * @brief Writes an array of floats or doubles as a NumPy .npy file (format version 1.0). The header is padded so the data starts at a multiple of 64 bytes, and the data is written
+ * with a single call, so the file can be memory-mapped with numpy.load(filename, mmap_mode='r').
+ *
+ * @param filename Name of the file, including the extension.
+ * @param data Pointer to the first value, in row-major order. The type of the array in the file is float32 or float64 following the type of the values.
+ * @param shape Size of every dimension of the array.
+ */
+template <typename Value>
+void write_npy(const std::string &filename, const Value *data, const std::vector<uint64_t> &shape)
+{
+    static_assert(std::is_same_v<Value, float> or std::is_same_v<Value, double>, "Only float and double arrays can be written as .npy files.");
+    uint64_t count = 1;
+    std::string dimensions;
+    for (std::vector<uint64_t>::const_iterator d = shape.begin(); d < shape.end(); d++)
+    {
+        count *= *d;
+        dimensions += std::to_string(*d) + ", ";
+    }
+    if (shape.size() > 1)
+        dimensions.erase(dimensions.size() - 1);
+    std::string description = std::string(std::endian::native == std::endian::little ? "<" : ">") + (sizeof(Value) == 4 ? "f4" : "f8");
+    std::string header = "{'descr': '" + description + "', 'fortran_order': False, 'shape': (" + dimensions + "), }";
+    // Magic string, version and header length take 10 bytes, and the header ends with a new line.
+    header.append(63 - (10 + header.size()) % 64, ' ');
+    header.push_back('\n');
+    if (header.size() > UINT16_MAX)
+        throw std::invalid_argument("Error: The array has too many dimensions for the .npy format.");
+
+    profile_scope scope("write_npy");
+    scope.add_written(10 + header.size() + count * sizeof(Value));
+    std::ofstream output(filename, std::ios::binary);
+    if (!output.is_open())
+        throw std::invalid_argument("Error creating the file " + filename + "!");
+    const char magic[8] = {'\x93', 'N', 'U', 'M', 'P', 'Y', 1, 0};
+    uint8_t header_length[2] = {static_cast<uint8_t>(header.size() & 0xFF), static_cast<uint8_t>(header.size() >> 8)};
+    output.write(magic, sizeof(magic));
+    output.write(reinterpret_cast<const char *>(header_length), sizeof(header_length));
+    output.write(header.data(), static_cast<std::streamsize>(header.size()));
+    output.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(count * sizeof(Value)));
+    output.close();
+    if (!output)
+        throw std::invalid_argument("Error writing the file " + filename + "!");
+    std::cout << "Created file: " << filename << '\n';
+}
+
+/**
+ * @brief Writes the raw map, its axis handles and the formatted grid of a data_map as .npy files, with the same names as the text files.
+ *
+ * @param spectra_map Map with the extracted intensities.
+ * @param output_filename Title of the output files.
+ * @param threads Amount of worker threads to build the formatted grid.
+ */
+template <typename Value>
+void export_npy(basic_data_map<Value> &spectra_map, const std::string &output_filename, const unsigned &threads = 1)
+{
+    std::vector<double> raw = spectra_map.show_raw();
+    write_npy(output_filename + "-raw.npy", raw.data(), {spectra_map.show_dimensions("length"), spectra_map.show_dimensions("width")});
+    std::vector<double> x = spectra_map.show_axis("x");
+    std::vector<double> y = spectra_map.show_axis("y");
+    write_npy(output_filename + "-raw-x-axis-handles.npy", x.data(), {x.size()});
+    write_npy(output_filename + "-raw-y-axis-handles.npy", y.data(), {y.size()});
+    std::vector<double> grid = spectra_map.show_formatted_grid(threads);
+    write_npy(output_filename + "-grid.npy", grid.data(), {spectra_map.show_formatted_dimensions("length"), spectra_map.show_formatted_dimensions("width")});
+}
+
+/**
+ * @brief Writes the intensities of a spectrum_cube as a .npy array with one row per spectrum, together with the energy axis and the coordinates of every spectrum.
+ * The intensities keep the storage type of the cube.
+ *
+ * @param cube Cube with the spectra.
+ * @param output_filename Title of the output files.
+ */
+template <typename Value>
+void export_npy(basic_spectrum_cube<Value> &cube, const std::string &output_filename)
+{
+    std::vector<double> energy = cube.show_energy_axis();
+    write_npy(output_filename + "-cube.npy", cube.show_spectrum(0), {cube.show_pixels(), energy.size()});
+    write_npy(output_filename + "-energy-axis.npy", energy.data(), {energy.size()});
+    std::vector<double> x = cube.show_positions("x");
+    std::vector<double> y = cube.show_positions("y");
+    std::vector<double> positions(2 * x.size());
+    for (size_t i = 0; i < x.size(); i++)
+    {
+        positions[2 * i] = x[i];
+        positions[2 * i + 1] = y[i];
+    }
+    write_npy(output_filename + "-positions.npy", positions.data(), {x.size(), 2});
 }
 
 /**
  * @brief Creates a binary BMP file. Build based on a tutorial from https://dev.to/muiz6/c-how-to-write-a-bitmap-image-from-scratch-1k6m (No lines were copied, but it was used as a guide for the information required)
  *
- * @param intensity Map values to set the colour of the image.
+ * @param intensity Map values to set the colour of the image, normalized between 0 and 1.
  * @param width Calculated width in pixels from the class data_map function.
  * @param length Calculated height in pixels from the class data_map function.
  * @param output_filename Title of the BMP file.
+ * @param colormap Name of the colormap: orange (default), gray, viridis or inferno.
  */
-void build_bitmap(std::vector<double> &intensity, const uint64_t &width, const uint64_t &length, std::string &output_filename)
+void build_bitmap(std::vector<double> &intensity, const uint64_t &width, const uint64_t &length, std::string &output_filename, const std::string &colormap = "orange")
 {
+    if (intensity.size() != width * length)
+        throw std::invalid_argument("Dimensions are not suitable for bitmap.");
+    profile_scope scope("build_bitmap");
     std::string filename = output_filename + ".bmp";
-    BmpHeader header(width, length);
-    BmpInfoHeader info_header(width, length);
-    std::ofstream outputbm(filename, std::ios::binary);
-    if (!outputbm.is_open())
-    {
-        std::cout << "Error creating BMP File";
-        exit(0);
-    }
-    if (width % 4 != 0 or length % 4 != 0)
+    bitmap_writer writer(filename, width, length, colormap);
+    writer.write_rows(intensity.data(), length);
+    writer.close();
+    scope.add_written(fs::file_size(filename));
+
+    std::cout << "Successfully created: " + filename << '\n';
+}
+
+/**
+ * @brief Creates the formatted grid of a class map with the class numbers, instead of the values normalized with the maximum of show_formatted_grid.
+ *
+ * @param class_map Map with the class of every spectrum, numbered from 1, e.g. from show_classes.
+ * @param threads Amount of worker threads to fill the matrix.
+ * @return Returns a vector with the flattened matrix of class numbers.
+ */
+template <typename Value>
+std::vector<double> class_grid(basic_data_map<Value> &class_map, const unsigned &threads = 1)
+{
+    double largest = class_map.show_formatted_maximum();
+    std::vector<double> grid = class_map.show_formatted_grid(threads);
+    for (std::vector<double>::iterator g = grid.begin(); g < grid.end(); g++)
+        *g = std::round(*g * largest);
+    return grid;
+}
+
+/**
+ * @brief Creates a BMP file of a class map with the colours of make_class_colormap: every class has its own colour and the positions of the grid without spectra are black.
+ *
+ * @param classes Formatted grid with the class numbers, from class_grid, 0 where the grid has no spectrum.
+ * @param width Width in pixels of the formatted grid.
+ * @param length Height in pixels of the formatted grid.
+ * @param output_filename Title of the BMP file.
+ * @return If the grid has more than class_colours classes, throws an invalid_argument exception instead of giving two classes the same colour.
+ */
+void build_class_bitmap(const std::vector<double> &classes, const uint64_t &width, const uint64_t &length, std::string &output_filename)
+{
+    if (classes.size() != width * length)
+        throw std::invalid_argument("Dimensions are not suitable for bitmap.");
+    // The level of a pixel is its normalized value times 255, so the value of class n is placed in the middle of level n.
+    std::vector<double> levels(classes.size());
+    for (size_t i = 0; i < classes.size(); i++)
     {
-        std::cout << "Dimensions are not suitable for bitmap." << '\n';
-        exit(0);
+        if (classes[i] > static_cast<double>(class_colours))
+            throw std::invalid_argument("Error: The class bitmap can only show " + std::to_string(class_colours) + " classes, use the raw, grid or npy formats for more classes.");
+        levels[i] = (classes[i] + 0.5) / 255.0;
     }
+    profile_scope scope("build_bitmap");
+    std::string filename = output_filename + ".bmp";
+    bitmap_writer writer(filename, width, length, make_class_colormap());
+    writer.write_rows(levels.data(), length);
+    writer.close();
+    scope.add_written(fs::file_size(filename));
+    std::cout << "Successfully created: " + filename << '\n';
+}
 
-    header.write_header(outputbm);
-    info_header.write_infoheader(outputbm);
-    for (uint64_t i = 0; i < intensity.size(); i++)
+/**
+ * @brief Creates a BMP file from the formatted grid of a data_map without building the whole grid: the grid is generated in bands of rows and every band is written before the next one is filled.
+ * The file is the same as the one from build_bitmap with the result of show_formatted_grid.
+ *
+ * @param spectra_map Map with the extracted intensities.
+ * @param output_filename Title of the BMP file.
+ * @param colormap Name of the colormap: orange (default), gray, viridis or inferno.
+ * @param threads Amount of worker threads to fill each band.
+ * @param band_rows Amount of rows per band, 0 to use bands of about 1 MB.
+ */
+template <typename Value>
+void stream_bitmap(basic_data_map<Value> &spectra_map, std::string &output_filename, const std::string &colormap = "orange", const unsigned &threads = 1, const uint64_t &band_rows = 0)
+{
+    profile_scope scope("stream_bitmap");
+    double maximum = spectra_map.show_formatted_maximum();
+    const typename basic_data_map<Value>::resampling_plan &plan = spectra_map.show_resampling_plan();
+    uint64_t rows = band_rows > 0 ? band_rows : std::max<uint64_t>(1, (1 << 17) / plan.width);
+    rows = std::min<uint64_t>(rows, plan.length);
+    std::string filename = output_filename + ".bmp";
+    bitmap_writer writer(filename, plan.width, plan.length, colormap);
+    std::vector<double> band(rows * plan.width);
+    for (uint64_t first = 0; first < plan.length; first += rows)
     {
-        if (intensity[i] > 1)
-        {
-            std::cout << "Error: Intensity map not suitable for bitmap build";
-            exit(0);
-        }
-        uint8_t blue = static_cast<uint8_t>(0 * intensity[i]);
-        outputbm.write((char *)&blue, sizeof(uint8_t));
-        uint8_t green = static_cast<uint8_t>(140 * intensity[i]);
-        outputbm.write((char *)&green, sizeof(uint8_t));
-        uint8_t red = static_cast<uint8_t>(255 * intensity[i]);
-        outputbm.write((char *)&red, sizeof(uint8_t));
+        uint64_t count = std::min<uint64_t>(rows, plan.length - first);
+        spectra_map.show_formatted_rows(first, count, maximum, band.data(), threads);
+        writer.write_rows(band.data(), count);
     }
-    outputbm.close();
+    writer.close();
+    scope.add_written(fs::file_size(filename));
 
     std::cout << "Successfully created: " + filename << '\n';
 }
+
+/**
+ * @brief Replaces rows of an existing BMP file created with bitmap_writer, without writing the rest of the file. The size of the file is checked against the dimensions.
+ *
+ * @param filename Name of the BMP file, including the extension.
+ * @param width Width of the image in pixels.
+ * @param length Height of the image in pixels.
+ * @param first First row to be replaced, counted from the bottom row.
+ * @param rows Amount of rows.
+ * @param intensity Normalized intensities of the rows, width values per row.
+ * @param colormap Name of the colormap, see make_colormap.
+ */
+void update_bitmap_rows(const std::string &filename, const uint64_t &width, const uint64_t &length, const uint64_t &first, const uint64_t &rows, const double *intensity, const std::string &colormap)
+{
+    uint64_t row_size = BmpHeader::bitmap_row_size(width);
+    // Both headers take 54 bytes before the pixels.
+    if (!fs::exists(filename) or fs::file_size(filename) != 54 + row_size * length or first + rows > length)
+        throw std::invalid_argument("Error: The BMP file " + filename + " does not have the dimensions of the map.");
+    colormap_table table = make_colormap(colormap);
+    std::vector<uint8_t> pixels(rows * row_size, 0);
+    for (uint64_t r = 0; r < rows; r++)
+        encode_bitmap_row(intensity + r * width, width, table, pixels.data() + r * row_size);
+    std::fstream outputbm(filename, std::ios::in | std::ios::out | std::ios::binary);
+    outputbm.seekp(static_cast<std::streamoff>(54 + first * row_size));
+    outputbm.write(reinterpret_cast<const char *>(pixels.data()), static_cast<std::streamsize>(pixels.size()));
+    outputbm.close();
+    if (!outputbm)
+        throw std::invalid_argument("Error writing the BMP file " + filename);
+}
+
+/**
+ * @brief Renders a numbered sequence of BMP files, one per energy, with the positions and the resampling plan of a map. All the frames are normalized with the same value, the maximum
+ * of all their formatted grids, so the colours can be compared between frames. The frames are extracted twice, first to find the maximum and then to write them, so only one raw map
+ * and one band of rows per thread are kept in memory. Several frames are rendered and written at the same time, one per worker thread.
+ *
+ * @param geometry Map with the positions of the spectra; its values are not used.
+ * @param energies Energy of every frame.
+ * @param extract Callable that takes an energy and returns the intensity of every spectrum, in the order of the constructor of the map. It must be safe to call from several threads.
+ * @param output_filename Title of the BMP files, followed by the number of the frame.
+ * @param colormap Name of the colormap, see make_colormap.
+ * @param threads Amount of worker threads.
+ * @return Returns the names of the BMP files, in the order of the energies.
+ */
+template <typename Value, typename Extractor>
+std::vector<std::string> render_frames(basic_data_map<Value> &geometry, const std::vector<double> &energies, Extractor extract, const std::string &output_filename, const std::string &colormap, const unsigned &threads)
+{
+    profile_scope scope("render_frames");
+    // The plan is computed before the threads start, afterwards the map is only read.
+    geometry.show_formatted_maximum();
+    const typename basic_data_map<Value>::resampling_plan &plan = geometry.show_resampling_plan();
+    make_colormap(colormap);
+
+    std::vector<double> maxima(energies.size());
+    parallel_for(energies.size(), threads, [&](const size_t f, const unsigned)
+                 { maxima[f] = geometry.show_formatted_maximum(geometry.show_placed(extract(energies[f]))); });
+    double maximum = *std::max_element(maxima.begin(), maxima.end());
+
+    size_t digits = std::max<size_t>(4, std::to_string(energies.size() - 1).size());
+    std::vector<std::string> filenames(energies.size());
+    for (size_t f = 0; f < energies.size(); f++)
+    {
+        std::string number = std::to_string(f);
+        filenames[f] = output_filename + "-" + std::string(digits - number.size(), '0') + number + ".bmp";
+    }
+    uint64_t rows = std::min<uint64_t>(plan.length, std::max<uint64_t>(1, (1 << 17) / plan.width));
+    std::vector<std::vector<double>> bands(std::max(threads, 1u), std::vector<double>(rows * plan.width));
+    parallel_for(energies.size(), threads, [&](const size_t f, const unsigned worker)
+                 {
+                     std::vector<Value> raw = geometry.show_placed(extract(energies[f]));
+                     bitmap_writer writer(filenames[f], plan.width, plan.length, colormap);
+                     for (uint64_t first = 0; first < plan.length; first += rows)
+                     {
+                         uint64_t count = std::min<uint64_t>(rows, plan.length - first);
+                         geometry.show_formatted_rows(raw, first, count, maximum, bands[worker].data());
+                         writer.write_rows(bands[worker].data(), count);
+                     }
+                     writer.close(); });
+    for (std::vector<std::string>::const_iterator f = filenames.begin(); f < filenames.end(); f++)
+        scope.add_written(fs::file_size(*f));
+    return filenames;
+}
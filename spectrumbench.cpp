@@ -0,0 +1,511 @@
+/**
+ * @file spectrumbench.cpp
+ * @author Joaquin Reyes (reyesgoj@mcmaster.ca)
+ * @brief Benchmarks of the header file spectrum_map: a micro-benchmark of the extraction paths (one spectrum object per file, the spectrum_cube and the energy_major_cube with the SIMD kernels)
+ * and of the text export of the maps, a generator of synthetic spectrum directories and an end-to-end benchmark of every stage of spectrumview with the results as JSON.
+ * @version 0.1
+ * @date 2022-12-23
+ * @copyright Copyright (c) 2022
+ */
+
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include "spectrum_map.hpp"
+namespace fs = std::filesystem;
+
+/**
+ * @brief Writes a directory of synthetic spectra with the file name format read by findcoords. Every spectrum has a zero-loss peak and a plasmon peak whose energy changes with the position.
+ * The positions go in steps of 10 nm, plus a random amount of nanometres between 0 and irregular for every step, so the same arguments always give the same directory.
+ *
+ * @param directory Directory where the files are written.
+ * @param width Amount of positions along x.
+ * @param length Amount of positions along y.
+ * @param channels Amount of energy channels per spectrum.
+ * @param irregular Maximum amount of nanometres added to a step.
+ * @param pixels Amount of spectra to be written, in rows from the first position. 0 to write the whole map.
+ */
+void write_synthetic_directory(const fs::path &directory, const uint64_t &width, const uint64_t &length, const uint64_t &channels, const uint64_t &irregular = 0, const uint64_t &pixels = 0)
+{
+    fs::create_directories(directory);
+    std::mt19937 generator(12345);
+    std::uniform_real_distribution<double> noise(0, 5);
+    std::uniform_int_distribution<uint64_t> jitter(0, irregular);
+    std::vector<uint64_t> x_axis(width);
+    std::vector<uint64_t> y_axis(length);
+    for (uint64_t i = 1; i < width; i++)
+        x_axis[i] = x_axis[i - 1] + 10 + jitter(generator);
+    for (uint64_t i = 1; i < length; i++)
+        y_axis[i] = y_axis[i - 1] + 10 + jitter(generator);
+    uint64_t count = pixels > 0 ? std::min(pixels, width * length) : width * length;
+    for (uint64_t p = 0; p < count; p++)
+    {
+        uint64_t x = x_axis[p % width];
+        uint64_t y = y_axis[p / width];
+        std::ofstream output(directory / ("bench-" + std::to_string(x) + "nm-" + std::to_string(y) + "nm.dat"));
+        output << std::fixed << std::setprecision(6);
+        for (uint64_t k = 0; k < channels; k++)
+        {
+            double energy = -0.05 + static_cast<double>(k) * 0.001;
+            double plasmon = 0.3 + 0.0001 * static_cast<double>(x);
+            double intensity = 1000 * std::exp(-std::pow(energy / 0.01, 2)) + 50 * std::exp(-std::pow((energy - plasmon) / 0.02, 2)) + noise(generator);
+            output << energy << ' ' << intensity;
+            if (k + 1 < channels)
+                output << '\n';
+        }
+    }
+}
+
+/**
+ * @brief Measures the average time of an extraction over several energies.
+ *
+ * @param energies Energies to be mapped.
+ * @param extract Callable that takes an energy and extracts the map.
+ * @return Returns the average time per map in milliseconds.
+ */
+template <typename Extractor>
+double time_maps(const std::vector<double> &energies, Extractor extract)
+{
+    double checksum = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (std::vector<double>::const_iterator e = energies.begin(); e < energies.end(); e++)
+    {
+        std::vector<double> values = extract(*e);
+        checksum += values[values.size() / 2];
+    }
+    double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (std::isnan(checksum))
+        std::cout << "Warning: the extracted values are not numbers" << '\n';
+    return milliseconds / static_cast<double>(energies.size());
+}
+
+/**
+ * @brief Writes a matrix with an output stream and std::setw/std::setprecision for every value, the text writer of the previous releases. Used as reference for external_plot.
+ *
+ * @param map Matrix with the values.
+ * @param width Width of the matrix.
+ * @param length Height of the matrix.
+ * @param filename Name of the output file.
+ */
+void iostream_plot(const std::vector<double> &map, const uint64_t &width, const uint64_t &length, const std::string &filename)
+{
+    std::ofstream output(filename);
+    for (uint64_t i = 0; i < length; i++)
+    {
+        for (uint64_t j = 0; j < width; j++)
+        {
+            output << std::setw(10) << std::setprecision(6);
+            output << map.at(i * width + j);
+            output << ' ';
+        }
+        output << '\n';
+    }
+}
+
+/**
+ * @brief Measures the throughput of a text export.
+ *
+ * @param directory Directory where the files were written, to measure their size.
+ * @param write Callable that writes the files.
+ * @return Returns the throughput in MB/s.
+ */
+template <typename Writer>
+double time_export(const fs::path &directory, Writer write)
+{
+    fs::remove_all(directory);
+    fs::create_directories(directory);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    write();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uintmax_t bytes = 0;
+    for (const fs::directory_entry &entry : fs::directory_iterator(directory))
+        bytes += entry.file_size();
+    return (static_cast<double>(bytes) / seconds) / 1e6;
+}
+
+/**
+ * @brief Time and amount of data of one stage of the end-to-end benchmark.
+ */
+struct stage_result
+{
+    std::string name;
+    double seconds = 0;
+    uint64_t items = 0;
+    uint64_t bytes = 0;
+};
+
+/**
+ * @brief Runs a stage several times and keeps the fastest run, so the result is less affected by other processes.
+ *
+ * @param name Name of the stage in the JSON report.
+ * @param repetitions Amount of runs.
+ * @param stage Callable that runs the stage once and returns the amount of items and bytes processed.
+ * @return Returns the result of the fastest run.
+ */
+template <typename Stage>
+stage_result time_stage(const std::string &name, const uint64_t &repetitions, Stage stage)
+{
+    stage_result result;
+    result.name = name;
+    result.seconds = std::numeric_limits<double>::infinity();
+    for (uint64_t r = 0; r < repetitions; r++)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::pair<uint64_t, uint64_t> processed = stage();
+        result.seconds = std::min(result.seconds, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        result.items = processed.first;
+        result.bytes = processed.second;
+    }
+    return result;
+}
+
+/**
+ * @brief Sums the size of the files in a directory.
+ */
+uint64_t directory_size(const fs::path &directory)
+{
+    uint64_t bytes = 0;
+    for (const fs::directory_entry &entry : fs::directory_iterator(directory))
+        bytes += entry.file_size();
+    return bytes;
+}
+
+/**
+ * @brief Generates a synthetic directory and times every stage of spectrumview on it: the directory scan, the parsing of the files, the extraction of an integrated map,
+ * the construction of the data_map, the formatted grid and every output writer. The outputs are written in a temporary directory that is removed at the end.
+ *
+ * @param directory Directory for the synthetic spectra, removed at the end.
+ * @param width Amount of positions along x.
+ * @param length Amount of positions along y.
+ * @param channels Amount of energy channels per spectrum.
+ * @param irregular Maximum amount of nanometres added to a step.
+ * @param threads Amount of worker threads.
+ * @param repetitions Amount of runs of every stage.
+ * @return Returns the report as a JSON document.
+ */
+std::string stage_benchmark(const fs::path &directory, const uint64_t &width, const uint64_t &length, const uint64_t &channels, const uint64_t &irregular, const unsigned &threads, const uint64_t &repetitions)
+{
+    std::vector<stage_result> stages;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    write_synthetic_directory(directory, width, length, channels, irregular);
+    stage_result generation;
+    generation.name = "generate";
+    generation.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    generation.items = width * length;
+    generation.bytes = directory_size(directory);
+    stages.push_back(generation);
+
+    std::vector<fs::path> files;
+    stages.push_back(time_stage("directory_scan", repetitions, [&]()
+                                {
+                                    files = opendirectory(directory.string());
+                                    return std::make_pair<uint64_t, uint64_t>(files.size(), 0); }));
+
+    // Reading alone, with io_uring when the kernel has it and with the reader threads, so the parse stages can be compared with the time spent waiting for the files.
+    for (bool use_io_uring : {true, false})
+    {
+        std::string backend;
+        stage_result prefetch = time_stage("prefetch", repetitions, [&]()
+                                           {
+                                               file_prefetcher prefetcher(files, 64, use_io_uring);
+                                               prefetched_file file;
+                                               uint64_t bytes = 0;
+                                               while (prefetcher.next(file))
+                                                   bytes += file.content.size();
+                                               backend = prefetcher.show_backend();
+                                               return std::make_pair<uint64_t, uint64_t>(files.size(), std::move(bytes)); });
+        prefetch.name = "prefetch_" + backend;
+        stages.push_back(prefetch);
+    }
+
+    std::vector<std::unique_ptr<spectrum>> spectra(files.size());
+    stages.push_back(time_stage("readfile_parse", repetitions, [&]()
+                                {
+                                    std::vector<uint64_t> bytes(std::max(threads, 1u), 0);
+                                    parallel_for(files.size(), threads, [&](const size_t i, const unsigned worker)
+                                                 {
+                                                     spectra[i] = std::make_unique<spectrum>(files[i]);
+                                                     bytes[worker] += spectra[i]->show_size(); });
+                                    uint64_t total = 0;
+                                    for (std::vector<uint64_t>::const_iterator b = bytes.begin(); b < bytes.end(); b++)
+                                        total += *b;
+                                    return std::make_pair<uint64_t, uint64_t>(files.size(), std::move(total)); }));
+
+    // An energy between two channels in the middle of the axis of write_synthetic_directory.
+    double energy = -0.05 + 0.001 * static_cast<double>(channels / 2) + 0.0003;
+    std::vector<double> x(files.size());
+    std::vector<double> y(files.size());
+    std::vector<double> intensity(files.size());
+    stages.push_back(time_stage("extraction", repetitions, [&]()
+                                {
+                                    parallel_for(files.size(), threads, [&](const size_t i, const unsigned)
+                                                 {
+                                                     intensity[i] = spectra[i]->integrated_intensity(energy, 5);
+                                                     x[i] = spectra[i]->show_position("x");
+                                                     y[i] = spectra[i]->show_position("y"); });
+                                    return std::make_pair<uint64_t, uint64_t>(files.size(), 0); }));
+    spectra.clear();
+
+    stages.push_back(time_stage("parse_and_extract", repetitions, [&]()
+                                {
+                                    std::vector<extracted_point> points = extract_directory(files, threads, [&](spectrum &current_spectrum)
+                                                                                            { return current_spectrum.integrated_intensity(energy, 5); });
+                                    uint64_t bytes = 0;
+                                    for (std::vector<extracted_point>::const_iterator p = points.begin(); p < points.end(); p++)
+                                        bytes += p->bytes;
+                                    return std::make_pair<uint64_t, uint64_t>(points.size(), std::move(bytes)); }));
+
+    std::unique_ptr<data_map> spectra_map;
+    stages.push_back(time_stage("data_map", repetitions, [&]()
+                                {
+                                    spectra_map = std::make_unique<data_map>(x, y, intensity);
+                                    return std::make_pair<uint64_t, uint64_t>(files.size(), 0); }));
+
+    std::vector<double> grid;
+    stages.push_back(time_stage("formatted_grid", repetitions, [&]()
+                                {
+                                    // A new map every run, so the resampling plan is included in the time.
+                                    data_map fresh_map(x, y, intensity);
+                                    grid = fresh_map.show_formatted_grid(threads);
+                                    return std::make_pair<uint64_t, uint64_t>(grid.size(), 0); }));
+
+    fs::path outputs = directory.string() + "-outputs";
+    fs::create_directories(outputs);
+    std::string raw_title = (outputs / "bench-raw").string();
+    std::string grid_title = (outputs / "bench-grid").string();
+    std::string bitmap_title = (outputs / "bench").string();
+    std::string stream_title = (outputs / "bench-stream").string();
+    std::vector<double> raw = spectra_map->show_raw();
+    uint64_t raw_width = spectra_map->show_dimensions("width");
+    uint64_t raw_length = spectra_map->show_dimensions("length");
+    uint64_t grid_width = spectra_map->show_formatted_dimensions("width");
+    uint64_t grid_length = spectra_map->show_formatted_dimensions("length");
+    std::streambuf *console = std::cout.rdbuf(nullptr);
+    stages.push_back(time_stage("write_raw_text", repetitions, [&]()
+                                {
+                                    external_plot(raw, raw_width, raw_length, raw_title, threads);
+                                    return std::make_pair<uint64_t, uint64_t>(raw.size(), fs::file_size(raw_title + ".txt")); }));
+    stages.push_back(time_stage("write_grid_text", repetitions, [&]()
+                                {
+                                    external_plot(grid, grid_width, grid_length, grid_title, threads);
+                                    return std::make_pair<uint64_t, uint64_t>(grid.size(), fs::file_size(grid_title + ".txt")); }));
+    stages.push_back(time_stage("write_bmp", repetitions, [&]()
+                                {
+                                    build_bitmap(grid, grid_width, grid_length, bitmap_title);
+                                    return std::make_pair<uint64_t, uint64_t>(grid.size(), fs::file_size(bitmap_title + ".bmp")); }));
+    stages.push_back(time_stage("stream_bmp", repetitions, [&]()
+                                {
+                                    stream_bitmap(*spectra_map, stream_title, "orange", threads);
+                                    return std::make_pair<uint64_t, uint64_t>(grid.size(), fs::file_size(stream_title + ".bmp")); }));
+    stages.push_back(time_stage("write_npy", repetitions, [&]()
+                                {
+                                    write_npy(grid_title + ".npy", grid.data(), {grid_length, grid_width});
+                                    return std::make_pair<uint64_t, uint64_t>(grid.size(), fs::file_size(grid_title + ".npy")); }));
+    std::cout.rdbuf(console);
+    fs::remove_all(outputs);
+    fs::remove_all(directory);
+
+    std::ostringstream json;
+    json << std::setprecision(9);
+    json << "{\n"
+         << "  \"benchmark\": \"spectrumview-stages\",\n"
+         << "  \"parameters\": {\"width\": " << width << ", \"length\": " << length << ", \"channels\": " << channels << ", \"irregular\": " << irregular
+         << ", \"threads\": " << threads << ", \"repetitions\": " << repetitions << "},\n"
+         << "  \"simd\": \"" << simd_kernels() << "\",\n"
+         << "  \"formatted_grid\": {\"width\": " << grid_width << ", \"length\": " << grid_length << "},\n"
+         << "  \"stages\": [\n";
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        json << "    {\"name\": \"" << stages[i].name << "\", \"seconds\": " << stages[i].seconds << ", \"items\": " << stages[i].items << ", \"bytes\": " << stages[i].bytes;
+        if (stages[i].bytes > 0 and stages[i].seconds > 0)
+            json << ", \"mb_per_second\": " << (static_cast<double>(stages[i].bytes) / stages[i].seconds) / 1e6;
+        json << "}" << (i + 1 < stages.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n"
+         << "}\n";
+    return json.str();
+}
+
+/**
+ * @brief Reads a positive integer argument of the command line.
+ */
+uint64_t read_count(const char *argument)
+{
+    std::string value = argument;
+    if (value.empty() or !std::all_of(value.begin(), value.end(), [](const unsigned char c) { return isdigit(c) != 0; }))
+        throw std::invalid_argument("Argument " + value + " must be a positive integer");
+    return std::stoull(value);
+}
+
+int main(int argc, char *argv[])
+{
+    fs::path directory;
+    try
+    {
+        if (argc > 1 and std::string(argv[1]) == "generate")
+        {
+            if (argc != 7)
+                throw std::invalid_argument("Syntax is: ./spectrumbench generate + directory + width + length + channels + irregular");
+            uint64_t width = read_count(argv[3]);
+            uint64_t length = read_count(argv[4]);
+            uint64_t channels = read_count(argv[5]);
+            if (width < 2 or length < 2 or channels < 16)
+                throw std::invalid_argument("The map needs at least 2 positions per direction and 16 channels");
+            write_synthetic_directory(argv[2], width, length, channels, read_count(argv[6]));
+            std::cout << "Wrote " << width * length << " synthetic spectra in " << argv[2] << '\n';
+            return 0;
+        }
+        if (argc > 1 and std::string(argv[1]) == "stages")
+        {
+            if (argc != 8 and argc != 9)
+                throw std::invalid_argument("Syntax is: ./spectrumbench stages + width + length + channels + irregular + threads + repetitions + [output.json]");
+            uint64_t width = read_count(argv[2]);
+            uint64_t length = read_count(argv[3]);
+            uint64_t channels = read_count(argv[4]);
+            uint64_t irregular = read_count(argv[5]);
+            unsigned threads = static_cast<unsigned>(read_count(argv[6]));
+            uint64_t repetitions = read_count(argv[7]);
+            if (width < 2 or length < 2 or channels < 16 or threads == 0 or repetitions == 0)
+                throw std::invalid_argument("The map needs at least 2 positions per direction, 16 channels, one thread and one repetition");
+            directory = fs::temp_directory_path() / ("spectrumbench-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+            std::string report = stage_benchmark(directory, width, length, channels, irregular, threads, repetitions);
+            if (argc == 9)
+            {
+                std::ofstream output(argv[8]);
+                output << report;
+                std::cout << "Created file: " << argv[8] << '\n';
+            }
+            else
+                std::cout << report;
+            return 0;
+        }
+
+        uint64_t pixels = argc > 1 ? std::stoull(argv[1]) : 10000;
+        uint64_t channels = argc > 2 ? std::stoull(argv[2]) : 1024;
+        uint64_t repetitions = argc > 3 ? std::stoull(argv[3]) : 20;
+        unsigned threads = argc > 4 ? static_cast<unsigned>(std::stoul(argv[4])) : 1;
+        if (pixels == 0 or channels < 16 or repetitions == 0 or threads == 0)
+            throw std::invalid_argument("Syntax is: ./spectrumbench + pixels + channels (at least 16) + repetitions + threads");
+
+        directory = fs::temp_directory_path() / ("spectrumbench-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+        std::cout << "Writing " << pixels << " synthetic spectra with " << channels << " channels in " << directory.string() << '\n';
+        uint64_t width = static_cast<uint64_t>(std::ceil(std::sqrt(static_cast<double>(pixels))));
+        write_synthetic_directory(directory, width, (pixels + width - 1) / width, channels, 0, pixels);
+        std::vector<fs::path> files = opendirectory(directory.string());
+
+        std::vector<spectrum> spectra;
+        spectra.reserve(files.size());
+        for (std::vector<fs::path>::iterator i = files.begin(); i < files.end(); i++)
+            spectra.emplace_back(*i);
+        spectrum_cube cube(files, threads);
+        energy_major_cube planes(cube, threads);
+        basic_spectrum_cube<float> single_cube(files, threads);
+        basic_energy_major_cube<float> single_planes(single_cube, threads);
+        fs::remove_all(directory);
+
+        std::vector<double> energies;
+        double first = -0.05 + 0.001 * 8;
+        double step = (0.001 * static_cast<double>(channels - 16)) / static_cast<double>(repetitions);
+        for (uint64_t r = 0; r < repetitions; r++)
+            energies.push_back(first + static_cast<double>(r) * step + 0.0003);
+
+        double object_interpolated = time_maps(energies, [&](const double &energy)
+                                               {
+                                                   std::vector<double> values(spectra.size());
+                                                   for (size_t i = 0; i < spectra.size(); i++)
+                                                       values[i] = spectra[i].interpolated_intensity(energy);
+                                                   return values; });
+        double object_integrated = time_maps(energies, [&](const double &energy)
+                                             {
+                                                 std::vector<double> values(spectra.size());
+                                                 for (size_t i = 0; i < spectra.size(); i++)
+                                                     values[i] = spectra[i].integrated_intensity(energy, 5);
+                                                 return values; });
+        double cube_interpolated = time_maps(energies, [&](const double &energy)
+                                             { return cube.interpolated_intensity(energy); });
+        double cube_integrated = time_maps(energies, [&](const double &energy)
+                                           { return cube.integrated_intensity(energy, 5); });
+        double planes_interpolated = time_maps(energies, [&](const double &energy)
+                                               { return planes.interpolated_intensity(energy); });
+        double planes_integrated = time_maps(energies, [&](const double &energy)
+                                             { return planes.integrated_intensity(energy, 5); });
+        double single_interpolated = time_maps(energies, [&](const double &energy)
+                                               { return single_planes.interpolated_intensity(energy); });
+        double single_integrated = time_maps(energies, [&](const double &energy)
+                                             { return single_planes.integrated_intensity(energy, 5); });
+
+        std::cout << "SIMD kernels: " << simd_kernels() << ", threads: " << threads << '\n'
+                  << "Average time per map in ms (integrated with 5 channels per side):" << '\n'
+                  << "  path                interpolated  integrated" << '\n'
+                  << "  spectrum objects    " << object_interpolated << "  " << object_integrated << '\n'
+                  << "  spectrum_cube       " << cube_interpolated << "  " << cube_integrated << '\n'
+                  << "  energy_major_cube   " << planes_interpolated << "  " << planes_integrated << '\n'
+                  << "  float planes        " << single_interpolated << "  " << single_integrated << '\n';
+
+        // Randomized PCA of the whole cube, the stage behind --pca.
+        uint64_t components = std::min<uint64_t>(8, pixels);
+        std::chrono::steady_clock::time_point pca_start = std::chrono::steady_clock::now();
+        principal_components pca = cube.decompose(components, threads);
+        double pca_double = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pca_start).count();
+        pca_start = std::chrono::steady_clock::now();
+        pca = single_cube.decompose(components, threads);
+        double pca_float = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pca_start).count();
+        std::cout << "PCA with " << components << " components of " << pixels << " x " << channels << " in ms:" << '\n'
+                  << "  spectrum_cube       " << pca_double << '\n'
+                  << "  float cube          " << pca_float << '\n';
+
+        // k-means of the whole cube, the stage behind --clusters.
+        std::chrono::steady_clock::time_point kmeans_start = std::chrono::steady_clock::now();
+        spectral_classes classes = cube.classify(components, threads);
+        double kmeans_time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - kmeans_start).count();
+        std::cout << "k-means with " << components << " classes in ms: " << kmeans_time << " (" << classes.iterations << " iterations)" << '\n';
+
+        // Text export of one map per energy, written as a square matrix.
+        width = static_cast<uint64_t>(std::sqrt(static_cast<double>(pixels)));
+        uint64_t length = std::max<uint64_t>(1, pixels / width);
+        std::vector<std::vector<double>> slices;
+        std::vector<std::string> titles;
+        fs::path text_directory = directory.string() + "-text";
+        for (std::vector<double>::const_iterator e = energies.begin(); e < energies.end(); e++)
+        {
+            std::vector<double> values = planes.interpolated_intensity(*e);
+            values.resize(width * length);
+            slices.push_back(values);
+            titles.push_back((text_directory / ("slice-" + std::to_string(slices.size()))).string());
+        }
+        double stream_export = time_export(text_directory, [&]()
+                                           {
+                                               for (size_t m = 0; m < slices.size(); m++)
+                                                   iostream_plot(slices[m], width, length, titles[m] + ".txt"); });
+        std::streambuf *console = std::cout.rdbuf(nullptr);
+        double plot_export = time_export(text_directory, [&]()
+                                         {
+                                             for (size_t m = 0; m < slices.size(); m++)
+                                                 external_plot(slices[m], width, length, titles[m], threads); });
+        std::cout.rdbuf(console);
+        double slices_export = time_export(text_directory, [&]()
+                                           { external_plot_slices(slices, width, length, titles, threads); });
+        fs::remove_all(text_directory);
+
+        std::cout << "Text export of " << slices.size() << " maps of " << width << " x " << length << " in MB/s:" << '\n'
+                  << "  iostream writer        " << stream_export << '\n'
+                  << "  external_plot          " << plot_export << '\n'
+                  << "  external_plot_slices   " << slices_export << '\n';
+    }
+    catch (std::invalid_argument const &e)
+    {
+        std::cout << e.what() << '\n';
+        if (!directory.empty())
+        {
+            fs::remove_all(directory);
+            fs::remove_all(directory.string() + "-outputs");
+        }
+    }
+}
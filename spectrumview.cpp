@@ -18,171 +18,1619 @@
 #include <map>
 #include <tuple>
 #include <set>
+#include <chrono>
+#include <sstream>
+#include <cmath>
+#include <memory>
+#include <csignal>
+#include <functional>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <utility>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#endif
 #include "spectrum_map.hpp"
 namespace fs = std::filesystem;
 
+/**
+ * @brief Prints the amount of files and bytes read from the directory and the parsing throughput.
+ *
+ * @param files Amount of files that were read.
+ * @param bytes Total amount of bytes read from the files.
+ * @param start Time point taken before reading the first file.
+ */
+void report_throughput(const uint64_t &files, const uint64_t &bytes, const std::chrono::steady_clock::time_point &start)
+{
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Read " << files << " files (" << bytes << " bytes) in " << seconds << " s";
+    if (seconds > 0)
+        std::cout << ": " << (static_cast<double>(bytes) / seconds) / 1e6 << " MB/s";
+    std::cout << '\n';
+}
+
+/**
+ * @brief Takes the optional arguments written as '--name value' out of the command line, so the positional arguments keep the order described in the documentation.
+ *
+ * @param argc Amount of arguments from the command line.
+ * @param argv Arguments from the command line.
+ * @param options Map where the name of every option (without the dashes) gets associated to its value.
+ * @return Returns a vector with the positional arguments, starting with the program name.
+ */
+std::vector<char *> parse_options(int argc, char *argv[], std::map<std::string, std::string> &options)
+{
+    std::vector<char *> positional;
+    for (int i = 0; i < argc; i++)
+    {
+        if (i > 0 and !std::strncmp(argv[i], "--", 2))
+        {
+            if (i + 1 == argc)
+                throw std::invalid_argument("Option " + std::string(argv[i]) + " requires a value");
+            options[argv[i] + 2] = argv[i + 1];
+            i++;
+        }
+        else
+            positional.push_back(argv[i]);
+    }
+    return positional;
+}
+
+/**
+ * @brief Reads the amount of worker threads requested with --threads. Only one thread is used if the option is not given.
+ *
+ * @param options Optional arguments from the command line.
+ * @return Returns the amount of threads to read the files.
+ */
+unsigned read_threads(const std::map<std::string, std::string> &options)
+{
+    if (!options.contains("threads"))
+        return 1;
+    std::string threads = options.at("threads");
+    for (std::string::iterator c = threads.begin(); c < threads.end(); c++)
+    {
+        if (!isdigit(static_cast<unsigned char>(*c)))
+            throw std::invalid_argument("threads must be a positive integer");
+    }
+    if (threads.empty() or std::stoul(threads) == 0)
+        throw std::invalid_argument("threads must be a positive integer");
+    return static_cast<unsigned>(std::stoul(threads));
+}
+
+/**
+ * @brief Reads an amount requested with an option, e.g. the principal components of --pca or the classes of --clusters.
+ *
+ * @param options Optional arguments from the command line.
+ * @param option Name of the option, without the dashes.
+ * @return Returns the amount, 0 if the option is not given.
+ */
+uint64_t read_amount(const std::map<std::string, std::string> &options, const std::string &option)
+{
+    if (!options.contains(option))
+        return 0;
+    std::string amount = options.at(option);
+    for (std::string::iterator c = amount.begin(); c < amount.end(); c++)
+    {
+        if (!isdigit(static_cast<unsigned char>(*c)))
+            throw std::invalid_argument("The value of --" + option + " must be a positive integer");
+    }
+    if (amount.empty() or std::stoull(amount) == 0)
+        throw std::invalid_argument("The value of --" + option + " must be a positive integer");
+    return std::stoull(amount);
+}
+
+/**
+ * @brief Reads the storage type of the intensities requested with --precision. The spectra are stored in double precision if the option is not given.
+ *
+ * @param options Optional arguments from the command line.
+ * @return Returns true to store the intensities as float, false to store them as double.
+ */
+bool read_single_precision(const std::map<std::string, std::string> &options)
+{
+    if (!options.contains("precision") or options.at("precision") == "double")
+        return false;
+    if (options.at("precision") == "float")
+        return true;
+    throw std::invalid_argument("precision can only be float or double");
+}
+
+/**
+ * @brief Descriptors that can be requested with --descriptors. A set of them is given as a mask with one bit per position of this list.
+ */
+typedef std::tuple<integrated_descriptor, peak_maximum_descriptor, peak_energy_descriptor, centroid_descriptor, fwhm_descriptor> descriptor_list;
+
+/**
+ * @brief Names of the descriptors of descriptor_list, used in --descriptors and in the titles of the outputs.
+ */
+const std::array<std::string, 5> descriptor_names = {integrated_descriptor::name, peak_maximum_descriptor::name, peak_energy_descriptor::name, centroid_descriptor::name, fwhm_descriptor::name};
+
+/**
+ * @brief Positions in descriptor_list of the descriptors of a mask, in increasing order.
+ */
+template <uint32_t Mask>
+constexpr std::array<size_t, std::popcount(Mask)> descriptor_positions = []()
+{
+    std::array<size_t, std::popcount(Mask)> positions{};
+    size_t k = 0;
+    for (size_t d = 0; d < std::tuple_size_v<descriptor_list>; d++)
+    {
+        if (Mask & (1u << d))
+            positions[k++] = d;
+    }
+    return positions;
+}();
+
+/**
+ * @brief Computes the descriptors of a mask known at compile time, so describe_window only keeps the running values they use.
+ *
+ * @return Returns the descriptors in the positions of descriptor_names, the positions that are not in the mask are left empty.
+ */
+template <uint32_t Mask, typename Spectra, size_t... K>
+auto describe_mask(Spectra &spectra, const double &energy, const uint64_t &channels, std::index_sequence<K...>)
+{
+    auto values = spectra.template descriptors<std::tuple_element_t<descriptor_positions<Mask>[K], descriptor_list>...>(energy, channels);
+    std::array<typename decltype(values)::value_type, std::tuple_size_v<descriptor_list>> described{};
+    ((described[descriptor_positions<Mask>[K]] = std::move(values[K])), ...);
+    return described;
+}
+
+/**
+ * @brief Calls describe_mask with the compiled mask equal to the requested one.
+ */
+template <typename Spectra, uint32_t... Masks>
+auto describe_any(Spectra &spectra, const double &energy, const uint64_t &channels, const uint32_t &mask, std::integer_sequence<uint32_t, Masks...>)
+{
+    decltype(describe_mask<1>(spectra, energy, channels, std::make_index_sequence<1>())) described{};
+    ((mask == Masks + 1 and (described = describe_mask<Masks + 1>(spectra, energy, channels, std::make_index_sequence<std::popcount(Masks + 1)>()), true)) or ...);
+    return described;
+}
+
+/**
+ * @brief Computes the descriptors requested with --descriptors in one pass over the integration window, for one spectrum or for all the spectra of a cube. Every set of descriptors
+ * is compiled into its own pass, so only the requested ones are computed.
+ *
+ * @param spectra A basic_spectrum or a basic_spectrum_cube.
+ * @param energy Energy to be mapped.
+ * @param channels The amount of channels to integrate per side.
+ * @param requested Positions in descriptor_names of the requested descriptors, comes from read_descriptors.
+ * @return Returns the descriptors in the positions of descriptor_names, the ones that were not requested are left empty: an array of values for a spectrum, an array of vectors with
+ * one value per spectrum for a cube.
+ */
+template <typename Spectra>
+auto describe(Spectra &spectra, const double &energy, const uint64_t &channels, const std::vector<size_t> &requested)
+{
+    uint32_t mask = 0;
+    for (std::vector<size_t>::const_iterator d = requested.begin(); d < requested.end(); d++)
+        mask |= 1u << *d;
+    return describe_any(spectra, energy, channels, mask, std::make_integer_sequence<uint32_t, (1u << std::tuple_size_v<descriptor_list>) - 1>());
+}
+
+/**
+ * @brief Reads the descriptors requested with --descriptors as a list separated by commas, e.g. peak-energy,fwhm.
+ *
+ * @param options Optional arguments from the command line.
+ * @return Returns the position of every requested descriptor in descriptor_names, without repetitions. It is empty if the option is not given.
+ */
+std::vector<size_t> read_descriptors(const std::map<std::string, std::string> &options)
+{
+    std::vector<size_t> descriptors;
+    if (!options.contains("descriptors"))
+        return descriptors;
+    std::istringstream list(options.at("descriptors"));
+    for (std::string name; std::getline(list, name, ',');)
+    {
+        std::array<std::string, 5>::const_iterator found = std::find(descriptor_names.begin(), descriptor_names.end(), name);
+        if (found == descriptor_names.end())
+            throw std::invalid_argument("Descriptor " + name + " not identified. Allowed descriptors are: integrated, peak-maximum, peak-energy, centroid, fwhm");
+        size_t position = static_cast<size_t>(found - descriptor_names.begin());
+        if (std::find(descriptors.begin(), descriptors.end(), position) == descriptors.end())
+            descriptors.push_back(position);
+    }
+    if (descriptors.empty())
+        throw std::invalid_argument("--descriptors needs at least one descriptor");
+    return descriptors;
+}
+
+/**
+ * @brief Fills the containers to build a data_map with the points extracted from the files, in the order of the directory listing so repeated positions are always reported the same way.
+ *
+ * @param points Points extracted from the files, comes from extract_directory.
+ * @param x The x coordinate of every point.
+ * @param y The y coordinate of every point.
+ * @param intensity The intensity of every point, or the descriptors of every point.
+ * @return Returns the total amount of bytes read from the files.
+ */
+template <typename Result>
+uint64_t fill_map(const std::vector<basic_extracted_point<Result>> &points, std::vector<double> &x, std::vector<double> &y, std::vector<Result> &intensity)
+{
+    uint64_t bytes_read = 0;
+    x.reserve(points.size());
+    y.reserve(points.size());
+    intensity.reserve(points.size());
+    for (typename std::vector<basic_extracted_point<Result>>::const_iterator i = points.begin(); i < points.end(); i++)
+    {
+        x.push_back(i->x);
+        y.push_back(i->y);
+        intensity.push_back(i->intensity);
+        bytes_read += i->bytes;
+    }
+    return bytes_read;
+}
+
+/**
+ * @brief Checks that a value from the command line is a positive float or integer.
+ *
+ * @param energy Value written in the command line.
+ * @return Returns the value as a double. If it is not a number, throws an invalid_argument exception.
+ */
+double read_energy(const std::string &energy)
+{
+    if (energy.empty())
+        throw std::invalid_argument("Energy must be a float or an integer");
+    for (std::string::const_iterator c = energy.begin(); c < energy.end(); c++)
+    {
+        if (!isdigit(static_cast<unsigned char>(*c)))
+        {
+            if (*c != '.')
+                throw std::invalid_argument("Energy must be a float or an integer");
+        }
+    }
+    return std::stod(energy);
+}
+
+/**
+ * @brief Counts the decimal places of a value written in the command line.
+ *
+ * @param value Value as written, e.g. "0.005".
+ * @return Returns the amount of digits after the decimal point, 0 if it has none.
+ */
+size_t decimal_places(const std::string &value)
+{
+    size_t point = value.find('.');
+    return point == std::string::npos ? 0 : value.size() - point - 1;
+}
+
+/**
+ * @brief Reads the energies requested with --energies. They can be written as a list 'e1,e2,e3' or as a range 'first:last:step' that includes both limits.
+ *
+ * @param list Value of the option.
+ * @return Returns a vector with the energies to be mapped.
+ */
+std::vector<double> read_energies(const std::string &list)
+{
+    std::vector<double> energies;
+    if (list.find(':') != std::string::npos)
+    {
+        uint64_t first_separator = list.find(':');
+        uint64_t second_separator = list.find(':', first_separator + 1);
+        if (second_separator == std::string::npos or list.find(':', second_separator + 1) != std::string::npos)
+            throw std::invalid_argument("Energy range must be written as first:last:step");
+        double first = read_energy(list.substr(0, first_separator));
+        double last = read_energy(list.substr(first_separator + 1, second_separator - first_separator - 1));
+        double step = read_energy(list.substr(second_separator + 1));
+        if (step <= 0 or last < first)
+            throw std::invalid_argument("Energy range must have a positive step and the last energy must be larger than the first one");
+        uint64_t steps = static_cast<uint64_t>(std::floor((last - first) / step + 1e-9));
+        // first + k * step can land one ULP away from the decimal value, and then from the channel of the energy axis. Every energy is rounded to the decimal places of first
+        // and step and read again, so a map of the range is the same as the map of that energy alone.
+        std::ostringstream energy;
+        energy.setf(std::ios::fixed);
+        energy.precision(static_cast<std::streamsize>(std::max(decimal_places(list.substr(0, first_separator)), decimal_places(list.substr(second_separator + 1)))));
+        for (uint64_t k = 0; k <= steps; k++)
+        {
+            energy.str("");
+            energy << first + static_cast<double>(k) * step;
+            energies.push_back(read_energy(energy.str()));
+        }
+    }
+    else
+    {
+        uint64_t start = 0;
+        while (start <= list.size())
+        {
+            uint64_t separator = list.find(',', start);
+            if (separator == std::string::npos)
+                separator = list.size();
+            energies.push_back(read_energy(list.substr(start, separator - start)));
+            start = separator + 1;
+        }
+    }
+    return energies;
+}
+
+/**
+ * @brief Checks that a value from the command line is a float or an integer, with an optional minus sign for the energies below the zero-loss peak.
+ *
+ * @param energy Value written in the command line.
+ * @return Returns the value as a double. If it is not a number, throws an invalid_argument exception.
+ */
+double read_signed_energy(const std::string &energy)
+{
+    if (!energy.empty() and energy[0] == '-')
+        return -read_energy(energy.substr(1));
+    return read_energy(energy);
+}
+
+/**
+ * @brief Reads the energy range requested with --sweep, --background or --align, written as 'first:last'.
+ *
+ * @param range Value of the option.
+ * @return Returns a vector with the first and the last energy.
+ */
+std::vector<double> read_range(const std::string &range)
+{
+    uint64_t separator = range.find(':');
+    if (separator == std::string::npos or range.find(':', separator + 1) != std::string::npos)
+        throw std::invalid_argument("Energy ranges for --sweep, --background and --align must be written as first:last");
+    std::vector<double> limits = {read_signed_energy(range.substr(0, separator)), read_signed_energy(range.substr(separator + 1))};
+    if (limits[1] < limits[0])
+        throw std::invalid_argument("The last energy must be larger than the first one");
+    return limits;
+}
+
+/**
+ * @brief Removes the binary cache from the directory listing in case it was saved in the same directory as the data files.
+ *
+ * @param files Paths to the data files, comes from opendirectory.
+ * @param cache Path to the binary cache, empty if no cache is used.
+ */
+void remove_cache(std::vector<fs::path> &files, const fs::path &cache)
+{
+    if (cache.empty() or !fs::exists(cache))
+        return;
+    std::erase_if(files, [&](const fs::path &file)
+                  { return fs::equivalent(file, cache); });
+}
+
+/**
+ * @brief Checks that the requested output format is one of the formats supported by the program.
+ *
+ * @param format Output format from the command line.
+ */
+void check_format(const std::string &format)
+{
+    if (format != "raw" and format != "grid" and format != "bmp" and format != "all" and format != "npy" and format != "frames")
+        throw std::invalid_argument("Specified format not identified. Allowed format is: all, grid, raw, bmp, npy, frames");
+}
+
+/**
+ * @brief Writes the files requested in the command line for a data_map.
+ *
+ * @param spectra_map The data_map with the extracted intensities.
+ * @param format Output format: all, raw, grid, bmp or npy.
+ * @param project_title Title of the output files.
+ * @param threads Amount of worker threads to build the formatted grid.
+ * @param colormap Colormap of the bitmap.
+ */
+void write_map(data_map &spectra_map, const std::string &format, std::string project_title, const unsigned &threads, const std::string &colormap)
+{
+    if (format == "raw" or format == "all")
+    {
+        std::string raw_title = project_title + "-raw";
+        std::vector<double> map = spectra_map.show_raw();
+        uint64_t width = spectra_map.show_dimensions("width");
+        std::cout << "Raw width is: " << width << '\n';
+        uint64_t height = spectra_map.show_dimensions("length");
+        std::cout << "Raw height is: " << height << '\n';
+        external_plot(map, width, height, raw_title, threads);
+        std::vector<double> x = spectra_map.show_axis("x");
+        std::vector<double> y = spectra_map.show_axis("y");
+        external_plot_axis(x, y, raw_title);
+    }
+    if (format == "npy")
+        export_npy(spectra_map, project_title, threads);
+    if (format == "bmp")
+    {
+        // Only the bitmap is needed, so the formatted grid is written in bands instead of being kept in memory.
+        std::cout << "Formatted width is: " << spectra_map.show_formatted_dimensions("width") << '\n';
+        std::cout << "Formatted height is:" << spectra_map.show_formatted_dimensions("length") << '\n';
+        stream_bitmap(spectra_map, project_title, colormap, threads);
+    }
+    if (format == "grid" or format == "all")
+    {
+        std::string grid_title = project_title + "-grid";
+        std::vector<double> formatted_map = spectra_map.show_formatted_grid(threads);
+        uint64_t width = spectra_map.show_formatted_dimensions("width");
+        std::cout << "Formatted width is: " << width << '\n';
+        uint64_t height = spectra_map.show_formatted_dimensions("length");
+        std::cout << "Formatted height is:" << height << '\n';
+        external_plot(formatted_map, width, height, grid_title, threads);
+        if (format == "all")
+            build_bitmap(formatted_map, width, height, project_title, colormap);
+    }
+}
+
+/**
+ * @brief Settings from the command line to extract maps from a spectrum_cube.
+ */
+struct map_request
+{
+    /**
+     * @brief Energies to be mapped. For a sweep it only has the first and last energy of the range.
+     */
+    std::vector<double> energies;
+    /**
+     * @brief Maps every energy of the axis between the two values in energies, moving the integration window one channel at a time.
+     */
+    bool sweep = false;
+    uint64_t channels = 0;
+    bool integrated = false;
+    std::string format;
+    std::string project_title;
+    /**
+     * @brief Adds the energy to the title of the outputs.
+     */
+    bool series = false;
+    std::string colormap = "orange";
+    /**
+     * @brief Descriptors written instead of the integrated map, as positions in descriptor_names. Every descriptor gets its name at the end of the title.
+     */
+    std::vector<size_t> descriptors;
+    /**
+     * @brief Stores the intensities of the spectra as float instead of double, see --precision.
+     */
+    bool single_precision = false;
+    /**
+     * @brief First and last energy of the pre-edge window of --background, empty if the background is not subtracted.
+     */
+    std::vector<double> background;
+    /**
+     * @brief First and last energy of the zero-loss peak window of --align, empty if the spectra are not aligned.
+     */
+    std::vector<double> alignment;
+    /**
+     * @brief Amount of principal components kept by --pca, 0 if the spectra are not denoised.
+     */
+    uint64_t components = 0;
+    /**
+     * @brief Amount of classes of --clusters, 0 if the spectra are not classified.
+     */
+    uint64_t classes = 0;
+};
+
+/**
+ * @brief Writes a map of values that are not intensities, e.g. shifts, scores or classes. The grid and the bitmap are normalized with the maximum, which does not work with signed
+ * values, so the map is only written as a raw map or as NumPy files.
+ *
+ * @param value_map Map to be written.
+ * @param request Format and colormap of the outputs.
+ * @param title Title of the output files.
+ * @param threads Amount of worker threads.
+ */
+void write_value_map(data_map &value_map, const map_request &request, const std::string &title, const unsigned &threads)
+{
+    if (request.format != "npy")
+    {
+        write_map(value_map, "raw", title, threads, request.colormap);
+        return;
+    }
+    std::vector<double> raw = value_map.show_raw();
+    write_npy(title + "-raw.npy", raw.data(), {value_map.show_dimensions("length"), value_map.show_dimensions("width")});
+    std::vector<double> x = value_map.show_axis("x");
+    std::vector<double> y = value_map.show_axis("y");
+    write_npy(title + "-raw-x-axis-handles.npy", x.data(), {x.size()});
+    write_npy(title + "-raw-y-axis-handles.npy", y.data(), {y.size()});
+}
+
+/**
+ * @brief Aligns the zero-loss peak of every spectrum of a cube to the mean peak and prints the range of the shifts, so the drift of the range is visible before the maps are read.
+ *
+ * @param cube Cube with the spectra.
+ * @param alignment First and last energy of the zero-loss peak window of --align, empty to leave the spectra where they are.
+ * @param threads Amount of worker threads.
+ * @return Returns the shift of every spectrum in energy units, empty if the spectra were not aligned.
+ */
+template <typename Value>
+std::vector<double> align_cube(basic_spectrum_cube<Value> &cube, const std::vector<double> &alignment, const unsigned &threads)
+{
+    if (alignment.empty())
+        return std::vector<double>();
+    std::vector<double> shifts = cube.align_zero_loss(alignment[0], alignment[1], threads);
+    std::pair<std::vector<double>::const_iterator, std::vector<double>::const_iterator> limits = std::minmax_element(shifts.begin(), shifts.end());
+    std::cout << "Aligned the zero-loss peak of " << shifts.size() << " spectra, shifts from " << *limits.first << " to " << *limits.second << '\n';
+    return shifts;
+}
+
+/**
+ * @brief Prints how many spectra had their power-law background subtracted and how many were left unchanged because the background could not be fitted.
+ *
+ * @param spectra Amount of spectra.
+ * @param unfitted Amount of spectra without two positive intensities in the pre-edge window.
+ */
+void report_background(const uint64_t &spectra, const uint64_t &unfitted)
+{
+    std::cout << "Subtracted the power-law background of " << spectra - unfitted << " spectra";
+    if (unfitted > 0)
+        std::cout << ", " << unfitted << " spectra without two positive intensities in the window were not changed";
+    std::cout << '\n';
+}
+
+/**
+ * @brief Subtracts the power-law background from every spectrum of a cube and prints how many spectra could not be fitted, see report_background.
+ *
+ * @param cube Cube with the spectra.
+ * @param background First and last energy of the pre-edge window of --background, empty to keep the background.
+ * @param threads Amount of worker threads.
+ */
+template <typename Value>
+void subtract_cube_background(basic_spectrum_cube<Value> &cube, const std::vector<double> &background, const unsigned &threads)
+{
+    if (background.empty())
+        return;
+    uint64_t unfitted = cube.subtract_background(background[0], background[1], threads);
+    report_background(cube.show_pixels(), unfitted);
+}
+
+/**
+ * @brief Subtracts the power-law background of --background from spectra read one by one, e.g. inside extract_directory, and counts the spectra whose background could not be fitted.
+ * It can be called from several threads.
+ */
+struct background_subtraction
+{
+    /**
+     * @brief First and last energy of the pre-edge window, empty if --background was not given.
+     */
+    std::vector<double> window;
+    std::atomic<uint64_t> unfitted{0};
+
+    template <typename Spectrum>
+    void operator()(Spectrum &current_spectrum)
+    {
+        if (!window.empty() and !current_spectrum.subtract_background(window[0], window[1]))
+            unfitted++;
+    }
+
+    /**
+     * @brief Prints the report of report_background for the spectra subtracted since the last report.
+     *
+     * @param spectra Amount of spectra read since the last report.
+     */
+    void report(const uint64_t &spectra)
+    {
+        if (!window.empty())
+            report_background(spectra, unfitted.exchange(0));
+    }
+};
+
+/**
+ * @brief Denoises the spectra of a cube with --pca: the spectra are decomposed in principal components and replaced by their reconstruction from the requested components. Prints the
+ * fraction of the variance of every component, to judge how many of them carry signal.
+ *
+ * @param cube Cube with the spectra.
+ * @param components Amount of principal components, 0 to keep the spectra as they are.
+ * @param threads Amount of worker threads.
+ * @return Returns the principal components, with no components if the spectra were not denoised.
+ */
+template <typename Value>
+principal_components denoise_cube(basic_spectrum_cube<Value> &cube, const uint64_t &components, const unsigned &threads)
+{
+    if (components == 0)
+        return principal_components();
+    principal_components pca = cube.decompose(components, threads);
+    cube.reconstruct(pca, threads);
+    for (uint64_t c = 0; c < pca.components; c++)
+    {
+        double fraction = pca.total_variance > 0 ? pca.singular_values[c] * pca.singular_values[c] / pca.total_variance : 0;
+        std::cout << "Principal component " << c + 1 << ": " << 100 * fraction << "% of the variance" << '\n';
+    }
+    return pca;
+}
+
+/**
+ * @brief Writes a principal component of --pca: its loading as a spectrum in title-pcN-loading.txt and its scores as a map named title-pcN, written like the other maps of values.
+ *
+ * @param loading Loading of the component, from show_loading.
+ * @param score_map Map with the score of every spectrum, from show_scores.
+ * @param component Index of the component, from 0.
+ * @param request Format, colormap and title of the outputs.
+ * @param threads Amount of worker threads.
+ */
+void write_component(spectrum &loading, data_map &score_map, const uint64_t &component, const map_request &request, const unsigned &threads)
+{
+    std::string component_title = request.project_title + "-pc" + std::to_string(component + 1);
+    write_spectrum(loading, component_title + "-loading.txt");
+    write_value_map(score_map, request, component_title, threads);
+}
+
+/**
+ * @brief Classifies the spectra of a cube with --clusters and writes the class map and the centroid spectrum of every class. The class numbers are written as a raw map or as NumPy
+ * files, and with the grid, bmp, all and frames formats also as a grid and a bitmap with a colour per class.
+ *
+ * @param cube Cube with the spectra.
+ * @param request Amount of classes (no maps are written if it is 0), format and title of the outputs.
+ * @param threads Amount of worker threads.
+ */
+template <typename Value>
+void write_class_maps(basic_spectrum_cube<Value> &cube, const map_request &request, const unsigned &threads)
+{
+    if (request.classes == 0)
+        return;
+    spectral_classes result = cube.classify(request.classes, threads);
+    std::cout << "Classified the spectra in " << result.classes << " classes after " << result.iterations << " iterations, sum of squared distances " << result.inertia << '\n';
+    for (uint64_t c = 0; c < result.classes; c++)
+    {
+        std::cout << "Class " << c + 1 << ": " << result.sizes[c] << " spectra" << '\n';
+        spectrum centroid = cube.show_centroid(result, c);
+        write_spectrum(centroid, request.project_title + "-class" + std::to_string(c + 1) + "-centroid.txt");
+    }
+    std::string classes_title = request.project_title + "-classes";
+    data_map class_map = cube.show_classes(result);
+    write_value_map(class_map, request, classes_title, threads);
+    if (request.format == "raw" or request.format == "npy")
+        return;
+    std::vector<double> grid = class_grid(class_map, threads);
+    uint64_t width = class_map.show_formatted_dimensions("width");
+    uint64_t length = class_map.show_formatted_dimensions("length");
+    if (request.format == "grid" or request.format == "all")
+    {
+        std::string grid_title = classes_title + "-grid";
+        external_plot(grid, width, length, grid_title, threads);
+    }
+    if (request.format != "grid")
+        build_class_bitmap(grid, width, length, classes_title);
+}
+
+/**
+ * @brief Writes one map per requested descriptor. The map is refilled with every descriptor, so its positions and resampling plan are reused.
+ *
+ * @param spectra_map Map with the positions of the spectra, created with the first descriptor if it is empty.
+ * @param make_map Callable that creates the map from the values of a descriptor.
+ * @param values Values of every descriptor in the order of descriptor_names, one per spectrum.
+ * @param title Title of the outputs, the name of the descriptor is added at the end.
+ * @param request Descriptors and outputs requested in the command line.
+ * @param threads Amount of worker threads.
+ */
+template <typename MakeMap>
+void write_descriptor_maps(std::unique_ptr<data_map> &spectra_map, MakeMap make_map, const std::array<std::vector<double>, 5> &values, const std::string &title, const map_request &request, const unsigned &threads)
+{
+    for (std::vector<size_t>::const_iterator d = request.descriptors.begin(); d < request.descriptors.end(); d++)
+    {
+        if (!spectra_map)
+            spectra_map = std::make_unique<data_map>(make_map(values[*d]));
+        else
+            spectra_map->refill(values[*d]);
+        write_map(*spectra_map, request.format, title + "-" + descriptor_names[*d], threads, request.colormap);
+    }
+}
+
+/**
+ * @brief Reads the whole directory once into a spectrum_cube and writes the output files for every requested energy. For integrated maps the cumulative sums of the spectra are used
+ * when the windows of all the energies together would add more values than the length of the axis.
+ *
+ * @param files Paths to the data files.
+ * @param threads Amount of worker threads to read the files.
+ * @param cache Path to the binary cache of the directory, empty if no cache is used.
+ * @param request Energies, intensity mode and outputs requested in the command line.
+ */
+template <typename Value>
+void write_energy_series(const std::vector<fs::path> &files, const unsigned &threads, const fs::path &cache, const map_request &request)
+{
+    std::chrono::steady_clock::time_point ingest_start = std::chrono::steady_clock::now();
+    basic_spectrum_cube<Value> cube(files, threads, cache);
+    if (cube.show_cached() > 0)
+        std::cout << "Copied " << cube.show_cached() << " spectra from the cache " << cache.string() << '\n';
+    report_throughput(cube.show_pixels() - cube.show_cached(), cube.show_size(), ingest_start);
+    std::vector<double> shifts = align_cube(cube, request.alignment, threads);
+    if (!shifts.empty())
+    {
+        data_map shift_map = cube.show_map(shifts);
+        write_value_map(shift_map, request, request.project_title + "-shift", threads);
+    }
+    subtract_cube_background(cube, request.background, threads);
+    principal_components pca = denoise_cube(cube, request.components, threads);
+    for (uint64_t c = 0; c < pca.components; c++)
+    {
+        spectrum loading = cube.show_loading(pca, c);
+        data_map score_map = cube.show_scores(pca, c);
+        write_component(loading, score_map, c, request, threads);
+    }
+    write_class_maps(cube, request, threads);
+
+    std::vector<double> energies = request.sweep ? cube.show_energies_between(request.energies[0], request.energies[1]) : request.energies;
+    bool prefix_sums = request.integrated and request.descriptors.empty() and energies.size() * (2 * request.channels + 1) > cube.show_energy_axis().size();
+    if (prefix_sums)
+        cube.build_prefix_sums(threads);
+    if (request.format == "frames")
+    {
+        // Every frame is extracted from the cube by its own thread, so the cube is not reordered by energy.
+        data_map geometry = cube.show_map(std::vector<double>(cube.show_pixels(), 0));
+        auto extract = [&](const double &energy)
+        {
+            return request.integrated ? cube.integrated_intensity(energy, request.channels) : cube.interpolated_intensity(energy);
+        };
+        std::vector<std::string> frames = render_frames(geometry, energies, extract, request.project_title, request.colormap, threads);
+        std::string index_name = request.project_title + "-frames.txt";
+        std::ofstream index(index_name);
+        for (size_t f = 0; f < frames.size(); f++)
+            index << fs::path(frames[f]).filename().string() << ' ' << energies[f] << '\n';
+        index.close();
+        if (!index)
+            throw std::invalid_argument("Error writing the file " + index_name);
+        std::cout << "Created " << frames.size() << " frames from " << frames.front() << " to " << frames.back() << ", energies in " << index_name << '\n';
+        return;
+    }
+    // For a series without cumulative sums the intensities are reordered by energy once, so every map reads contiguous planes.
+    std::unique_ptr<basic_energy_major_cube<Value>> planes;
+    if (energies.size() > 1 and !prefix_sums and request.descriptors.empty())
+        planes = std::make_unique<basic_energy_major_cube<Value>>(cube, threads);
+
+    // The cube does not depend on the energy, so it is exported once with the title of the series.
+    if (request.format == "npy")
+        export_npy(cube, request.project_title);
+
+    std::unique_ptr<data_map> spectra_map;
+    for (std::vector<double>::const_iterator e = energies.begin(); e < energies.end(); e++)
+    {
+        if (!request.descriptors.empty())
+        {
+            // All the descriptors come from one pass over every spectrum of the cube.
+            std::ostringstream title;
+            title << request.project_title;
+            if (request.series)
+                title << '-' << *e;
+            auto make_map = [&](const std::vector<double> &values)
+            {
+                return cube.show_map(values);
+            };
+            write_descriptor_maps(spectra_map, make_map, describe(cube, *e, request.channels, request.descriptors), title.str(), request, threads);
+            continue;
+        }
+        std::vector<double> values;
+        if (planes)
+            values = request.integrated ? planes->integrated_intensity(*e, request.channels) : planes->interpolated_intensity(*e);
+        else
+            values = request.integrated ? cube.integrated_intensity(*e, request.channels) : cube.interpolated_intensity(*e);
+        // Every energy has the same positions, so the map and its resampling plan are built once and refilled for the next energies.
+        if (!spectra_map)
+            spectra_map = std::make_unique<data_map>(cube.show_map(values));
+        else
+            spectra_map->refill(values);
+        std::ostringstream title;
+        title << request.project_title;
+        if (request.series)
+            title << '-' << *e;
+        write_map(*spectra_map, request.format, title.str(), threads, request.colormap);
+    }
+}
+
+/**
+ * @brief Writes the outputs of an energy series with the storage precision of the request.
+ */
+void write_energy_series(const std::vector<fs::path> &files, const unsigned &threads, const fs::path &cache, const map_request &request)
+{
+    if (request.single_precision)
+        write_energy_series<float>(files, threads, cache, request);
+    else
+        write_energy_series<double>(files, threads, cache, request);
+}
+
+/**
+ * @brief Set by SIGINT or SIGTERM to stop the watch and server modes.
+ */
+volatile std::sig_atomic_t stop_requested = 0;
+
+/**
+ * @brief Signal handler of the watch and server modes.
+ */
+void request_stop(int)
+{
+    stop_requested = 1;
+}
+
+/**
+ * @brief State of the outputs written by the watch mode, used to decide which rows have to be written again.
+ */
+struct watch_outputs
+{
+    /**
+     * @brief Writes every output again, e.g. the first time or after the axes changed.
+     */
+    bool full = true;
+    /**
+     * @brief Rows of the raw map updated since the last render.
+     */
+    std::set<uint64_t> rows;
+    double maximum = 0;
+    uint32_t width = 0;
+    uint32_t length = 0;
+    /**
+     * @brief Normalized formatted grid, kept only for the grid text file.
+     */
+    std::vector<double> grid;
+};
+
+/**
+ * @brief Writes the outputs of the map during the watch mode. The raw files are written again, and if the resampling plan and the maximum of the map did not change, only the rows
+ * of the formatted grid that come from updated rows of the raw map are computed again and replaced in the BMP file and in the grid. Otherwise every output is written again.
+ *
+ * @param spectra_map Map with the spectra received so far.
+ * @param state Outputs written by the previous render.
+ * @param request Format, title and colormap of the outputs.
+ * @param threads Amount of worker threads.
+ * @return Returns false if the map does not have enough positions yet to build the formatted grid.
+ */
+bool render_watch(data_map &spectra_map, watch_outputs &state, const map_request &request, const unsigned &threads)
+{
+    if (spectra_map.show_dimensions("width") < 2 or spectra_map.show_dimensions("length") < 2)
+        return false;
+    std::string title = request.project_title;
+    const std::string &format = request.format;
+    if (format == "raw" or format == "all")
+    {
+        std::string raw_title = title + "-raw";
+        std::vector<double> map = spectra_map.show_raw();
+        external_plot(map, spectra_map.show_dimensions("width"), spectra_map.show_dimensions("length"), raw_title, threads);
+        std::vector<double> x = spectra_map.show_axis("x");
+        std::vector<double> y = spectra_map.show_axis("y");
+        external_plot_axis(x, y, raw_title);
+    }
+    if (format == "npy")
+        export_npy(spectra_map, title, threads);
+
+    bool grid = format == "grid" or format == "all";
+    bool bitmap = format == "bmp" or format == "all";
+    if (grid or bitmap)
+    {
+        const data_map::resampling_plan &plan = spectra_map.show_resampling_plan();
+        double maximum = spectra_map.show_formatted_maximum();
+        std::string grid_title = title + "-grid";
+        if (state.full or maximum != state.maximum or plan.width != state.width or plan.length != state.length)
+        {
+            if (grid)
+            {
+                state.grid = spectra_map.show_formatted_grid(threads);
+                external_plot(state.grid, plan.width, plan.length, grid_title, threads);
+            }
+            if (bitmap)
+                stream_bitmap(spectra_map, title, request.colormap, threads);
+        }
+        else
+        {
+            std::vector<double> band;
+            uint64_t width = spectra_map.show_dimensions("width");
+            for (std::set<uint64_t>::const_iterator r = state.rows.begin(); r != state.rows.end(); r++)
+            {
+                // The plan goes through the raw rows in order, so the rows of the grid that come from one raw row are contiguous.
+                std::pair<std::vector<uint64_t>::const_iterator, std::vector<uint64_t>::const_iterator> rows = std::equal_range(plan.rows.begin(), plan.rows.end(), *r * width);
+                uint64_t first = static_cast<uint64_t>(rows.first - plan.rows.begin());
+                uint64_t count = static_cast<uint64_t>(rows.second - rows.first);
+                if (count == 0)
+                    continue;
+                band.resize(count * plan.width);
+                spectra_map.show_formatted_rows(first, count, maximum, band.data(), threads);
+                if (grid)
+                    std::copy(band.begin(), band.end(), state.grid.begin() + static_cast<std::ptrdiff_t>(first * plan.width));
+                if (bitmap)
+                    update_bitmap_rows(title + ".bmp", plan.width, plan.length, first, count, band.data(), request.colormap);
+            }
+            if (grid)
+                external_plot(state.grid, plan.width, plan.length, grid_title, threads);
+            if (bitmap)
+                std::cout << "Updated " << state.rows.size() << " rows of the raw map in: " << title << ".bmp" << '\n';
+        }
+        state.maximum = maximum;
+        state.width = plan.width;
+        state.length = plan.length;
+    }
+    state.full = false;
+    state.rows.clear();
+    return true;
+}
+
+/**
+ * @brief Reads the spectra already in the directory and keeps the map updated with the spectra that arrive during the acquisition, until the program is interrupted with Ctrl+C.
+ * Only the new files are read; their intensity is written into the raw map and the outputs are written again at most once per interval.
+ *
+ * @param directory Path to the data directory.
+ * @param threads Amount of worker threads.
+ * @param interval Minimum time between two renders in seconds.
+ * @param request Energy, intensity mode and outputs requested in the command line.
+ */
+template <typename Value>
+void watch_directory(const fs::path &directory, const unsigned &threads, const double &interval, const map_request &request)
+{
+    // The watch starts before the listing, so a file written in between is not lost.
+    directory_watcher watcher(directory);
+    std::signal(SIGINT, request_stop);
+    std::signal(SIGTERM, request_stop);
+    double energy = request.energies[0];
+    background_subtraction subtract_background;
+    subtract_background.window = request.background;
+    auto extract = [&](basic_spectrum<Value> &current_spectrum)
+    {
+        subtract_background(current_spectrum);
+        return request.integrated ? current_spectrum.integrated_intensity(energy, request.channels) : current_spectrum.interpolated_intensity(energy);
+    };
+    // The outputs of render_watch are not spectra if they are written in the data directory. Only their exact names are skipped, so spectra whose names start with the title are kept.
+    std::string title = fs::path(request.project_title).filename().string();
+    const std::set<std::string> outputs = {title + "-raw.txt", title + "-raw-x-axis-handles.txt", title + "-raw-y-axis-handles.txt", title + "-grid.txt", title + ".bmp",
+                                           title + "-raw.npy", title + "-raw-x-axis-handles.npy", title + "-raw-y-axis-handles.npy", title + "-grid.npy"};
+    auto output_file = [&](const fs::path &file)
+    {
+        return outputs.contains(file.filename().string());
+    };
+
+    std::vector<fs::path> files = opendirectory(directory.string());
+    std::erase_if(files, output_file);
+    std::chrono::steady_clock::time_point ingest_start = std::chrono::steady_clock::now();
+    std::vector<extracted_point> points = extract_directory<Value>(files, threads, extract);
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<double> intensity;
+    uint64_t bytes_read = fill_map(points, x, y, intensity);
+    report_throughput(files.size(), bytes_read, ingest_start);
+    subtract_background.report(points.size());
+
+    std::unique_ptr<data_map> spectra_map;
+    if (!x.empty())
+        spectra_map = std::make_unique<data_map>(x, y, intensity);
+    watch_outputs state;
+    bool pending = spectra_map != nullptr;
+    std::chrono::steady_clock::time_point last_render = std::chrono::steady_clock::now() - std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(interval));
+    std::cout << "Watching " << directory.string() << " for new spectra, press Ctrl+C to stop" << '\n';
+    while (!stop_requested)
+    {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - last_render).count();
+        if (pending and elapsed >= interval)
+        {
+            if (render_watch(*spectra_map, state, request, threads))
+                pending = false;
+            last_render = std::chrono::steady_clock::now();
+            elapsed = 0;
+        }
+        int wait = pending ? static_cast<int>(std::ceil((interval - elapsed) * 1000)) : static_cast<int>(std::ceil(interval * 1000));
+        std::vector<fs::path> arrived = watcher.wait(std::max(wait, 1));
+        std::erase_if(arrived, output_file);
+        for (std::vector<fs::path>::const_iterator f = arrived.begin(); f < arrived.end(); f++)
+        {
+            // A file that can not be read yet is reported and skipped, it is read again if it is written once more.
+            try
+            {
+                basic_spectrum<Value> current_spectrum(*f);
+                double value = extract(current_spectrum);
+                double file_x = current_spectrum.show_position("x");
+                double file_y = current_spectrum.show_position("y");
+                uint64_t raw_row = 0;
+                if (!spectra_map)
+                {
+                    spectra_map = std::make_unique<data_map>(std::vector<double>{file_x}, std::vector<double>{file_y}, std::vector<double>{value});
+                    state.full = true;
+                }
+                else if (spectra_map->update(file_x, file_y, value, raw_row))
+                    state.full = true;
+                else
+                    state.rows.insert(raw_row);
+                pending = true;
+            }
+            catch (std::invalid_argument const &e)
+            {
+                std::cout << e.what() << '\n';
+            }
+        }
+        // The new spectra are only reported if some of them could not be fitted.
+        if (subtract_background.unfitted > 0)
+            subtract_background.report(arrived.size());
+    }
+    if (pending)
+        render_watch(*spectra_map, state, request, threads);
+    std::signal(SIGINT, SIG_DFL);
+    std::signal(SIGTERM, SIG_DFL);
+}
+
+/**
+ * @brief Watches the directory reading the spectra with the storage precision of the request.
+ */
+void watch_directory(const fs::path &directory, const unsigned &threads, const double &interval, const map_request &request)
+{
+    if (request.single_precision)
+        watch_directory<float>(directory, threads, interval, request);
+    else
+        watch_directory<double>(directory, threads, interval, request);
+}
+
+/**
+ * @brief Spectra and map kept in memory by the server mode. Only the cube ordered by energy is kept, behind the two extraction calls, so the server does not depend on the storage
+ * precision. The map is built when the spectra are loaded and refilled for every request, so its geometry and resampling plan are reused.
+ */
+struct map_server
+{
+    std::function<std::vector<double>(const double &)> interpolated;
+    std::function<std::vector<double>(const double &, const uint64_t &)> integrated;
+    std::vector<double> energy_ax;
+    uint64_t spectra = 0;
+    std::unique_ptr<data_map> spectra_map;
+    unsigned threads = 1;
+    std::string format = "all";
+    std::string colormap = "orange";
+    /**
+     * @brief Shift of every spectrum measured by --align when the spectra were loaded, empty if they were not aligned.
+     */
+    std::vector<double> shifts;
+    /**
+     * @brief Loading and scores of every principal component of --pca, empty if the spectra were not denoised.
+     */
+    std::vector<spectrum> loadings;
+    std::vector<std::vector<double>> scores;
+};
+
+/**
+ * @brief Answers one request of the server line protocol. The requests are:
+ * "interpolated energy title", "integrated energy channels title", "shifts title" (the map of the shifts of --align, written like the -shift map of the command line),
+ * "component number title" (the loading and the score map of a principal component of --pca, numbered from 1, written like the command line), "format name" (all, raw, grid, bmp, npy or values), "colormap name", "info" and "help". With the values format the raw map is returned in the answer instead of being written in files.
+ *
+ * @param server Spectra and settings of the server.
+ * @param line Request, the words are separated by spaces.
+ * @return Returns the answer: a single line starting with "ok" or "error".
+ */
+std::string answer_request(map_server &server, const std::string &line)
+{
+    std::istringstream words(line);
+    std::vector<std::string> request;
+    for (std::string word; words >> word;)
+        request.push_back(word);
+    if (request.empty())
+        throw std::invalid_argument("Empty request");
+
+    const std::string &command = request[0];
+    if (command == "help")
+        return "ok requests: interpolated energy title | integrated energy channels title | shifts title | component number title | format all|raw|grid|bmp|npy|values | colormap name | info | quit";
+    if (command == "info")
+    {
+        const std::vector<double> &energy = server.energy_ax;
+        std::ostringstream answer;
+        answer << "ok spectra " << server.spectra << " channels " << energy.size() << " energy " << energy.front() << ' ' << energy.back() << " format " << server.format;
+        return answer.str();
+    }
+    if (command == "format" and request.size() == 2)
+    {
+        if (request[1] == "frames")
+            throw std::invalid_argument("The frames format is not available in the server");
+        if (request[1] != "values")
+            check_format(request[1]);
+        server.format = request[1];
+        return "ok format " + server.format;
+    }
+    if (command == "colormap" and request.size() == 2)
+    {
+        make_colormap(request[1]);
+        server.colormap = request[1];
+        return "ok colormap " + server.colormap;
+    }
+
+    std::vector<double> values;
+    std::string title;
+    bool value_map = false;
+    if (command == "shifts" and (request.size() == 2 or (request.size() == 1 and server.format == "values")))
+    {
+        if (server.shifts.empty())
+            throw std::invalid_argument("The spectra were not aligned, start the server with --align to get the shifts");
+        values = server.shifts;
+        title = request.size() == 2 ? request[1] + "-shift" : "";
+        value_map = true;
+    }
+    else if (command == "component" and (request.size() == 3 or (request.size() == 2 and server.format == "values")))
+    {
+        if (server.loadings.empty())
+            throw std::invalid_argument("The spectra were not decomposed, start the server with --pca to get the principal components");
+        const std::string &number = request[1];
+        if (number.empty() or !std::all_of(number.begin(), number.end(), [](const unsigned char c) { return isdigit(c) != 0; }))
+            throw std::invalid_argument("The component must be a positive integer");
+        uint64_t component = std::stoull(number);
+        if (component == 0 or component > server.loadings.size())
+            throw std::invalid_argument("The components are numbered from 1 to " + std::to_string(server.loadings.size()));
+        server.spectra_map->refill(server.scores[component - 1]);
+        if (server.format == "values")
+            values = server.scores[component - 1];
+        else
+        {
+            map_request settings;
+            settings.format = server.format;
+            settings.colormap = server.colormap;
+            settings.project_title = request[2];
+            write_component(server.loadings[component - 1], *server.spectra_map, component - 1, settings, server.threads);
+            return "ok " + request[2] + "-pc" + std::to_string(component);
+        }
+    }
+    else if (command == "interpolated" and (request.size() == 3 or (request.size() == 2 and server.format == "values")))
+    {
+        values = server.interpolated(read_energy(request[1]));
+        title = request.size() == 3 ? request[2] : "";
+    }
+    else if (command == "integrated" and (request.size() == 4 or (request.size() == 3 and server.format == "values")))
+    {
+        const std::string &channel = request[2];
+        if (channel.empty() or !std::all_of(channel.begin(), channel.end(), [](const unsigned char c) { return isdigit(c) != 0; }))
+            throw std::invalid_argument("channel must be an integer");
+        values = server.integrated(read_energy(request[1]), std::stoull(channel));
+        title = request.size() == 4 ? request[3] : "";
+    }
+    else
+        throw std::invalid_argument("Request not recognized, send help to get the list of requests");
+
+    server.spectra_map->refill(values);
+    if (server.format == "values")
+    {
+        std::vector<double> raw = server.spectra_map->show_raw();
+        std::string answer = "ok " + std::to_string(server.spectra_map->show_dimensions("width")) + ' ' + std::to_string(server.spectra_map->show_dimensions("length"));
+        for (std::vector<double>::const_iterator v = raw.begin(); v < raw.end(); v++)
+        {
+            answer.push_back(' ');
+            append_value(answer, *v, 0);
+        }
+        return answer;
+    }
+    if (value_map)
+    {
+        map_request settings;
+        settings.format = server.format;
+        settings.colormap = server.colormap;
+        write_value_map(*server.spectra_map, settings, title, server.threads);
+    }
+    else
+        write_map(*server.spectra_map, server.format, title, server.threads, server.colormap);
+    return "ok " + title;
+}
+
+/**
+ * @brief Answers one request and catches its errors, so a wrong request does not stop the server.
+ */
+std::string answer_safely(map_server &server, const std::string &line)
+{
+    try
+    {
+        return answer_request(server, line);
+    }
+    catch (std::exception const &e)
+    {
+        return std::string("error ") + e.what();
+    }
+}
+
+/**
+ * @brief Reads the requests from the standard input, one per line, and writes every answer as one line in the standard output. The messages of the library go to the standard error
+ * while the server runs, so the standard output only has answers. Stops at the end of the input or with "quit".
+ *
+ * @param server Spectra and settings of the server.
+ */
+void serve_stdin(map_server &server)
+{
+    std::ostream answers(std::cout.rdbuf());
+    std::streambuf *console = std::cout.rdbuf(std::cerr.rdbuf());
+    answers << "ready" << std::endl;
+    for (std::string line; !stop_requested and std::getline(std::cin, line);)
+    {
+        if (!line.empty() and line.back() == '\r')
+            line.pop_back();
+        if (line == "quit")
+            break;
+        answers << answer_safely(server, line) << std::endl;
+    }
+    std::cout.rdbuf(console);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+/**
+ * @brief Listens on a Unix socket and answers the requests of one client at a time with the same line protocol as serve_stdin. "quit" closes the connection; the server stops with Ctrl+C
+ * or SIGTERM and removes the socket.
+ *
+ * @param server Spectra and settings of the server.
+ * @param path Path of the socket file.
+ */
+void serve_socket(map_server &server, const fs::path &path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.string().size() >= sizeof(address.sun_path))
+        throw std::invalid_argument("The path of the socket is too long: " + path.string());
+    std::strcpy(address.sun_path, path.c_str());
+    if (fs::is_socket(path))
+        fs::remove(path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 or bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 or listen(listener, 8) < 0)
+    {
+        std::string error = std::strerror(errno);
+        if (listener >= 0)
+            close(listener);
+        throw std::invalid_argument("Error creating the socket " + path.string() + ": " + error);
+    }
+    std::cout << "Listening on " << path.string() << ", press Ctrl+C to stop" << '\n';
+
+    // Waits with poll, so a signal stops the server even while it waits for a client or a request.
+    auto readable = [](const int descriptor)
+    {
+        pollfd request = {descriptor, POLLIN, 0};
+        return poll(&request, 1, 250) > 0;
+    };
+    while (!stop_requested)
+    {
+        if (!readable(listener))
+            continue;
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0)
+            continue;
+        std::string pending;
+        bool connected = true;
+        while (connected and !stop_requested)
+        {
+            if (!readable(client))
+                continue;
+            char buffer[4096];
+            ssize_t length = read(client, buffer, sizeof(buffer));
+            if (length <= 0)
+                break;
+            pending.append(buffer, static_cast<size_t>(length));
+            for (size_t end = pending.find('\n'); end != std::string::npos; end = pending.find('\n'))
+            {
+                std::string line = pending.substr(0, end);
+                pending.erase(0, end + 1);
+                if (!line.empty() and line.back() == '\r')
+                    line.pop_back();
+                if (line == "quit")
+                {
+                    connected = false;
+                    break;
+                }
+                std::string answer = answer_safely(server, line) + '\n';
+                for (size_t sent = 0; sent < answer.size();)
+                {
+                    ssize_t written = send(client, answer.data() + sent, answer.size() - sent, MSG_NOSIGNAL);
+                    if (written <= 0)
+                    {
+                        connected = false;
+                        break;
+                    }
+                    sent += static_cast<size_t>(written);
+                }
+                if (!connected)
+                    break;
+            }
+        }
+        close(client);
+    }
+    close(listener);
+    fs::remove(path);
+}
+#endif
+
+/**
+ * @brief Reads the directory into a spectrum_cube with the storage type Value and keeps it reordered by energy in the server. The spectrum_cube is released once it is reordered.
+ *
+ * @param server Server where the spectra are loaded.
+ * @param files Paths to the data files.
+ * @param cache Path to the binary cache of the directory, empty if no cache is used.
+ * @param settings Alignment, background and principal components of the spectra.
+ */
+template <typename Value>
+void load_server(map_server &server, const std::vector<fs::path> &files, const fs::path &cache, const map_request &settings)
+{
+    std::chrono::steady_clock::time_point ingest_start = std::chrono::steady_clock::now();
+    basic_spectrum_cube<Value> cube(files, server.threads, cache);
+    report_throughput(cube.show_pixels() - cube.show_cached(), cube.show_size(), ingest_start);
+    server.shifts = align_cube(cube, settings.alignment, server.threads);
+    subtract_cube_background(cube, settings.background, server.threads);
+    principal_components pca = denoise_cube(cube, settings.components, server.threads);
+    for (uint64_t c = 0; c < pca.components; c++)
+    {
+        server.loadings.push_back(cube.show_loading(pca, c));
+        std::vector<double>::const_iterator first = pca.scores.begin() + static_cast<std::ptrdiff_t>(c * pca.pixels);
+        server.scores.push_back(std::vector<double>(first, first + static_cast<std::ptrdiff_t>(pca.pixels)));
+    }
+    std::shared_ptr<basic_energy_major_cube<Value>> planes = std::make_shared<basic_energy_major_cube<Value>>(cube, server.threads);
+    server.interpolated = [planes](const double &energy)
+    {
+        return planes->interpolated_intensity(energy);
+    };
+    server.integrated = [planes](const double &energy, const uint64_t &channels)
+    {
+        return planes->integrated_intensity(energy, channels);
+    };
+    server.energy_ax = cube.show_energy_axis();
+    server.spectra = cube.show_pixels();
+    server.spectra_map = std::make_unique<data_map>(cube.show_map(std::vector<double>(cube.show_pixels(), 0)));
+}
+
+/**
+ * @brief Reads the directory once into a spectrum_cube, reorders it by energy and answers map requests from the standard input or a Unix socket until it is stopped.
+ *
+ * @param files Paths to the data files.
+ * @param threads Amount of worker threads.
+ * @param cache Path to the binary cache of the directory, empty if no cache is used.
+ * @param channel "stdin" to read the requests from the standard input, otherwise the path of the Unix socket.
+ * @param settings Colormap of the bitmaps until a request changes it, storage precision, alignment, background and principal components of the spectra.
+ */
+void run_server(const std::vector<fs::path> &files, const unsigned &threads, const fs::path &cache, const std::string &channel, const map_request &settings)
+{
+    map_server server;
+    server.threads = threads;
+    server.colormap = settings.colormap;
+    // Progress messages go to the standard error, the standard output of the stdin server only has answers.
+    std::streambuf *console = std::cout.rdbuf(std::cerr.rdbuf());
+    try
+    {
+        if (settings.single_precision)
+            load_server<float>(server, files, cache, settings);
+        else
+            load_server<double>(server, files, cache, settings);
+    }
+    catch (...)
+    {
+        std::cout.rdbuf(console);
+        throw;
+    }
+    std::cout.rdbuf(console);
+
+    std::signal(SIGINT, request_stop);
+    std::signal(SIGTERM, request_stop);
+    if (channel == "stdin")
+        serve_stdin(server);
+    else
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        serve_socket(server, channel);
+#else
+        throw std::invalid_argument("Unix sockets are not available in this system, use --serve stdin");
+#endif
+    }
+    std::signal(SIGINT, SIG_DFL);
+    std::signal(SIGTERM, SIG_DFL);
+}
+
+/**
+ * @brief Writes the report of --profile when the program leaves main, also after an error: a table in the console if the value of the option is "table", or a Chrome trace
+ * in the file named by the option otherwise.
+ */
+struct profile_report
+{
+    std::string destination;
+
+    ~profile_report()
+    {
+        if (destination.empty())
+            return;
+        try
+        {
+            if (destination == "table")
+                profiler::instance().write_table(std::cout);
+            else
+            {
+                profiler::instance().write_trace(destination);
+                std::cout << "Created profile: " << destination << '\n';
+            }
+        }
+        catch (std::exception const &e)
+        {
+            std::cout << e.what() << '\n';
+        }
+    }
+};
+
 int main(int argc, char *argv[])
 {
     try
     {
-        if (argc == 1)
+        std::map<std::string, std::string> options;
+        std::vector<char *> positional = parse_options(argc, argv, options);
+        argc = static_cast<int>(positional.size());
+        argv = positional.data();
+        profile_report report;
+        if (options.contains("profile"))
+        {
+            report.destination = options.at("profile");
+            profiler::instance().enable();
+        }
+        unsigned threads = read_threads(options);
+        bool energy_series = options.contains("energies") or options.contains("sweep");
+        if (options.contains("energies") and options.contains("sweep"))
+            throw std::invalid_argument("Use either --energies or --sweep");
+        fs::path cache = options.contains("cache") ? fs::path(options.at("cache")) : fs::path();
+        int energy_argument = energy_series ? 0 : 1;
+        bool watch = options.contains("watch");
+        if (watch and (energy_series or options.contains("cache")))
+            throw std::invalid_argument("--watch can not be used with --energies, --sweep or --cache");
+        double watch_interval = watch ? read_energy(options.at("watch")) : 0;
+        if (argc > 2 and !std::strcmp(argv[2], "frames") and !energy_series)
+            throw std::invalid_argument("The frames format needs a series of energies with --energies or --sweep");
+        if (watch and watch_interval <= 0)
+            throw std::invalid_argument("The interval of --watch must be a positive number of seconds");
+        std::string colormap = options.contains("colormap") ? options.at("colormap") : "orange";
+        // Unknown colormaps are reported before reading the directory.
+        make_colormap(colormap);
+        bool single_precision = read_single_precision(options);
+        std::vector<size_t> descriptors = read_descriptors(options);
+        std::vector<double> background = options.contains("background") ? read_range(options.at("background")) : std::vector<double>();
+        std::vector<double> alignment = options.contains("align") ? read_range(options.at("align")) : std::vector<double>();
+        uint64_t components = read_amount(options, "pca");
+        uint64_t classes = read_amount(options, "clusters");
+        if (watch and (!alignment.empty() or components > 0 or classes > 0))
+            throw std::invalid_argument("--align, --pca and --clusters need all the spectra in memory and can not be used with --watch");
+        if (classes > 0 and options.contains("serve"))
+            throw std::invalid_argument("--clusters writes its maps once and can not be used with --serve");
+        if (classes > class_colours and argc > 2 and std::strcmp(argv[2], "raw") and std::strcmp(argv[2], "npy"))
+            throw std::invalid_argument("--clusters can only show " + std::to_string(class_colours) + " classes in the bitmap, use the raw or npy formats for more classes");
+        // The alignment, the principal components and the classes use all the spectra at once, so they always need the cube.
+        bool cube_stages = !alignment.empty() or components > 0 or classes > 0;
+        if (!descriptors.empty() and (watch or options.contains("serve") or (argc > 2 and !std::strcmp(argv[2], "frames"))))
+            throw std::invalid_argument("--descriptors can not be used with --watch, --serve or the frames format");
+        if (!descriptors.empty() and argc > 3 and std::strcmp(argv[3], "integrated"))
+            throw std::invalid_argument("--descriptors needs the integrated mode, the channels set the window of the descriptors");
+
+        // Options shared by every mode; the energies, the channels and the title are added once the positional arguments are read.
+        map_request request;
+        if (argc > 2)
+            request.format = argv[2];
+        request.series = energy_series;
+        request.sweep = options.contains("sweep");
+        request.colormap = colormap;
+        request.single_precision = single_precision;
+        request.descriptors = descriptors;
+        request.background = background;
+        request.alignment = alignment;
+        request.components = components;
+        request.classes = classes;
+
+        if (options.contains("serve"))
+        {
+            if (argc != 2)
+                throw std::invalid_argument("Server syntax is: ./spectrumview + 'Path to directory' + --serve stdin or --serve socket_path");
+            if (energy_series or watch)
+                throw std::invalid_argument("--serve can not be used with --energies, --sweep or --watch");
+            std::vector<fs::path> myFiles = opendirectory(argv[1]);
+            remove_cache(myFiles, cache);
+            run_server(myFiles, threads, cache, options.at("serve"), request);
+        }
+        else if (argc == 1)
         {
             std::cout << "Welcome to spectrumview!" << '\n'
                       << '\n'
                       << "To create raw files and bitmap syntax is:" << '\n'
                       << "\n./spectrumview + 'Path to directory' + Format + Intensity mode + Output file name + Energy of interest" << '\n'
-                      << "\nFormat is: [all] to get all files, [raw] to get raw map file and handles, [grid] to get grid file and [bmp] to get bitmap." << '\n'
+                      << "\nFormat is: [all] to get all files, [raw] to get raw map file and handles, [grid] to get grid file, [bmp] to get bitmap and [npy] to get the raw map, the axis handles and the grid as NumPy files (with --energies, --sweep or --cache also the whole cube), [frames] to get a numbered BMP sequence over the energies of --energies or --sweep, all with the same normalization." << '\n'
                       << "\nIntensity mode is: [integrated] to add the intensities of a range of channels, its followed by the amount of energy channels or [Interpolated] to get the intensity at a specific energy." << '\n'
                       << "\nOutput file name will be modified with details of the energy and type of output" << '\n'
                       << "\nThe final value correspond to the energy of interest. " << '\n'
+                      << "\nOptional arguments: [--threads N] to read the files with N threads, [--energies first:last:step] or [--energies e1,e2,e3] to replace the energy of interest and get one map per energy, [--cache file] to keep a binary copy of the spectra for the next runs, [--sweep first:last] to get an integrated map at every channel of the range, [--colormap name] to colour the bitmap with orange, gray, viridis or inferno, [--watch seconds] to keep the outputs updated while new spectra arrive to the directory, [--profile table] or [--profile trace.json] to get the time, data and memory of every stage, [--precision float] to store the intensities in single precision and halve the memory of the spectra (double by default), [--descriptors list] with the integrated mode to get maps of integrated, peak-maximum, peak-energy, centroid and/or fwhm within the window, e.g. --descriptors peak-energy,fwhm, [--background first:last] to fit a power law A*E^-r in the pre-edge window of every spectrum and subtract it before the extraction, [--align first:last] to align the zero-loss peak of every spectrum within the window and get the map of the shifts, [--pca k] to denoise the spectra with their first k principal components and get the loadings and score maps, [--clusters k] to classify the spectra in k classes with k-means and get the class map and the centroid spectra (at most " << class_colours << " classes with the bitmap formats)." << '\n'
+                      << "\nServer mode: ./spectrumview + 'Path to directory' + --serve stdin or --serve socket_path keeps the spectra in memory and answers requests like 'interpolated 0.035 title' or 'integrated 0.035 2 title', one per line." << '\n'
                       << "\nExample:" << '\n'
-                      << "\n./spectrumview 'C:/Users/Scientist/EELS' all integrated 2 EELS_Spectrum_map 0.035" << '\n';
+                      << "\n./spectrumview 'C:/Users/Scientist/EELS' all integrated 2 EELS_Spectrum_map 0.035" << '\n'
+                      << "\n./spectrumview 'C:/Users/Scientist/EELS' bmp interpolated EELS_Spectrum_map --energies 0.02:0.20:0.005" << '\n';
         }
-        else if (argc > 1 and argc < 6)
+        else if (argc > 1 and argc < 5 + energy_argument)
         {
             std::cout << "Not enough arguments to run the program" << '\n'
                       << "To create raw files and bitmap syntax is:" << '\n'
                       << "\n./spectrumview + 'Path to directory' + Format + Intensity mode + Output file name + Energy of interest" << '\n'
                       << "\nWrite ./spectrumview to get a command line example or read the documentation " << '\n';
-            exit(0);
+            return 0;
         }
-        else if (argc == 6 and !std::strcmp(argv[3], "interpolated"))
+        else if (argc == 5 + energy_argument and !std::strcmp(argv[3], "interpolated"))
         {
-
-            std::string energy = argv[5];
-            for (std::string::iterator c = energy.begin(); c < energy.end(); c++)
-            {
-                if (!isdigit(*c))
-                {
-                    if (*c != '.')
-                        throw std::invalid_argument("Energy must be a float or an integer");
-                }
-            }
+            check_format(argv[2]);
+            if (options.contains("sweep"))
+                throw std::invalid_argument("--sweep can only be used with the integrated mode");
+            std::vector<double> energies = energy_series ? read_energies(options.at("energies")) : std::vector<double>{read_energy(argv[5])};
             std::vector<fs::path> myFiles = opendirectory(argv[1]);
-            std::map<std::tuple<double, double>, double> mapfilling;
-            std::set<std::tuple<double, double>> coordinate_list;
-
-            for (std::vector<fs::path>::iterator i = myFiles.begin(); i < myFiles.end(); i++)
-            {
-                spectrum current_spectrum(*i);
-                double extracted_intensity = current_spectrum.interpolated_intensity(std::stod(argv[5]));
-                std::tuple<double, double> coordinates = std::make_tuple(current_spectrum.show_position("x"), current_spectrum.show_position("y"));
-                if (mapfilling.contains(coordinates))
-                {
-                    std::cout << "Two files found for the same position. Make sure directory only has one file per position.";
-                    exit(0);
-                }
-                else
-                {
-                    coordinate_list.insert(coordinates);
-                    mapfilling[coordinates] = extracted_intensity;
-                }
-            }
-
+            remove_cache(myFiles, cache);
             std::string project_title = argv[4];
-            data_map spectra_map(coordinate_list, mapfilling);
+            request.energies = energies;
+            request.project_title = project_title;
 
-            if (!std::strcmp(argv[2], "raw") or !std::strcmp(argv[2], "all"))
+            if (watch)
             {
-                std::string raw_title = project_title + "-raw";
-                std::vector<double> map = spectra_map.show_raw();
-                uint32_t width = spectra_map.show_dimensions("width");
-                std::cout << "Raw width is: " << width << '\n';
-                uint32_t height = spectra_map.show_dimensions("length");
-                std::cout << "Raw height is: " << height << '\n';
-                external_plot(map, width, height, raw_title);
-                std::vector<double> x = spectra_map.show_axis("x");
-                std::vector<double> y = spectra_map.show_axis("y");
-                external_plot_axis(x, y, raw_title);
+                watch_directory(argv[1], threads, watch_interval, request);
+                return 0;
             }
-            if (!std::strcmp(argv[2], "grid") or !std::strcmp(argv[2], "all") or !std::strcmp(argv[2], "bmp"))
+            if (energy_series or !cache.empty() or cube_stages)
             {
-                std::string grid_title = project_title + "-grid";
-                std::vector<double> formatted_map = spectra_map.show_formatted_grid();
-                uint32_t width = spectra_map.show_formatted_dimensions("width");
-                std::cout << "Formatted width is: " << width << '\n';
-                uint32_t height = spectra_map.show_formatted_dimensions("length");
-                std::cout << "Formatted height is:" << height << '\n';
-                if (!std::strcmp(argv[2], "grid") or !std::strcmp(argv[2], "all"))
-                    external_plot(formatted_map, width, height, grid_title);
-                if (!std::strcmp(argv[2], "bmp") or !std::strcmp(argv[2], "all"))
-                    build_bitmap(formatted_map, width, height, project_title);
+                write_energy_series(myFiles, threads, cache, request);
+                return 0;
             }
-            else
-                throw std::invalid_argument("Specified format not identified. Allowed format is: all, grid, raw, bmp");
-        }
-        else if (argc == 7 and !std::strcmp(argv[3], "integrated"))
-        {
 
-            std::string energy = argv[6];
-            for (std::string::iterator c = energy.begin(); c < energy.end(); c++)
+            std::vector<double> x;
+            std::vector<double> y;
+            std::vector<double> intensity;
+            double requested_energy = energies[0];
+            std::chrono::steady_clock::time_point ingest_start = std::chrono::steady_clock::now();
+            background_subtraction subtract_background;
+            subtract_background.window = background;
+            auto extract = [&](auto &current_spectrum)
             {
-                if (!isdigit(*c))
-                {
-                    if (*c != '.')
-                        throw std::invalid_argument("Energy must be a float or an integer");
-                }
-            }
+                subtract_background(current_spectrum);
+                return current_spectrum.interpolated_intensity(requested_energy);
+            };
+            std::vector<extracted_point> points = single_precision ? extract_directory<float>(myFiles, threads, extract) : extract_directory<double>(myFiles, threads, extract);
+            uint64_t bytes_read = fill_map(points, x, y, intensity);
+            report_throughput(myFiles.size(), bytes_read, ingest_start);
+            subtract_background.report(points.size());
+
+            data_map spectra_map(x, y, intensity);
+            write_map(spectra_map, argv[2], project_title, threads, colormap);
+        }
+        else if (argc == 6 + energy_argument and !std::strcmp(argv[3], "integrated"))
+        {
+            check_format(argv[2]);
+            std::vector<double> energies;
+            if (options.contains("sweep"))
+                energies = read_range(options.at("sweep"));
+            else
+                energies = energy_series ? read_energies(options.at("energies")) : std::vector<double>{read_energy(argv[6])};
             std::string channel = argv[4];
             for (std::string::iterator c = channel.begin(); c < channel.end(); c++)
             {
-                if (!isdigit(*c))
+                if (!isdigit(static_cast<unsigned char>(*c)))
                 {
                     throw std::invalid_argument("channel must be an integer");
                 }
             }
+            uint64_t channels = std::stoull(argv[4]);
             std::vector<fs::path> myFiles = opendirectory(argv[1]);
-            std::map<std::tuple<double, double>, double> mapfilling;
-            std::set<std::tuple<double, double>> coordinate_list;
-            for (std::vector<fs::path>::iterator i = myFiles.begin(); i < myFiles.end(); i++)
-            {
-                spectrum current_spectrum(*i);
-                double extracted_intensity = current_spectrum.integrated_intensity(std::stod(argv[6]), std::stoull(argv[4]));
-                std::tuple<double, double> coordinates = std::make_tuple(current_spectrum.show_position("x"), current_spectrum.show_position("y"));
-                if (mapfilling.contains(coordinates))
-                {
-                    std::cout << "Two files found for the same position. Make sure directory only has one file per position.";
-                    exit(0);
-                }
-                else
-                {
-                    coordinate_list.insert(coordinates);
-                    mapfilling[coordinates] = extracted_intensity;
-                }
-            }
-
+            remove_cache(myFiles, cache);
             std::string project_title = argv[5];
-            data_map spectra_map(coordinate_list, mapfilling);
+            request.energies = energies;
+            request.channels = channels;
+            request.integrated = true;
+            request.project_title = project_title;
 
-            if (!std::strcmp(argv[2], "raw") or !std::strcmp(argv[2], "all"))
+            if (watch)
             {
-                std::string raw_title = project_title + "-raw";
-                std::vector<double> map = spectra_map.show_raw();
-                uint64_t width = spectra_map.show_dimensions("width");
-                std::cout << "Raw width is: " << width << '\n';
-                uint64_t height = spectra_map.show_dimensions("length");
-                std::cout << "Raw height is: " << height << '\n';
-                external_plot(map, width, height, raw_title);
-                std::vector<double> x = spectra_map.show_axis("x");
-                std::vector<double> y = spectra_map.show_axis("y");
-                external_plot_axis(x, y, raw_title);
+                watch_directory(argv[1], threads, watch_interval, request);
+                return 0;
+            }
+            if (energy_series or !cache.empty() or cube_stages)
+            {
+                write_energy_series(myFiles, threads, cache, request);
+                return 0;
             }
 
-            if (!std::strcmp(argv[2], "grid") or !std::strcmp(argv[2], "all") or !std::strcmp(argv[2], "bmp"))
+            std::vector<double> x;
+            std::vector<double> y;
+            std::vector<double> intensity;
+            double requested_energy = energies[0];
+            std::chrono::steady_clock::time_point ingest_start = std::chrono::steady_clock::now();
+            background_subtraction subtract_background;
+            subtract_background.window = background;
+            if (!descriptors.empty())
             {
-                std::string grid_title = project_title + "-grid";
-                std::vector<double> formatted_map = spectra_map.show_formatted_grid();
-                uint64_t width = spectra_map.show_formatted_dimensions("width");
-                std::cout << "Formatted width is: " << width << '\n';
-                uint64_t height = spectra_map.show_formatted_dimensions("length");
-                std::cout << "Formatted height is:" << height << '\n';
-                if (!std::strcmp(argv[2], "grid") or !std::strcmp(argv[2], "all"))
-                    external_plot(formatted_map, width, height, grid_title);
-                if (!std::strcmp(argv[2], "bmp") or !std::strcmp(argv[2], "all"))
-                    build_bitmap(formatted_map, width, height, project_title);
+                // Every file is read once and all the descriptors are computed in the same pass over its spectrum.
+                auto describe_spectrum = [&](auto &current_spectrum)
+                {
+                    subtract_background(current_spectrum);
+                    return describe(current_spectrum, requested_energy, channels, descriptors);
+                };
+                std::vector<basic_extracted_point<std::array<double, 5>>> points = single_precision ? extract_directory<float>(myFiles, threads, describe_spectrum) : extract_directory<double>(myFiles, threads, describe_spectrum);
+                std::vector<std::array<double, 5>> described;
+                uint64_t bytes_read = fill_map(points, x, y, described);
+                report_throughput(myFiles.size(), bytes_read, ingest_start);
+                subtract_background.report(points.size());
+
+                std::array<std::vector<double>, 5> values;
+                for (std::vector<size_t>::const_iterator d = descriptors.begin(); d < descriptors.end(); d++)
+                {
+                    values[*d].resize(described.size());
+                    for (size_t i = 0; i < described.size(); i++)
+                        values[*d][i] = described[i][*d];
+                }
+                std::unique_ptr<data_map> spectra_map;
+                auto make_map = [&](const std::vector<double> &intensity_fill)
+                {
+                    return data_map(x, y, intensity_fill);
+                };
+                write_descriptor_maps(spectra_map, make_map, values, project_title, request, threads);
+                return 0;
             }
-            else
-                throw std::invalid_argument("Specified format not identified. Allowed format is: all, grid, raw, bmp");
+            auto extract = [&](auto &current_spectrum)
+            {
+                subtract_background(current_spectrum);
+                return current_spectrum.integrated_intensity(requested_energy, channels);
+            };
+            std::vector<extracted_point> points = single_precision ? extract_directory<float>(myFiles, threads, extract) : extract_directory<double>(myFiles, threads, extract);
+            uint64_t bytes_read = fill_map(points, x, y, intensity);
+            report_throughput(myFiles.size(), bytes_read, ingest_start);
+            subtract_background.report(points.size());
+
+            data_map spectra_map(x, y, intensity);
+            write_map(spectra_map, argv[2], project_title, threads, colormap);
         }
         else
         {
@@ -190,7 +1638,7 @@ int main(int argc, char *argv[])
                       << "Make sure that there is no additional arguments on your instruction" << '\n'
                       << "Modes can only be interpolated or integrated" << '\n'
                       << "Run the program without command lines to see an example or check the documentation" << '\n';
-            exit(0);
+            return 0;
         }
     }
     catch (std::invalid_argument const &e)